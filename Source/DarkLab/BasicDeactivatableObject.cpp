@@ -1,6 +1,8 @@
 // Fill out your copyright notice in the Description page of Project Settings.
 
 #include "BasicDeactivatableObject.h"
+#include "Components/PrimitiveComponent.h"
+#include "Components/LightComponent.h"
 
 // Activates/deactivates the object (usually for pooling)
 void ABasicDeactivatableObject::SetActive_Implementation(const bool active)
@@ -10,11 +12,117 @@ void ABasicDeactivatableObject::SetActive_Implementation(const bool active)
 
 	bIsActive = active;
 
+	// Pooled objects are never culled
+	SetCulled(false);
+
+	// Parked objects were never hidden
+	if (bIsParked)
+	{
+		bIsParked = false;
+		for (ULightComponent* light : ParkedLights)
+			if (light)
+				light->SetAffectsWorld(true);
+		ParkedLights.Empty();
+		if (bDefaultTickEnabled)
+			SetActorTickEnabled(active);
+		return;
+	}
+
 	SetActorHiddenInGame(!active);
 	SetActorEnableCollision(active);
 	if (bDefaultTickEnabled)
 		SetActorTickEnabled(active);
 }
+// Deactivates the object by moving it away without hiding it or disabling collision, SetActive(true) activates it again
+void ABasicDeactivatableObject::Park(const FVector location)
+{
+	if (!bIsActive)
+		return;
+
+	bIsActive = false;
+	bIsParked = true;
+	SetCulled(false);
+
+	// Lights would still be drawn and shadowed below the laboratory, their visibility is their state so it's not changed
+	TInlineComponentArray<ULightComponent*> lights(this);
+	for (ULightComponent* light : lights)
+	{
+		if (!light->bAffectsWorld)
+			continue;
+		light->SetAffectsWorld(false);
+		ParkedLights.Add(light);
+	}
+
+	SetActorLocation(location, false, nullptr, ETeleportType::TeleportPhysics);
+	if (bDefaultTickEnabled)
+		SetActorTickEnabled(false);
+}
+// Returns true if the object is parked
+bool ABasicDeactivatableObject::IsParked() const
+{
+	return bIsParked;
+}
+// Stops drawing the object, its lights and its tick without changing its state, SetCulled(false) undoes it
+void ABasicDeactivatableObject::SetCulled(const bool culled)
+{
+	// Inactive objects are already hidden or parked
+	if (bIsCulled == culled || (culled && !bIsActive))
+		return;
+
+	bIsCulled = culled;
+
+	if (culled)
+	{
+		// Components that are already hidden stay as they are
+		TInlineComponentArray<UPrimitiveComponent*> primitives(this);
+		for (UPrimitiveComponent* primitive : primitives)
+		{
+			if (primitive->bHiddenInGame)
+				continue;
+			primitive->SetHiddenInGame(true);
+			CulledPrimitives.Add(primitive);
+		}
+
+		// Visibility of lights is their state (lamps are on if the light is visible), so it's not changed
+		TInlineComponentArray<ULightComponent*> lights(this);
+		for (ULightComponent* light : lights)
+		{
+			if (!light->bAffectsWorld)
+				continue;
+			light->SetAffectsWorld(false);
+			CulledLights.Add(light);
+		}
+	}
+	else
+	{
+		for (UPrimitiveComponent* primitive : CulledPrimitives)
+			if (primitive)
+				primitive->SetHiddenInGame(false);
+		for (ULightComponent* light : CulledLights)
+			if (light)
+				light->SetAffectsWorld(true);
+		CulledPrimitives.Empty();
+		CulledLights.Empty();
+	}
+
+	if (bDefaultTickEnabled && bIsActive)
+		SetActorTickEnabled(!culled);
+}
+// Returns true if the object is culled
+bool ABasicDeactivatableObject::IsCulled() const
+{
+	return bIsCulled;
+}
+// Returns the number of primitives and lights culling stopped drawing
+int ABasicDeactivatableObject::GetNumCulledPrimitives() const
+{
+	return CulledPrimitives.Num();
+}
+int ABasicDeactivatableObject::GetNumCulledLights() const
+{
+	return CulledLights.Num();
+}
+
 // Returns true if the object is active
 bool ABasicDeactivatableObject::IsActive_Implementation()
 {
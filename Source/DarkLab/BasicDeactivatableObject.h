@@ -7,6 +7,14 @@
 #include "Deactivatable.h"
 #include "BasicDeactivatableObject.generated.h"
 
+// How pooled objects are deactivated
+UENUM(BlueprintType)
+enum class EPoolingStrategyEnum : uint8
+{
+	VE_Hide 	UMETA(DisplayName = "Hide"),
+	VE_Park 	UMETA(DisplayName = "Park")
+};
+
 // Represents objects with physical representation that can be activated/deactivated
 UCLASS()
 class DARKLAB_API ABasicDeactivatableObject : public AActor, public IDeactivatable
@@ -24,12 +32,42 @@ public:
 	bool IsActive();
 	virtual bool IsActive_Implementation() override;
 
+	// Deactivates the object by moving it away without hiding it or disabling collision, SetActive(true) activates it again
+	// Keeps render and physics state of its meshes, its lights stop affecting the world, which recreates their render state
+	void Park(const FVector location);
+	// Returns true if the object is parked
+	bool IsParked() const;
+
+	// Stops drawing the object, its lights and its tick without changing its state, SetCulled(false) undoes it
+	// Lights only stop affecting the world, so they are still visible to light level queries
+	void SetCulled(const bool culled);
+	// Returns true if the object is culled
+	bool IsCulled() const;
+	// Returns the number of primitives and lights culling stopped drawing
+	int GetNumCulledPrimitives() const;
+	int GetNumCulledLights() const;
+
 protected:
 	UPROPERTY()
 	bool bIsActive = true;
 
 	UPROPERTY()
 	bool bDefaultTickEnabled = false;
+
+	// True if the object was deactivated with Park
+	UPROPERTY()
+	bool bIsParked = false;
+	// Lights parking stopped drawing, only these are restored
+	UPROPERTY()
+	TArray<class ULightComponent*> ParkedLights;
+
+	// True if the object was culled with SetCulled
+	bool bIsCulled = false;
+	// Components culling changed, only these are restored
+	UPROPERTY()
+	TArray<class UPrimitiveComponent*> CulledPrimitives;
+	UPROPERTY()
+	TArray<class ULightComponent*> CulledLights;
 	
 public:	
 	// Sets default values
@@ -37,6 +37,7 @@ void ABasicDoor::ActivateObject(AMainCharacter * character)
 
 		// UE_LOG(LogTemp, Warning, TEXT("Opened %s"), *(Name.ToString()));
 		DoorDriver->Play();
+		NotifyGameModeOfMovement();
 	}
 	else if (!bIsExit && (DoorDriver->GetPlaybackPosition() == DoorDriver->GetTimelineLength() || DoorDriver->IsPlaying())) // We can't close exit door
 	{
@@ -44,9 +45,28 @@ void ABasicDoor::ActivateObject(AMainCharacter * character)
 
 		// UE_LOG(LogTemp, Warning, TEXT("Closed %s"), *(Name.ToString()));
 		DoorDriver->Reverse();
+		NotifyGameModeOfMovement();
 	}
 }
 
+// Returns true if the door is opening or closing
+bool ABasicDoor::IsMoving() const
+{
+	return DoorDriver && DoorDriver->IsPlaying();
+}
+// Returns true if the door is fully closed and nothing can be seen through it
+bool ABasicDoor::IsClosed() const
+{
+	return DoorDriver && !DoorDriver->IsPlaying() && DoorDriver->GetPlaybackPosition() == 0.0f;
+}
+// Lets game mode know that light can now pass differently
+void ABasicDoor::NotifyGameModeOfMovement()
+{
+	AMainGameMode* gameMode = Cast<AMainGameMode>(GetWorld()->GetAuthGameMode());
+	if (gameMode)
+		gameMode->OnDoorMoved(this);
+}
+
 // TODO let some interface define it?
 // Resets to initial state
 void ABasicDoor::ResetDoor(bool isExit)
@@ -94,12 +114,18 @@ ABasicDoor::ABasicDoor()
 	bActivatableIndirectly = true;
 }
 
-// Called when the game starts or when spawned
-void ABasicDoor::BeginPlay()
+// Called after properties are initialized, before the object is placed
+void ABasicDoor::PostInitProperties()
 {
-	Super::BeginPlay();
+	Super::PostInitProperties();
 
 	// Set size
-	// Gets overridden if done in constructor for some reason
+	// Gets overridden by blueprint defaults if done in constructor, and placing new objects needs it before BeginPlay
 	BaseSize = FIntVector(4, 1, 5);
+}
+
+// Called when the game starts or when spawned
+void ABasicDoor::BeginPlay()
+{
+	Super::BeginPlay();
 }
\ No newline at end of file
@@ -22,6 +22,13 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "Door")
 	void ResetDoor(bool isExit);
 
+	// Returns true if the door is opening or closing
+	UFUNCTION(BlueprintCallable, Category = "Door")
+	bool IsMoving() const;
+	// Returns true if the door is fully closed and nothing can be seen through it
+	UFUNCTION(BlueprintCallable, Category = "Door")
+	bool IsClosed() const;
+
 	// Called when opening
 	UFUNCTION(BlueprintImplementableEvent, Category = "Door")
 	void OnOpen();
@@ -51,6 +58,9 @@ protected:
 	// If true, this is an exit door
 	bool bIsExit = false;
 
+	// Lets game mode know that light can now pass differently
+	void NotifyGameModeOfMovement();
+
 public:
 	// The color of panels on the door
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Door")
@@ -60,6 +70,9 @@ public:
 	// Sets default values
 	ABasicDoor();
 
+	// Called after properties are initialized, before the object is placed
+	virtual void PostInitProperties() override;
+
 protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
@@ -4,6 +4,12 @@
 #include "Components/ArrowComponent.h"
 #include "Components/StaticMeshComponent.h"
 
+// Returns the floor's shape
+UStaticMeshComponent * ABasicFloor::GetFloorMesh() const
+{
+	return Floor;
+}
+
 // Sets default values
 ABasicFloor::ABasicFloor()
 {
@@ -22,6 +22,9 @@ protected:
 	class UStaticMeshComponent* Floor;
 
 public:
+	// Returns the floor's shape
+	class UStaticMeshComponent* GetFloorMesh() const;
+
 	// Sets default values
 	ABasicFloor();
 };
\ No newline at end of file
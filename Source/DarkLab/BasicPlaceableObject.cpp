@@ -53,8 +53,52 @@ void ABasicPlaceableObject::Place_Implementation(const FIntVector botLeftLoc, co
 	location.Z = ZOffset;
 	SetActorLocation(location); //, false, nullptr, ETeleportType::TeleportPhysics);
 
-	float rotation;
-	switch (GridDirection)
+	SetActorRotation(GetGridRotation(GridDirection));
+}
+// Returns the transform SetSize followed by Place would give the object
+FTransform ABasicPlaceableObject::GetPlacementTransform(const FIntVector botLeftLoc, const EDirectionEnum direction, const FIntVector size) const
+{
+	// Same scale as SetSize and SetSizeXY set
+	FVector scale = GetActorScale3D();
+	if (size.X >= 1 && size.Y >= 1)
+	{
+		scale.X = size.Y * 1.0f / BaseSize.Y;
+		scale.Y = size.X * 1.0f / BaseSize.X;
+	}
+	if (size.Z >= 1)
+		scale.Z = size.Z * 1.0f / BaseSize.Z;
+
+	// Same size as GetSize returns after direction is set
+	int gridSizeX, gridSizeY;
+	if (direction == EDirectionEnum::VE_Up || direction == EDirectionEnum::VE_Down)
+	{
+		gridSizeX = BaseSize.X * scale.Y;
+		gridSizeY = BaseSize.Y * scale.X;
+	}
+	else
+	{
+		gridSizeX = BaseSize.Y * scale.X;
+		gridSizeY = BaseSize.X * scale.Y;
+	}
+
+	FVector location;
+	AMainGameMode::GridToWorld(botLeftLoc.X, botLeftLoc.Y, gridSizeX, gridSizeY, location.X, location.Y);
+	location.Z = ZOffset;
+
+	return FTransform(GetGridRotation(direction), location, scale);
+}
+// Does the same as SetSize followed by Place, but sets the transform once
+void ABasicPlaceableObject::PlaceAtOnce(const FIntVector botLeftLoc, const EDirectionEnum direction, const FIntVector size)
+{
+	FTransform transform = GetPlacementTransform(botLeftLoc, direction, size);
+	GridDirection = direction;
+	SetActorTransform(transform);
+}
+// Returns the rotation of an object facing the direction
+FQuat ABasicPlaceableObject::GetGridRotation(const EDirectionEnum direction)
+{
+	float rotation = 0;
+	switch (direction)
 	{
 	case EDirectionEnum::VE_Up:
 		rotation = 0;
@@ -70,5 +114,5 @@ void ABasicPlaceableObject::Place_Implementation(const FIntVector botLeftLoc, co
 		break;
 	}
 
-	SetActorRotation(FQuat(FVector(0,0,1), FMath::DegreesToRadians(rotation)));
+	return FQuat(FVector(0,0,1), FMath::DegreesToRadians(rotation));
 }
\ No newline at end of file
@@ -34,6 +34,14 @@ public:
 	void Place(const FIntVector botLeftLoc, const EDirectionEnum direction);
 	virtual void Place_Implementation(const FIntVector botLeftLoc, const EDirectionEnum direction) override;
 
+	// Returns the transform SetSize followed by Place would give the object
+	// Size X or Y below 1 keeps the current width and length like Place alone, size Z below 1 keeps the current height like SetSizeXY
+	FTransform GetPlacementTransform(const FIntVector botLeftLoc, const EDirectionEnum direction, const FIntVector size = FIntVector(0, 0, 0)) const;
+	// Does the same as SetSize followed by Place, but sets the transform once
+	void PlaceAtOnce(const FIntVector botLeftLoc, const EDirectionEnum direction, const FIntVector size = FIntVector(0, 0, 0));
+	// Returns the rotation of an object facing the direction
+	static FQuat GetGridRotation(const EDirectionEnum direction);
+
 protected:
 	UPROPERTY()
 	FIntVector BaseSize = FIntVector(1, 1, 1);
@@ -4,6 +4,12 @@
 #include "Components/ArrowComponent.h"
 #include "Components/StaticMeshComponent.h"
 
+// Returns the wall's shape
+UStaticMeshComponent * ABasicWall::GetWallMesh() const
+{
+	return Wall;
+}
+
 // Sets default values
 ABasicWall::ABasicWall()
 {
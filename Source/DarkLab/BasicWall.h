@@ -22,6 +22,9 @@ protected:
 	class UStaticMeshComponent* Wall;
 
 public:
+	// Returns the wall's shape
+	class UStaticMeshComponent* GetWallMesh() const;
+
 	// Sets default values
 	ABasicWall();
 };
\ No newline at end of file
@@ -3,5 +3,9 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "Stats/Stats.h"
 
-DECLARE_LOG_CATEGORY_EXTERN(LogDarkLab, Log, All);
\ No newline at end of file
+DECLARE_LOG_CATEGORY_EXTERN(LogDarkLab, Log, All);
+
+// Game specific stats, shown with "stat DarkLab"
+DECLARE_STATS_GROUP(TEXT("DarkLab"), STATGROUP_DarkLab, STATCAT_Advanced);
\ No newline at end of file
@@ -5,8 +5,23 @@
 #include "Components/SphereComponent.h"
 #include "GameFramework/FloatingPawnMovement.h"
 #include "DarknessController.h"
+#include "DarknessManager.h"
 #include "MainCharacter.h"
 #include "MainGameMode.h"
+#include "LabScalability.h"
+#include "HAL/IConsoleManager.h"
+
+// Console variables
+static TAutoConsoleVariable<int32> CVarDarknessLightLOD(
+	TEXT("lab.Darkness.LightLOD"),
+	1,
+	TEXT("If 1, darkness checks light less often and less precisely when far from lights and the player"),
+	ECVF_Default);
+static TAutoConsoleVariable<int32> CVarDarknessPathfinding(
+	TEXT("lab.Darkness.Pathfinding"),
+	1,
+	TEXT("If 1, darkness follows paths through rooms instead of moving straight to its target"),
+	ECVF_Default);
 
 // Movement functions
 void ADarkness::Move(const FVector direction)
@@ -18,9 +33,7 @@ void ADarkness::Move(const FVector direction)
 		return;
 
 	// Moves slower in light, but light resistance helps
-	// float temp = 1 - LightFearK * Luminosity * FMath::Max(0.0f, Luminosity - LightResistance);
-	float temp = 1 - 2 * FMath::Max(0.f, Luminosity - LightResistance / 2.f) / (LightResistance + 0.2f);
-	Movement->AddInputVector(direction * FMath::Max(0.0f, temp));
+	Movement->AddInputVector(direction * FMath::Max(0.0f, GetLightPush()));
 }
 void ADarkness::MoveToLocation(FVector location)
 {
@@ -53,15 +66,12 @@ bool ADarkness::RetreatFromLight()
 	UE_LOG(LogTemp, Warning, TEXT("Darkness::RetreatFromLight"));
 
 	// Retreats faster in brighter light, but resistance helps
-	// float temp = 1 - LightFearK * Luminosity * FMath::Max(0.0f, Luminosity - LightResistance);
-	// float temp = 1 - Luminosity / (LightResistance + 0.1f);
-	float temp = 1 - 2 * FMath::Max(0.f, Luminosity - LightResistance / 2.f) / (LightResistance + 0.2f);
+	float temp = GetLightPush();
 	if (temp >= 0)
 		return false; // Doesn't retreat
 	
-	// Away from brightest light
-	FVector fleeDirection = GetActorLocation() - BrightestLightLocation;
-	fleeDirection.Normalize();
+	// Towards darker rooms or away from brightest light
+	FVector fleeDirection = GetFleeDirection();
 	Movement->AddInputVector(fleeDirection * temp * -1); // temo is lower than 0 at this point
 	
 	return true; // Does retreat
@@ -86,24 +96,250 @@ void ADarkness::Tracking()
 		break;
 	}
 
-	FVector direction = currentLocation - GetActorLocation();
-
 	// We don't move if objects are already close
 	// TODO delete magic number
-	if (direction.Size() < 20.0f)
+	if ((currentLocation - GetActorLocation()).Size() < 20.0f)
 		return;
 
+	FVector direction = GetPathWaypoint(currentLocation) - GetActorLocation();
 	direction.Normalize();
 
 	Move(direction);
 }
+// Returns where to move to get to the location, going through passages if it's in another room
+FVector ADarkness::GetPathWaypoint(const FVector location)
+{
+	if (!GameMode || CVarDarknessPathfinding.GetValueOnGameThread() == 0)
+		return location;
+
+	FVector currentLocation = GetActorLocation();
+	LabRoomGraph& graph = GameMode->GetRoomGraph();
+	LabRoom* startRoom = graph.GetRoomAt(currentLocation);
+	LabRoom* goalRoom = graph.GetRoomAt(location);
+
+	// In the same room or outside of the lab we just go straight
+	if (!startRoom || !goalRoom || startRoom == goalRoom)
+		return location;
+
+	// Many hunters share one search towards the goal, a single one keeps its own path
+	if (DarknessManager && DarknessManager->GetNumHunters() > 1)
+	{
+		LabPassage* passage = graph.GetPassageTowards(goalRoom, startRoom);
+		return passage ? GetPassageWaypoint(passage, LabRoomGraph::GetOtherRoom(passage, startRoom)) : location;
+	}
+
+	const FRoomPathStruct* path = graph.FindCachedPath(this, startRoom, goalRoom);
+	if (!path || path->Passages.Num() == 0)
+		return location;
+
+	return GetPassageWaypoint(path->Passages[0], path->Rooms[1]);
+}
+// Returns where to move to go through the passage into the next room
+FVector ADarkness::GetPassageWaypoint(LabPassage * passage, LabRoom * nextRoom)
+{
+	FVector currentLocation = GetActorLocation();
+	FVector waypoint = AMainGameMode::GetPassageLocation(passage);
+	waypoint.Z = currentLocation.Z;
+
+	// Near the passage we aim into the next room so we don't stop on the wall line
+	if (FVector::Dist2D(currentLocation, waypoint) < PassageReachDistance)
+	{
+		FVector through = LabRoomGraph::GetRoomCenter(nextRoom) - waypoint;
+		through.Z = 0.f;
+		waypoint += through.GetSafeNormal() * PassageReachDistance * 2.f;
+	}
+
+	return waypoint;
+}
+
 // Goes away from last brightest light
 void ADarkness::IntoDarkness()
 {
+	// Towards darker rooms or away from brightest light
+	Move(GetFleeDirection());
+}
+// Returns true if there is no light around the darkness
+bool ADarkness::IsInDark() const
+{
+	return Luminosity <= 0;
+}
+// Returns direction to the neighbouring room furthest from light, or away from the brightest light if there is none
+FVector ADarkness::GetFleeDirection()
+{
+	FVector currentLocation = GetActorLocation();
+
+	// Rooms further from lit rooms are darker
+	if (GameMode && CVarDarknessPathfinding.GetValueOnGameThread() != 0)
+	{
+		LabRoomGraph& graph = GameMode->GetRoomGraph();
+		LabPassage* through = nullptr;
+		LabRoom* darkerRoom = graph.GetDarkerNeighbour(graph.GetRoomAt(currentLocation), through);
+		if (darkerRoom)
+		{
+			FVector direction = GetPassageWaypoint(through, darkerRoom) - currentLocation;
+			direction.Z = 0.f;
+			return direction.GetSafeNormal();
+		}
+	}
+
 	// Away from brightest light
-	FVector fleeDirection = GetActorLocation() - BrightestLightLocation;
+	FVector fleeDirection = currentLocation - BrightestLightLocation;
 	fleeDirection.Normalize();
-	Move(fleeDirection);
+	return fleeDirection;
+}
+
+// Checks the light level as precisely and as often as the query LOD needs
+void ADarkness::UpdateLuminosity(const float deltaTime)
+{
+	SinceLastLightQuery += deltaTime;
+
+	// The manager makes queries for all darkness at once
+	ELightQueryLODEnum lod;
+	if (!DarknessManager && NeedsLightQuery(lod))
+	{
+		FVector lightLocation;
+		float luminosity = QueryLight(lod, lightLocation);
+		ApplyLightQuery(lod, luminosity, lightLocation);
+		NotifyLightChanges();
+	}
+
+	InterpolateLuminosity();
+}
+// Moves luminosity towards the last query's result
+void ADarkness::InterpolateLuminosity()
+{
+	// Values change smoothly between queries
+	float alpha = LightQueryInterval > 0.f ? FMath::Clamp(SinceLastLightQuery / LightQueryInterval, 0.f, 1.f) : 1.f;
+	Luminosity = FMath::Lerp(PreviousLuminosity, TargetLuminosity, alpha);
+	BrightestLightLocation = FMath::Lerp(PreviousLightLocation, TargetLightLocation, alpha);
+}
+// Returns true if it's time for a new light query and the LOD it should use
+bool ADarkness::NeedsLightQuery(ELightQueryLODEnum & lod)
+{
+	lod = CVarDarknessLightLOD.GetValueOnGameThread() != 0 ? ChooseLightQueryLOD(GetLightSampleRadius()) : ELightQueryLODEnum::VE_Full;
+
+	// A new query is made when the interval passes or the LOD changes
+	return lod == ELightQueryLODEnum::VE_Full || lod != LightQueryLOD || SinceLastLightQuery >= LightQueryInterval;
+}
+// Makes a light query with the LOD, its result can be shared by darkness nearby
+float ADarkness::QueryLight(const ELightQueryLODEnum lod, FVector & lightLocation)
+{
+	lightLocation = TargetLightLocation;
+
+	// No light can reach the darkness
+	if (lod == ELightQueryLODEnum::VE_Skipped)
+		return 0.f;
+
+	TArray<FVector> locations;
+	GetLightSamplePoints(lod, locations);
+	return GameMode->GetLightingAmount(lightLocation, this, locations); // , false, bShowLightDebug);
+}
+// Returns the points a light query with the LOD samples
+void ADarkness::GetLightSamplePoints(const ELightQueryLODEnum lod, TArray<FVector>& locations) const
+{
+	switch (lod)
+	{
+	case ELightQueryLODEnum::VE_Full:
+	{
+		// Number of points depends on scalability
+		int samples = LabScalability::GetDarknessLightSamples();
+		AMainGameMode::GetSamplePointsAround(GetActorLocation(), locations, samples > 1, GetLightSampleRadius(), samples > 7);
+		break;
+	}
+	case ELightQueryLODEnum::VE_Reduced:
+		locations.Add(GetActorLocation());
+		break;
+	default:
+		break;
+	}
+}
+// Returns the location of the brightest light found by the last query
+FVector ADarkness::GetLastLightLocation() const
+{
+	return TargetLightLocation;
+}
+// Starts moving luminosity towards the query's result
+void ADarkness::ApplyLightQuery(const ELightQueryLODEnum lod, const float luminosity, const FVector lightLocation)
+{
+	PreviousLuminosity = Luminosity;
+	PreviousLightLocation = BrightestLightLocation;
+	TargetLuminosity = luminosity;
+	TargetLightLocation = lightLocation;
+	LightQueryLOD = lod;
+	LightQueryInterval = lod == ELightQueryLODEnum::VE_Full ? 0.f : ReducedLightQueryInterval;
+	SinceLastLightQuery = 0.f;
+}
+// Returns the time since the last light query
+float ADarkness::GetSinceLastLightQuery() const
+{
+	return SinceLastLightQuery;
+}
+// Returns the radius around the darkness in which light is sampled
+float ADarkness::GetLightSampleRadius() const
+{
+	return Collision->GetScaledSphereRadius() + 30;
+}
+// Returns how much light lets the darkness move, negative values push it back
+float ADarkness::GetLightPush() const
+{
+	// float temp = 1 - LightFearK * Luminosity * FMath::Max(0.0f, Luminosity - LightResistance);
+	// float temp = 1 - Luminosity / (LightResistance + 0.1f);
+	return GetLightPush(Luminosity);
+}
+float ADarkness::GetLightPush(const float luminosity) const
+{
+	return 1 - 2 * FMath::Max(0.f, luminosity - LightResistance / 2.f) / (LightResistance + 0.2f);
+}
+// Tells the controller when the last light query starts or stops light pushing the darkness back and when it enters or leaves the dark
+void ADarkness::NotifyLightChanges()
+{
+	if (!DarknessController)
+		return;
+
+	// Luminosity only moves towards the query's result, so the result is what decides
+	bool afraid = GetLightPush(TargetLuminosity) < 0;
+	if (afraid != bWasAfraid)
+	{
+		bWasAfraid = afraid;
+		DarknessController->OnLightFearChanged(afraid);
+	}
+
+	bool inDark = TargetLuminosity <= 0;
+	if (inDark != bWasInDark)
+	{
+		bWasInDark = inDark;
+		DarknessController->OnDarkChanged(inDark);
+	}
+}
+// Returns the query LOD for current situation
+ELightQueryLODEnum ADarkness::ChooseLightQueryLOD(const float sampleRadius)
+{
+	// Lights that can't reach any of the points don't need queries
+	FVector location = GetActorLocation();
+	bool lightInReach = false;
+	for (const FLightSampleStruct& light : GameMode->GetFrameLightSamples())
+	{
+		if (FVector::DistSquared(location, light.Location) < FMath::Square(light.Radius + sampleRadius))
+		{
+			lightInReach = true;
+			break;
+		}
+	}
+	if (!lightInReach)
+		return ELightQueryLODEnum::VE_Skipped;
+
+	// Full precision while hunting or being pushed back by light
+	if (!DarknessController || DarknessController->State == EDarkStateEnum::VE_Hunting || TargetLuminosity > LightResistance / 2.f)
+		return ELightQueryLODEnum::VE_Full;
+	if (DarknessController->State == EDarkStateEnum::VE_Passive)
+		return ELightQueryLODEnum::VE_Reduced;
+
+	// Darkness far from the player doesn't need precision
+	APlayerController* controller = GetWorld()->GetFirstPlayerController();
+	APawn* player = controller ? controller->GetPawn() : nullptr;
+	if (!player || FVector::Dist(location, player->GetActorLocation()) > ReducedLightQueryDistance)
+		return ELightQueryLODEnum::VE_Reduced;
+	return ELightQueryLODEnum::VE_Full;
 }
 
 // Reenables particles
@@ -118,7 +354,7 @@ void ADarkness::OnBeginOverlap(UPrimitiveComponent* OverlappedComp, AActor * Oth
 	// UE_LOG(LogTemp, Warning, TEXT("Entered the darkness!"));
 	
 	// Darkness is harmless when it isn't hunting
-	if (DarknessController->State != EDarkStateEnum::VE_Hunting)
+	if (!DarknessController || DarknessController->State != EDarkStateEnum::VE_Hunting)
 		return;
 
 	AMainCharacter* character = Cast<AMainCharacter>(OtherActor);
@@ -167,6 +403,34 @@ void ADarkness::BeginPlay()
 
 	GameMode = Cast<AMainGameMode>(GetWorld()->GetAuthGameMode());
 	DarknessController = Cast<ADarknessController>(GetController());
+
+	// All darkness is ticked together
+	DarknessManager = GameMode ? GameMode->GetDarknessManager() : nullptr;
+	if (DarknessManager)
+		DarknessManager->AddHunter(this);
+}
+
+// Called when actor is being removed from the play
+void ADarkness::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	Super::EndPlay(EndPlayReason);
+
+	if (GameMode)
+		GameMode->GetRoomGraph().ForgetCachedPath(this);
+	if (DarknessManager)
+		DarknessManager->RemoveHunter(this);
+}
+
+// Called when a controller takes over the darkness
+void ADarkness::PossessedBy(AController * NewController)
+{
+	Super::PossessedBy(NewController);
+
+	DarknessController = Cast<ADarknessController>(NewController);
+
+	// The new controller knows nothing yet
+	bWasAfraid = false;
+	bWasInDark = true;
 }
 
 // Called every frame
@@ -176,11 +440,16 @@ void ADarkness::Tick(const float deltaTime)
 
 	Super::Tick(deltaTime);
 
+	UpdateHunter(deltaTime);
+}
+// Updates luminosity, time in the dark and light resistance, managed darkness is updated by the manager instead of ticking
+void ADarkness::UpdateHunter(const float deltaTime)
+{
 	if (!bIsActive)
 		return;
 
-	// We check the light level	
-	Luminosity = GameMode->GetLightingAmount(BrightestLightLocation, this, true, Collision->GetScaledSphereRadius() + 30, true); // , false, bShowLightDebug);
+	// We check the light level
+	UpdateLuminosity(deltaTime);
 
 	// Calculate time in darkness
 	if (Luminosity > 0)
@@ -15,6 +15,15 @@ enum class ETrackingEnum : uint8
 	VE_Location	UMETA(DisplayName = "Location")
 };
 
+// Precision of darkness's light queries
+UENUM(BlueprintType)
+enum class ELightQueryLODEnum : uint8
+{
+	VE_Full 	UMETA(DisplayName = "Full"),
+	VE_Reduced 	UMETA(DisplayName = "Reduced"),
+	VE_Skipped	UMETA(DisplayName = "Skipped")
+};
+
 // The darkness that hunts the player
 UCLASS(Blueprintable)
 class DARKLAB_API ADarkness : public APawn
@@ -32,14 +41,51 @@ public:
 	bool RetreatFromLight();
 	// Tracks something
 	void Tracking();
+	// Returns where to move to get to the location, going through passages if it's in another room
+	FVector GetPathWaypoint(const FVector location);
+	// Returns where to move to go through the passage into the next room
+	FVector GetPassageWaypoint(class LabPassage* passage, class LabRoom* nextRoom);
+	// Returns direction to the neighbouring room furthest from light, or away from the brightest light if there is none
+	FVector GetFleeDirection();
 	// Goes away from last brightest light
 	void IntoDarkness();
+	// Returns true if there is no light around the darkness
+	bool IsInDark() const;
 
 	// Called after player finds black card
 	UFUNCTION(BlueprintImplementableEvent, Category = "Darkness")
 	void OnEnraged();
 
+	// Returns true if it's time for a new light query and the LOD it should use
+	bool NeedsLightQuery(ELightQueryLODEnum& lod);
+	// Makes a light query with the LOD, its result can be shared by darkness nearby
+	float QueryLight(const ELightQueryLODEnum lod, FVector& lightLocation);
+	// Returns the points a light query with the LOD samples
+	void GetLightSamplePoints(const ELightQueryLODEnum lod, TArray<FVector>& locations) const;
+	// Returns the location of the brightest light found by the last query
+	FVector GetLastLightLocation() const;
+	// Starts moving luminosity towards the query's result
+	void ApplyLightQuery(const ELightQueryLODEnum lod, const float luminosity, const FVector lightLocation);
+	// Returns the time since the last light query
+	float GetSinceLastLightQuery() const;
+	// Tells the controller when the last light query starts or stops light pushing the darkness back and when it enters or leaves the dark
+	void NotifyLightChanges();
+	// Updates luminosity, time in the dark and light resistance, managed darkness is updated by the manager instead of ticking
+	void UpdateHunter(const float deltaTime);
+
 private:
+	// Checks the light level as precisely and as often as the query LOD needs
+	void UpdateLuminosity(const float deltaTime);
+	// Moves luminosity towards the last query's result
+	void InterpolateLuminosity();
+	// Returns the query LOD for current situation
+	ELightQueryLODEnum ChooseLightQueryLOD(const float sampleRadius);
+	// Returns the radius around the darkness in which light is sampled
+	float GetLightSampleRadius() const;
+	// Returns how much light lets the darkness move, negative values push it back
+	float GetLightPush() const;
+	float GetLightPush(const float luminosity) const;
+
 	// Reenables particles
 	void ReenableParticles();
 	float ReenableParticlesAfterTeleportDelay = 2.f;
@@ -61,6 +107,9 @@ protected:
 	AActor* TrackedActor;
 	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Darkness: Tracking")
 	FVector TrackedLocation;
+	// Distance to a passage at which the darkness starts going through it
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Darkness: Tracking")
+	float PassageReachDistance = 60.f;
 
 public:
 	// The amount of light the darkness is in
@@ -76,7 +125,7 @@ public:
 protected:
 	// The amount of light the darkness is in
 	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Darkness: Luminosity")
-	FVector BrightestLightLocation;
+	FVector BrightestLightLocation = FVector::ZeroVector;
 	// The speed of resistance rising if in light higher than resistance
 	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Darkness: Luminosity")
 	float LightResGainSpeed = 0.007f;
@@ -87,6 +136,29 @@ protected:
 	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Darkness: Luminosity")
 	float LightFearK = 10.0f;
 
+	// Current precision of light queries
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Darkness: Light LOD")
+	ELightQueryLODEnum LightQueryLOD = ELightQueryLODEnum::VE_Full;
+	// Distance to the player after which light is checked less precisely
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Darkness: Light LOD")
+	float ReducedLightQueryDistance = 2500.f;
+	// Time between light queries when they are reduced or skipped
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Darkness: Light LOD")
+	float ReducedLightQueryInterval = 0.25f;
+
+private:
+	// Values found by the last two light queries, used to interpolate between them
+	float PreviousLuminosity = 0.f;
+	float TargetLuminosity = 0.f;
+	FVector PreviousLightLocation = FVector::ZeroVector;
+	FVector TargetLightLocation = FVector::ZeroVector;
+	// Time since the last light query and the time until the next one
+	float SinceLastLightQuery = 0.f;
+	float LightQueryInterval = 0.f;
+	// Last states the controller was told about
+	bool bWasAfraid = false;
+	bool bWasInDark = true;
+
 	// The particle system, forming the main body of the darkness
 	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Darkness: Components")
 	class UParticleSystemComponent* DarkParticles;
@@ -104,6 +176,9 @@ private:
 	// A pointer to the controller
 	UPROPERTY()
 	class ADarknessController* DarknessController;
+	// A pointer to the manager that makes light queries for all darkness, nullptr if darkness makes them itself
+	UPROPERTY()
+	class ADarknessManager* DarknessManager;
 
 public:
 	// Used for the collision overlaps
@@ -119,8 +194,13 @@ public:
 protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
+	// Called when actor is being removed from the play
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
 
-public:	
+public:
+	// Called when a controller takes over the darkness
+	virtual void PossessedBy(AController* NewController) override;
+	
 	// Called every frame
 	virtual void Tick(const float deltaTime) override;
 };
\ No newline at end of file
@@ -6,12 +6,29 @@
 #include "GameFramework/PawnMovementComponent.h"
 #include "MainCharacter.h"
 #include "GameHUD.h"
+#include "MainGameMode.h"
 
 // Called on disabling a character
 void ADarknessController::OnDisabling()
 {
 	StartRetreating();
 }
+// Called when light starts or stops pushing the darkness back
+void ADarknessController::OnLightFearChanged(const bool afraid)
+{
+	bIsAfraid = afraid;
+	UpdateTickEnabled();
+
+	// The state change that came while afraid happens now
+	if (!afraid && bStateChangeWaitsForFear)
+		OnStateTimer();
+}
+// Called when the darkness enters or leaves the dark
+void ADarknessController::OnDarkChanged(const bool inDark)
+{
+	if (State == EDarkStateEnum::VE_Retreating)
+		ScheduleInDark();
+}
 
 // Called when player gets the black doorcard
 void ADarknessController::OnPlayerFindsBlackCard()
@@ -27,12 +44,28 @@ void ADarknessController::OnPlayerFindsBlackCard()
 	GetWorldTimerManager().SetTimer(handler, Darkness, &ADarkness::OnEnraged, 1.f, false, 0.2f);
 }
 
+// Returns true while light is strong enough to push the darkness back
+bool ADarknessController::IsAfraid() const
+{
+	return bIsAfraid;
+}
+
+// Stops or resumes ticking on its own, a managed controller is updated by the darkness manager
+void ADarknessController::SetManaged(const bool managed)
+{
+	if (bIsManaged == managed)
+		return;
+
+	bIsManaged = managed;
+	UpdateTickEnabled();
+}
+
 // Teleports to some point closer to character
 void ADarknessController::TeleportToCharacter()
 {
 	UE_LOG(LogTemp, Warning, TEXT("DarknessController::TeleportToCharacter"));
 
-	if (SinceLastTeleport < MinTimeBetweenTeleports)
+	if (GetWorld()->GetTimeSeconds() - LastTeleportTime < MinTimeBetweenTeleports)
 		return;
 
 	FVector charLocation = MainCharacter->GetActorLocation();
@@ -43,30 +76,26 @@ void ADarknessController::TeleportToCharacter()
 	if (!bIsPersistent && Darkness->TimeInDark < MinTimeInDark)
 		return;
 
-	// Making random direction
-	// UE_LOG(LogTemp, Warning, TEXT("Making random direction"));
-	FVector direction;
-	int tries = 50;
-	float L;
-	do
-	{
-		// Check random vectors in the unit circle so result is statistically uniform.
-		direction.X = FMath::FRand() * 2.f - 1.f;
-		direction.Y = FMath::FRand() * 2.f - 1.f;
-		L = direction.SizeSquared();
-		--tries;
-	}
-	while (tries > 0 && (L > 1.0f || L < KINDA_SMALL_NUMBER));
-	// UE_LOG(LogTemp, Warning, TEXT("Made random direction"));
-	if (tries <= 0)
-		UE_LOG(LogTemp, Warning, TEXT("Teleport took me long"));
-	direction *= (1.0f / FMath::Sqrt(L));
+	if (!GameMode)
+		return;
 
-	// TODO check if that place is not lit
-	FVector destination = charLocation + direction * MinTeleportDistance;
+	// A floor cell of some room far enough from light for an ambush
+	// If there is none at the right distance, rooms a few passages away will do
+	LabRoomGraph& graph = GameMode->GetRoomGraph();
+	FIntPoint cell;
+	if (!graph.FindDarkCell(charLocation, MinTeleportDistance, MaxTeleportDistance, MinAmbushHopsToLight, cell) &&
+		!graph.FindDarkCell(graph.GetRoomAt(charLocation), MinTeleportHops, MaxTeleportHops, MinAmbushHopsToLight, cell))
+		return;
+	float destinationX, destinationY;
+	AMainGameMode::GridToWorld(cell.X, cell.Y, destinationX, destinationY);
+	FVector destination = FVector(destinationX, destinationY, Darkness->GetActorLocation().Z);
 
 	Darkness->TeleportToLocation(destination);
-	SinceLastTeleport = 0.f;
+	LastTeleportTime = GetWorld()->GetTimeSeconds();
+
+	// Next attempts wait till teleports are allowed again
+	if (State == EDarkStateEnum::VE_Hunting)
+		ScheduleTeleport();
 
 	//UE_LOG(LogTemp, Warning, TEXT("Teleported"));
 }
@@ -77,10 +106,15 @@ void ADarknessController::BecomePassive()
 	UE_LOG(LogTemp, Warning, TEXT("DarknessController::BecomePassive"));
 
 	State = EDarkStateEnum::VE_Passive;
+	bStateChangeWaitsForFear = false;
 	Darkness->Stop();
 
+	// Starts the hunt after some time
 	CurrentMaxTimePassive = FMath::FRandRange(MinTimePassive, MaxTimePassive);
-	SinceLastStateChange = 0.f;
+	GetWorldTimerManager().SetTimer(StateTimerHandle, this, &ADarknessController::OnStateTimer, CurrentMaxTimePassive, false);
+	GetWorldTimerManager().ClearTimer(TeleportTimerHandle);
+	GetWorldTimerManager().ClearTimer(InDarkTimerHandle);
+	UpdateTickEnabled();
 
 	// MainCharacter->GameHUD->ShowHideWarning(true, FText::FromString("You feel safe lol"));
 	// UE_LOG(LogTemp, Warning, TEXT("Entering passive state"));
@@ -98,10 +132,19 @@ void ADarknessController::StartHunting()
 	bool firstHunt = CurrentMaxTimeHunting < 0;
 	
 	State = EDarkStateEnum::VE_Hunting;
+	bStateChangeWaitsForFear = false;
 	CurrentMaxTimeHunting = FMath::FRandRange(MinTimeHunting, MaxTimeHunting);
-	SinceLastStateChange = 0.f;
 	Darkness->MoveToActor((AActor*)MainCharacter);
 
+	// Starts retreating after some time unless persistent
+	if (bIsPersistent)
+		GetWorldTimerManager().ClearTimer(StateTimerHandle);
+	else
+		GetWorldTimerManager().SetTimer(StateTimerHandle, this, &ADarknessController::OnStateTimer, CurrentMaxTimeHunting, false);
+	GetWorldTimerManager().ClearTimer(InDarkTimerHandle);
+	ScheduleTeleport();
+	UpdateTickEnabled();
+
 	if (!bIsPersistent || firstHunt)
 		MainCharacter->GameHUD->ShowHideWarning(true, FText::FromString("You sense something malevolent coming after you from the darkness"));
 	else
@@ -115,24 +158,89 @@ void ADarknessController::StartRetreating()
 	UE_LOG(LogTemp, Warning, TEXT("DarknessController::StartRetreating"));
 
 	State = EDarkStateEnum::VE_Retreating;
+	bStateChangeWaitsForFear = false;
 	Darkness->Stop();
 
-	SinceLastStateChange = 0.f;
+	// Becomes passive after some time or after escaping into darkness
+	GetWorldTimerManager().SetTimer(StateTimerHandle, this, &ADarknessController::OnStateTimer, MaxTimeRetreating, false);
+	GetWorldTimerManager().ClearTimer(TeleportTimerHandle);
+	ScheduleInDark();
+	UpdateTickEnabled();
 
 	if (!MainCharacter->bIsDisabled)
 		MainCharacter->GameHUD->ShowHideWarning(true, FText::FromString("You notice the darkness retreating. You are safe."));
 	// UE_LOG(LogTemp, Warning, TEXT("Retreating into darkness"));
 }
 
+// Changes the state when its time runs out, unless the darkness is afraid
+void ADarknessController::OnStateTimer()
+{
+	// Afraid darkness only retreats from light, as it did before timers
+	bStateChangeWaitsForFear = IsAfraid();
+	if (bStateChangeWaitsForFear)
+		return;
+
+	switch (State)
+	{
+	case EDarkStateEnum::VE_Passive:
+		StartHunting();
+		break;
+	case EDarkStateEnum::VE_Hunting:
+		if (!bIsPersistent)
+			StartRetreating();
+		break;
+	case EDarkStateEnum::VE_Retreating:
+		BecomePassive();
+		break;
+	}
+}
+// Tries to teleport from time to time while hunting, starting when teleports are allowed again
+void ADarknessController::ScheduleTeleport()
+{
+	float sinceLastTeleport = GetWorld()->GetTimeSeconds() - LastTeleportTime;
+	float delay = FMath::Max(MinTimeBetweenTeleports - sinceLastTeleport, TeleportCheckInterval);
+	GetWorldTimerManager().SetTimer(TeleportTimerHandle, this, &ADarknessController::OnTeleportTimer, TeleportCheckInterval, true, delay);
+}
+// Called when it's time for the next teleport attempt, afraid darkness doesn't teleport
+void ADarknessController::OnTeleportTimer()
+{
+	if (!IsAfraid())
+		TeleportToCharacter();
+}
+// Waits for the darkness to spend enough time in the dark, if it is in the dark
+void ADarknessController::ScheduleInDark()
+{
+	if (!Darkness->IsInDark())
+	{
+		GetWorldTimerManager().ClearTimer(InDarkTimerHandle);
+		return;
+	}
+
+	// Already spent enough time means the next tick
+	float delay = FMath::Max(MinTimeInDark - Darkness->TimeInDark, KINDA_SMALL_NUMBER);
+	GetWorldTimerManager().SetTimer(InDarkTimerHandle, this, &ADarknessController::OnStayedInDark, delay, false);
+}
+// Called when the darkness spent enough time in the dark
+void ADarknessController::OnStayedInDark()
+{
+	if (State == EDarkStateEnum::VE_Retreating && !IsAfraid())
+		BecomePassive();
+}
+// Ticks only when the darkness has to move and the manager doesn't update it
+void ADarknessController::UpdateTickEnabled()
+{
+	SetActorTickEnabled(!bIsManaged && (bIsAfraid || State != EDarkStateEnum::VE_Passive));
+}
+
 // Called when the game starts or when spawned
 void ADarknessController::BeginPlay()
 {
 	Super::BeginPlay();
 
-	// We find the darkness
+	GameMode = Cast<AMainGameMode>(GetWorld()->GetAuthGameMode());
+
+	// We find the darkness, spawned darkness is only possessed after this
 	Darkness = Cast<ADarkness>(GetPawn());	
-	if (!Darkness)
-		UE_LOG(LogTemp, Warning, TEXT("No Darkness"));
 
 	// We find the player
 	APlayerController* controller = GetWorld()->GetFirstPlayerController();
@@ -147,7 +255,22 @@ void ADarknessController::BeginPlay()
 	MainCharacter = Cast<AMainCharacter>(character);
 
 	// Then we set the state
-	BecomePassive();
+	if (Darkness)
+		BecomePassive();
+}
+
+// Called when the controller takes over a pawn
+void ADarknessController::Possess(APawn * InPawn)
+{
+	Super::Possess(InPawn);
+
+	Darkness = Cast<ADarkness>(InPawn);
+	if (!Darkness)
+		UE_LOG(LogTemp, Warning, TEXT("No Darkness"));
+
+	// Darkness placed in the level is possessed before the game starts and becomes passive in BeginPlay
+	if (Darkness && HasActorBegunPlay())
+		BecomePassive();
 }
 
 // Called every frame
@@ -157,47 +280,28 @@ void ADarknessController::Tick(const float deltaTime)
 
 	Super::Tick(deltaTime);
 
-	SinceLastStateChange += deltaTime;
-	SinceLastTeleport += deltaTime;
+	UpdateMovement(deltaTime);
+}
+// Moves the darkness the way its state and fear need
+void ADarknessController::UpdateMovement(const float deltaTime)
+{
+	if (!Darkness)
+		return;
 
 	// Darkness retreats from powerful light sources
-	bool isAfraid = Darkness->RetreatFromLight();
+	if (bIsAfraid && Darkness->RetreatFromLight())
+		return;
 
-	// Do something based on state if it isn't afraid already
-	if (!isAfraid)
+	// State changes come from timers and darkness's events, here it only moves
+	switch (State)
 	{
-		switch (State)
-		{
-		case EDarkStateEnum::VE_Passive:
-			// If its been some time, start the hunt
-			if (SinceLastStateChange >= CurrentMaxTimePassive)
-				StartHunting();
-			// TODO else?
-			break;
-		case EDarkStateEnum::VE_Hunting:
-			// If hunting for some time, start retreating
-			if (!bIsPersistent && SinceLastStateChange >= CurrentMaxTimeHunting)
-				StartRetreating();
-			// Otherwise keep hunting
-			else
-			{
-				// UE_LOG(LogTemp, Warning, TEXT("Hunting"));
-				// Tries to teleport if possible
-				TeleportToCharacter();
-				// UE_LOG(LogTemp, Warning, TEXT("> After teleport"));
-				// Then just moves
-				Darkness->Tracking();
-				// UE_LOG(LogTemp, Warning, TEXT("> After tracking"));
-			}
-			break;
-		case EDarkStateEnum::VE_Retreating:
-			// If retreating for too long or if already escaped into darkness, become passive
-			if (SinceLastStateChange >= MaxTimeRetreating || Darkness->TimeInDark >= MinTimeInDark)
-				BecomePassive();
-			// Otherwise keep retreating
-			else
-				Darkness->IntoDarkness();
-			break;
-		}
+	case EDarkStateEnum::VE_Hunting:
+		Darkness->Tracking();
+		break;
+	case EDarkStateEnum::VE_Retreating:
+		Darkness->IntoDarkness();
+		break;
+	default:
+		break;
 	}
 }
\ No newline at end of file
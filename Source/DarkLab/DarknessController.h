@@ -31,6 +31,9 @@ protected:
 	// Hunted character controller
 	UPROPERTY()
 	class AMainPlayerController* PlayerController;
+	// A pointer to the game mode
+	UPROPERTY()
+	class AMainGameMode* GameMode;
 
 public:
 	// If true, keeps hunting till it gets the player
@@ -53,14 +56,29 @@ protected:
 	//float TrackingRestartDelay = 8.0f;
 
 	// The minimum distance between darkness and character before darkness can teleport
+	// Darkness also teleports at least this far from character
 	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Darkness: Teleport")
 	float MinTeleportDistance = 3000.0f;
+	// The maximum distance from character darkness can teleport to
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Darkness: Teleport")
+	float MaxTeleportDistance = 4000.0f;
+	// Passages between character's room and the room darkness teleports to if there are no rooms at the right distance
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Darkness: Teleport")
+	int MinTeleportHops = 3;
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Darkness: Teleport")
+	int MaxTeleportHops = 6;
 	// The minimum time between two consequtive teleports
 	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Darkness: Teleport")
 	float MinTimeBetweenTeleports = 15.0f;
-	// Time since last teleport
+	// Time between teleport attempts while hunting
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Darkness: Teleport")
+	float TeleportCheckInterval = 0.5f;
+	// Game time of the last teleport
 	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Darkness: Teleport")
-	float SinceLastTeleport = 0.f;
+	float LastTeleportTime = 0.f;
+	// The minimum number of passages between a room the darkness teleports into and the nearest lit room
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Darkness: Teleport")
+	int MinAmbushHopsToLight = 2;
 
 	// The maximum time the darkness keeps hunting
 	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Darkness: Hunting")
@@ -80,22 +98,45 @@ protected:
 	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Darkness: States")
 	float MinTimeInDark = 5.0f;
 
-	// Time since last state change
-	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Darkness: States")
-	float SinceLastStateChange = 0.f;
-
 public:
 	// Current state of the darkness
 	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Darkness: States")
 	EDarkStateEnum State = EDarkStateEnum::VE_Passive;
 
+protected:
+	// True while light is strong enough to push the darkness back
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Darkness: States")
+	bool bIsAfraid = false;
+
+private:
+	// Timers of the next state change, the next teleport attempt and the end of required time in the dark
+	FTimerHandle StateTimerHandle;
+	FTimerHandle TeleportTimerHandle;
+	FTimerHandle InDarkTimerHandle;
+	// True if the state timer went off while afraid, the state changes when light stops pushing the darkness back
+	bool bStateChangeWaitsForFear = false;
+	// True if the darkness manager updates the controller instead of it ticking
+	bool bIsManaged = false;
+
 public:
 	// Called on disabling a character
 	void OnDisabling();
+	// Called when light starts or stops pushing the darkness back
+	void OnLightFearChanged(const bool afraid);
+	// Called when the darkness enters or leaves the dark
+	void OnDarkChanged(const bool inDark);
 
 	// Called when player gets the black doorcard
 	void OnPlayerFindsBlackCard();
 
+	// Returns true while light is strong enough to push the darkness back
+	bool IsAfraid() const;
+
+	// Stops or resumes ticking on its own, a managed controller is updated by the darkness manager
+	void SetManaged(const bool managed);
+	// Moves the darkness the way its state and fear need
+	void UpdateMovement(const float deltaTime);
+
 	// Teleports to some point closer to character
 	UFUNCTION(BlueprintCallable, Category = "Darkness: Teleport")
 	void TeleportToCharacter();
@@ -110,9 +151,25 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "Darkness: Retreating")
 	void StartRetreating();
 
+private:
+	// Changes the state when its time runs out, unless the darkness is afraid
+	void OnStateTimer();
+	// Tries to teleport from time to time while hunting, starting when teleports are allowed again
+	void ScheduleTeleport();
+	// Called when it's time for the next teleport attempt, afraid darkness doesn't teleport
+	void OnTeleportTimer();
+	// Waits for the darkness to spend enough time in the dark, if it is in the dark
+	void ScheduleInDark();
+	// Called when the darkness spent enough time in the dark
+	void OnStayedInDark();
+	// Ticks only when the darkness has to move and the manager doesn't update it
+	void UpdateTickEnabled();
+
 public:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
+	// Called when the controller takes over a pawn
+	virtual void Possess(APawn* InPawn) override;
 
 	// Called every frame
 	virtual void Tick(const float deltaTime) override;
@@ -0,0 +1,272 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "DarknessManager.h"
+#include "DarknessController.h"
+#include "MainGameMode.h"
+#include "Async/ParallelFor.h"
+#include "DarkLab.h"
+
+// Stats
+DECLARE_CYCLE_STAT(TEXT("Darkness manager"), STAT_DarknessManager, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Darkness hunters"), STAT_DarknessHunters, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Darkness light queries"), STAT_DarknessLightQueries, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Darkness light queries postponed"), STAT_DarknessLightQueriesPostponed, STATGROUP_DarkLab);
+
+// Starts managing the hunter
+void ADarknessManager::AddHunter(ADarkness * hunter)
+{
+	if (!hunter || Hunters.Contains(hunter))
+		return;
+
+	Hunters.Add(hunter);
+
+	// The manager updates the hunter and its controller after the light queries, so they don't tick on their own
+	hunter->SetActorTickEnabled(false);
+	ADarknessController* controller = Cast<ADarknessController>(hunter->GetController());
+	if (controller)
+		controller->SetManaged(true);
+}
+// Stops managing the hunter
+void ADarknessManager::RemoveHunter(ADarkness * hunter)
+{
+	if (!hunter)
+		return;
+
+	Hunters.Remove(hunter);
+	SpawnedHunters.Remove(hunter);
+	hunter->SetActorTickEnabled(true);
+	ADarknessController* controller = Cast<ADarknessController>(hunter->GetController());
+	if (controller)
+		controller->SetManaged(false);
+}
+// Returns the number of managed hunters
+int ADarknessManager::GetNumHunters() const
+{
+	return Hunters.Num();
+}
+// Returns all managed hunters
+const TArray<ADarkness*>& ADarknessManager::GetHunters() const
+{
+	return Hunters;
+}
+
+// Called when player gets the black doorcard
+void ADarknessManager::OnPlayerFindsBlackCard()
+{
+	for (ADarkness* hunter : Hunters)
+	{
+		ADarknessController* controller = hunter ? Cast<ADarknessController>(hunter->GetController()) : nullptr;
+		if (controller && !controller->bIsPersistent)
+			controller->OnPlayerFindsBlackCard();
+	}
+}
+
+// Spawns or destroys hunters spawned by the manager so that there are count hunters overall
+void ADarknessManager::SetHunterCount(TSubclassOf<ADarkness> darknessClass, const int count)
+{
+	UE_LOG(LogTemp, Warning, TEXT("DarknessManager::SetHunterCount"));
+
+	// Hunters that were there from the start are never destroyed
+	while (Hunters.Num() > count && SpawnedHunters.Num() > 0)
+	{
+		ADarkness* hunter = SpawnedHunters.Pop();
+		AController* controller = hunter->GetController();
+		hunter->Destroy();
+		if (controller)
+			controller->Destroy();
+	}
+
+	while (Hunters.Num() < count)
+	{
+		if (!SpawnHunter(darknessClass))
+		{
+			UE_LOG(LogDarkLab, Warning, TEXT("No dark rooms left to spawn darkness hunters in"));
+			break;
+		}
+	}
+
+	UE_LOG(LogDarkLab, Log, TEXT("Darkness hunters: %d, spawned: %d"), Hunters.Num(), SpawnedHunters.Num());
+}
+// Spawns a hunter in a dark room away from the character, returns nullptr if there is no such room
+ADarkness * ADarknessManager::SpawnHunter(TSubclassOf<ADarkness> darknessClass)
+{
+	APlayerController* controller = GetWorld()->GetFirstPlayerController();
+	APawn* player = controller ? controller->GetPawn() : nullptr;
+	if (!darknessClass || !GameMode || !player)
+		return nullptr;
+
+	// Same kind of place darkness teleports to
+	FVector playerLocation = player->GetActorLocation();
+	LabRoomGraph& graph = GameMode->GetRoomGraph();
+	FIntPoint cell;
+	if (!graph.FindDarkCell(playerLocation, MinSpawnDistance, MaxSpawnDistance, 1, cell) &&
+		!graph.FindDarkCell(graph.GetRoomAt(playerLocation), 1, LabRoomGraph::MaxHopsToLight, 1, cell))
+		return nullptr;
+	float x, y;
+	AMainGameMode::GridToWorld(cell.X, cell.Y, x, y);
+	float z = Hunters.Num() > 0 ? Hunters[0]->GetActorLocation().Z : playerLocation.Z;
+	FTransform transform = FTransform(FVector(x, y, z));
+
+	// Spawned hunters are always controlled by a darkness controller
+	ADarkness* hunter = GetWorld()->SpawnActorDeferred<ADarkness>(darknessClass, transform, nullptr, nullptr, ESpawnActorCollisionHandlingMethod::AlwaysSpawn);
+	if (!hunter)
+		return nullptr;
+	if (!hunter->AIControllerClass || !hunter->AIControllerClass->IsChildOf(ADarknessController::StaticClass()))
+		hunter->AIControllerClass = ADarknessController::StaticClass();
+	hunter->AutoPossessAI = EAutoPossessAI::Spawned;
+	hunter->FinishSpawning(transform);
+
+	SpawnedHunters.Add(hunter);
+	return hunter;
+}
+
+// Makes light queries for hunters that need them, hunters close to each other in the same room share one
+// Lights are gathered once per room and traces of all queries are made together on worker threads
+// Darkness tells its controller about results that make it afraid or put it in the dark
+void ADarknessManager::UpdateLuminosity()
+{
+	TMap<TPair<LabRoom*, FIntPoint>, FLightQueryGroupStruct> groups;
+	for (ADarkness* hunter : Hunters)
+	{
+		ELightQueryLODEnum lod;
+		if (!hunter->bIsActive || !hunter->NeedsLightQuery(lod))
+			continue;
+
+		// No light can reach, nothing to share
+		if (lod == ELightQueryLODEnum::VE_Skipped || !GameMode)
+		{
+			FVector lightLocation;
+			float luminosity = hunter->QueryLight(lod, lightLocation);
+			hunter->ApplyLightQuery(lod, luminosity, lightLocation);
+			hunter->NotifyLightChanges();
+			continue;
+		}
+
+		// Hunters on different sides of a wall are in different light
+		FVector location = hunter->GetActorLocation();
+		LabRoom* room = GameMode->GetRoomGraph().GetRoomAt(location);
+		FIntPoint cell = FIntPoint(FMath::FloorToInt(location.X / SharedLightQuerySize), FMath::FloorToInt(location.Y / SharedLightQuerySize));
+		FLightQueryGroupStruct& group = groups.FindOrAdd(TPair<LabRoom*, FIntPoint>(room, cell));
+		group.Room = room;
+		group.Hunters.Add(hunter);
+		group.LODs.Add(lod);
+		group.Waited = FMath::Max(group.Waited, hunter->GetSinceLastLightQuery());
+
+		// Lower values are more precise
+		if (!group.Querying || lod < group.LOD)
+		{
+			group.Querying = hunter;
+			group.LOD = lod;
+		}
+	}
+
+	// Groups that waited the longest go first so none of them waits forever
+	TArray<FLightQueryGroupStruct> ordered;
+	groups.GenerateValueArray(ordered);
+	ordered.Sort([](const FLightQueryGroupStruct& a, const FLightQueryGroupStruct& b) { return a.Waited > b.Waited; });
+	int queries = FMath::Min(ordered.Num(), MaxLightQueriesPerFrame);
+	SET_DWORD_STAT(STAT_DarknessLightQueries, queries);
+	SET_DWORD_STAT(STAT_DarknessLightQueriesPostponed, ordered.Num() - queries);
+	if (queries == 0)
+		return;
+
+	// Each room keeps the lights that reach any point sampled in it
+	const TArray<FLightSampleStruct>& frameLights = GameMode->GetFrameLightSamples();
+	TArray<TArray<FVector>> locations;
+	locations.SetNum(queries);
+	TMap<LabRoom*, TBitArray<>> roomLightsInReach;
+	for (int i = 0; i < queries; ++i)
+	{
+		ordered[i].Querying->GetLightSamplePoints(ordered[i].LOD, locations[i]);
+		TBitArray<>& inReach = roomLightsInReach.FindOrAdd(ordered[i].Room);
+		if (inReach.Num() == 0)
+			inReach.Init(false, frameLights.Num());
+		for (int j = 0; j < frameLights.Num(); ++j)
+		{
+			if (inReach[j])
+				continue;
+			for (const FVector& location : locations[i])
+			{
+				if (AMainGameMode::IsInLightReach(location, frameLights[j]))
+				{
+					inReach[j] = true;
+					break;
+				}
+			}
+		}
+	}
+	TMap<LabRoom*, TArray<FLightSampleStruct>> roomLights;
+	for (const TPair<LabRoom*, TBitArray<>>& pair : roomLightsInReach)
+	{
+		TArray<FLightSampleStruct>& lights = roomLights.Add(pair.Key);
+		for (TConstSetBitIterator<> it(pair.Value); it; ++it)
+			lights.Add(frameLights[it.GetIndex()]);
+	}
+
+	// Traces only read the world, so all queries are made at once
+	UWorld* world = GetWorld();
+	TArray<float> luminosities;
+	TArray<FVector> lightLocations;
+	luminosities.SetNumZeroed(queries);
+	lightLocations.SetNum(queries);
+	for (int i = 0; i < queries; ++i)
+		lightLocations[i] = ordered[i].Querying->GetLastLightLocation();
+	ParallelFor(queries, [world, &ordered, &locations, &roomLights, &luminosities, &lightLocations](int32 i)
+	{
+		luminosities[i] = AMainGameMode::GetLightingAmount(world, lightLocations[i], ordered[i].Querying, locations[i], roomLights.FindChecked(ordered[i].Room));
+	});
+
+	for (int i = 0; i < queries; ++i)
+	{
+		FLightQueryGroupStruct& group = ordered[i];
+		for (int j = 0; j < group.Hunters.Num(); ++j)
+		{
+			group.Hunters[j]->ApplyLightQuery(group.LODs[j], luminosities[i], lightLocations[i]);
+			// Controllers only hear about results that change something
+			group.Hunters[j]->NotifyLightChanges();
+		}
+	}
+}
+
+// Sets default values
+ADarknessManager::ADarknessManager()
+{
+	// Set to call Tick() every frame
+	PrimaryActorTick.bCanEverTick = true;
+}
+
+// Called when the game starts or when spawned
+void ADarknessManager::BeginPlay()
+{
+	Super::BeginPlay();
+
+	GameMode = Cast<AMainGameMode>(GetWorld()->GetAuthGameMode());
+}
+
+// Called every frame
+void ADarknessManager::Tick(const float deltaTime)
+{
+	Super::Tick(deltaTime);
+
+	SCOPE_CYCLE_COUNTER(STAT_DarknessManager);
+
+	// Destroyed hunters might not have told us
+	Hunters.RemoveAll([](ADarkness* hunter) { return !IsValid(hunter); });
+	SpawnedHunters.RemoveAll([](ADarkness* hunter) { return !IsValid(hunter); });
+	SET_DWORD_STAT(STAT_DarknessHunters, Hunters.Num());
+
+	UpdateLuminosity();
+
+	// Hunters move with the results of this frame's queries
+	for (ADarkness* hunter : Hunters)
+	{
+		hunter->UpdateHunter(deltaTime);
+
+		// Hunters can be possessed by a new controller after they are added
+		ADarknessController* controller = Cast<ADarknessController>(hunter->GetController());
+		if (!controller)
+			continue;
+		controller->SetManaged(true);
+		controller->UpdateMovement(deltaTime);
+	}
+}
@@ -0,0 +1,90 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GameFramework/Actor.h"
+#include "Darkness.h"
+#include "DarknessManager.generated.h"
+
+// Hunters that share one light query
+struct FLightQueryGroupStruct
+{
+	// The room all hunters are in, nullptr outside of the lab
+	class LabRoom* Room = nullptr;
+	TArray<class ADarkness*> Hunters;
+	TArray<ELightQueryLODEnum> LODs;
+	// The hunter that makes the query and the most precise LOD any hunter needs
+	class ADarkness* Querying = nullptr;
+	ELightQueryLODEnum LOD = ELightQueryLODEnum::VE_Skipped;
+	// The longest time any hunter has waited for the query
+	float Waited = 0.f;
+};
+
+// Updates all darkness hunters and their controllers together so they can share light queries
+UCLASS()
+class DARKLAB_API ADarknessManager : public AActor
+{
+	GENERATED_BODY()
+
+public:
+	// Starts managing the hunter
+	void AddHunter(class ADarkness* hunter);
+	// Stops managing the hunter
+	void RemoveHunter(class ADarkness* hunter);
+	// Returns the number of managed hunters
+	int GetNumHunters() const;
+	// Returns all managed hunters
+	const TArray<class ADarkness*>& GetHunters() const;
+
+	// Called when player gets the black doorcard
+	void OnPlayerFindsBlackCard();
+
+	// Spawns or destroys hunters spawned by the manager so that there are count hunters overall
+	void SetHunterCount(TSubclassOf<class ADarkness> darknessClass, const int count);
+
+private:
+	// Makes light queries for hunters that need them, hunters close to each other in the same room share one
+	// Lights are gathered once per room and traces of all queries are made together on worker threads
+	// Darkness tells its controller about results that make it afraid or put it in the dark
+	void UpdateLuminosity();
+	// Spawns a hunter in a dark room away from the character, returns nullptr if there is no such room
+	class ADarkness* SpawnHunter(TSubclassOf<class ADarkness> darknessClass);
+
+protected:
+	// Hunters in the same room closer than this share light queries
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Darkness Manager")
+	float SharedLightQuerySize = 300.f;
+	// The most light queries made in a single frame, the rest wait for the next frames
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Darkness Manager")
+	int MaxLightQueriesPerFrame = 16;
+	// Spawned hunters appear at least this far from the character
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Darkness Manager")
+	float MinSpawnDistance = 2000.f;
+	// Spawned hunters appear at most this far from the character
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Darkness Manager")
+	float MaxSpawnDistance = 6000.f;
+
+private:
+	// All managed hunters
+	UPROPERTY()
+	TArray<class ADarkness*> Hunters;
+	// Hunters spawned by the manager
+	UPROPERTY()
+	TArray<class ADarkness*> SpawnedHunters;
+	// A pointer to the game mode
+	UPROPERTY()
+	class AMainGameMode* GameMode;
+
+public:
+	// Sets default values
+	ADarknessManager();
+
+protected:
+	// Called when the game starts or when spawned
+	virtual void BeginPlay() override;
+
+public:
+	// Called every frame
+	virtual void Tick(const float deltaTime) override;
+};
@@ -3,6 +3,7 @@
 #include "Doorcard.h"
 #include "Components/ArrowComponent.h"
 #include "Components/StaticMeshComponent.h"
+#include "LabMaterialCache.h"
 
 // Sets the color
 void ADoorcard::SetColor(FLinearColor color)
@@ -19,7 +20,7 @@ FLinearColor ADoorcard::GetColor()
 // Update's the color of the doorcard mesh
 void ADoorcard::UpdateMeshColor(FLinearColor color)
 {
-	Card->SetVectorParameterValueOnMaterials("Color", FVector(color.R, color.G, color.B));
+	LabMaterialCache::SetMeshColor(Card, color);
 }
 
 // Sets default values
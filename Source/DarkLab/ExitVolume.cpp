@@ -52,6 +52,16 @@ AExitVolume::AExitVolume()
 	Light->SetupAttachment(RootComponent);
 }
 
+// Called after properties are initialized, before the object is placed
+void AExitVolume::PostInitProperties()
+{
+	Super::PostInitProperties();
+
+	// Set size
+	// Gets overridden by blueprint defaults if done in constructor, and placing new objects needs it before BeginPlay
+	BaseSize = FIntVector(8, 1, 5); // TODO make bigger on X?
+}
+
 // Called when the game starts or when spawned
 void AExitVolume::BeginPlay()
 {
@@ -62,8 +72,4 @@ void AExitVolume::BeginPlay()
 
 	// Light is disabled
 	Reset();
-
-	// Set size
-	// Gets overridden if done in constructor for some reason
-	BaseSize = FIntVector(8, 1, 5); // TODO make bigger on X?
 }
\ No newline at end of file
@@ -51,6 +51,9 @@ public:
 	// Sets default values
 	AExitVolume();
 
+	// Called after properties are initialized, before the object is placed
+	virtual void PostInitProperties() override;
+
 protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
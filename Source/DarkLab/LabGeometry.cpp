@@ -0,0 +1,528 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "LabGeometry.h"
+#include "Components/HierarchicalInstancedStaticMeshComponent.h"
+#include "Components/BoxComponent.h"
+#include "KismetProceduralMeshLibrary.h"
+#include "Async/TaskGraphInterfaces.h"
+#include "MainGameMode.h"
+#include "DarkLab.h"
+
+// Other constants
+const float ALabGeometry::FloorCollisionExtent = 1000000.f;
+const int ALabGeometry::MaxBuiltMergedMeshes = 8;
+
+// Stats
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Geometry: instances"), STAT_GeometryInstances, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Geometry: primitives"), STAT_GeometryPrimitives, STATGROUP_DarkLab);
+
+// Takes mesh, materials and collision from the floor and wall blueprints' meshes
+void ALabGeometry::Init(UStaticMeshComponent * floorTemplate, UStaticMeshComponent * wallTemplate)
+{
+	FloorTemplate = floorTemplate;
+	WallTemplate = wallTemplate;
+
+	if (floorTemplate && floorTemplate->GetStaticMesh())
+	{
+		FloorMeshTransform = floorTemplate->GetRelativeTransform();
+		FloorBounds = floorTemplate->GetStaticMesh()->GetBoundingBox().TransformBy(FloorMeshTransform);
+	}
+	if (wallTemplate && wallTemplate->GetStaticMesh())
+	{
+		WallMeshTransform = wallTemplate->GetRelativeTransform();
+		WallBounds = wallTemplate->GetStaticMesh()->GetBoundingBox().TransformBy(WallMeshTransform);
+	}
+	if (!IsReady())
+		return;
+
+	// One mesh for every floor and one for every wall of the laboratory
+	UHierarchicalInstancedStaticMeshComponent** components[2] = { &InstancedFloors, &InstancedWalls };
+	for (int i = 0; i < 2; ++i)
+	{
+		if (*components[i])
+			continue;
+		UHierarchicalInstancedStaticMeshComponent* component = NewObject<UHierarchicalInstancedStaticMeshComponent>(this);
+		component->SetupAttachment(RootComponent);
+		component->SetMobility(EComponentMobility::Movable);
+		CopyFromTemplate(component, i == 1 ? wallTemplate : floorTemplate);
+		component->RegisterComponent();
+		*components[i] = component;
+	}
+
+	// Merged floors collide with one box under the whole laboratory
+	if (!FloorCollision)
+	{
+		FloorCollision = NewObject<UBoxComponent>(this);
+		FloorCollision->SetupAttachment(RootComponent);
+		FloorCollision->SetMobility(EComponentMobility::Movable);
+		CopyFromTemplate(FloorCollision, floorTemplate);
+		FloorCollision->SetBoxExtent(FVector(FloorCollisionExtent, FloorCollisionExtent, FloorBounds.GetExtent().Z));
+		FloorCollision->SetWorldLocation(FVector(0.f, 0.f, FloorBounds.GetCenter().Z));
+		FloorCollision->RegisterComponent();
+		UpdateFloorCollision();
+	}
+}
+// Returns true if both floors and walls have meshes to instance
+bool ALabGeometry::IsReady() const
+{
+	return FloorTemplate && FloorTemplate->GetStaticMesh() && WallTemplate && WallTemplate->GetStaticMesh();
+}
+
+// Adds a floor or a wall that belongs to the owner, sizes are the same PlaceObject takes
+void ALabGeometry::AddFloor(const void * owner, const int botLeftX, const int botLeftY, const int sizeX, const int sizeY, const EGeometryModeEnum mode)
+{
+	if (mode == EGeometryModeEnum::VE_Merged)
+	{
+		AddMergedPiece(owner, FloorBounds.TransformBy(GetPieceTransform(FTransform::Identity, botLeftX, botLeftY, sizeX, sizeY)), false);
+		return;
+	}
+
+	AddInstance(owner, false, GetPieceTransform(FloorMeshTransform, botLeftX, botLeftY, sizeX, sizeY));
+}
+void ALabGeometry::AddWall(const void * owner, const int botLeftX, const int botLeftY, const int sizeX, const int sizeY, const EGeometryModeEnum mode)
+{
+	if (mode == EGeometryModeEnum::VE_Merged)
+	{
+		AddMergedPiece(owner, WallBounds.TransformBy(GetPieceTransform(FTransform::Identity, botLeftX, botLeftY, sizeX, sizeY)), true);
+		return;
+	}
+
+	AddInstance(owner, true, GetPieceTransform(WallMeshTransform, botLeftX, botLeftY, sizeX, sizeY));
+}
+// Removes all floors and walls of the owner
+void ALabGeometry::RemoveAll(const void * owner)
+{
+	// Instances are removed, nothing is left to draw or collide with
+	// Highest indices go first, so the last instance is never one of the owner's that are still to be removed
+	FInstancedPiecesStruct* instanced = InstancedPieces.Find(owner);
+	if (instanced)
+	{
+		for (int isWall = 0; isWall <= 1; ++isWall)
+		{
+			TArray<int32> indices = isWall ? instanced->Walls : instanced->Floors;
+			indices.Sort([](const int32 a, const int32 b) { return a > b; });
+			for (int32 index : indices)
+				RemoveInstance(isWall != 0, index);
+		}
+		InstancedPieces.Remove(owner);
+	}
+
+	// Late builds find no host and are thrown away
+	FMergedPiecesStruct pieces;
+	if (MergedPieces.RemoveAndCopyValue(owner, pieces) && pieces.Host)
+	{
+		FMergedHostStruct& host = MergedHosts[pieces.Host];
+		host.Parts.Remove(owner);
+		if (host.Parts.Num() == 0)
+			RemoveMergedHost(pieces.Host);
+		else
+			MergedChanged.Add(pieces.Host);
+	}
+
+	// Owners merged into the owner's mesh get meshes of their own
+	FMergedHostStruct* hosted = MergedHosts.Find(owner);
+	if (hosted)
+	{
+		TArray<const void*> parts = hosted->Parts;
+		for (const void* part : parts)
+			SetMergedHost(part, part);
+	}
+}
+// Merges the owner's pieces into the host's mesh, owners host themselves by default
+void ALabGeometry::SetMergedHost(const void * owner, const void * host)
+{
+	FMergedPiecesStruct& pieces = MergedPieces.FindOrAdd(owner);
+	if (pieces.Host == host)
+		return;
+
+	// The old mesh is rebuilt without the owner's pieces
+	if (pieces.Host)
+	{
+		FMergedHostStruct& oldHost = MergedHosts[pieces.Host];
+		oldHost.Parts.Remove(owner);
+		if (oldHost.Parts.Num() == 0)
+			RemoveMergedHost(pieces.Host);
+		else
+			MergedChanged.Add(pieces.Host);
+	}
+
+	pieces.Host = host;
+	MergedHosts.FindOrAdd(host).Parts.AddUnique(owner);
+	MergedChanged.Add(host);
+	UpdateFloorCollision();
+}
+// Builds merged meshes that changed right away on the game thread, collision is cooked right away too
+void ALabGeometry::BuildMergedNow()
+{
+	TArray<const void*> hosts = MergedChanged.Array();
+	for (const void* host : hosts)
+		BuildMergedNow(host);
+}
+void ALabGeometry::BuildMergedNow(const void * owner)
+{
+	const FMergedPiecesStruct* pieces = MergedPieces.Find(owner);
+	const void* host = pieces ? pieces->Host : owner;
+
+	// Nothing changed since the last build
+	if (MergedChanged.Remove(host) == 0)
+		return;
+
+	BuildMerged(host, true);
+}
+// Stops or resumes drawing the owner's merged mesh, collision is kept, returns the number of components hidden or shown
+int ALabGeometry::SetHidden(const void * owner, const bool hidden)
+{
+	int hiddenOrShown = 0;
+
+	FMergedHostStruct* merged = MergedHosts.Find(owner);
+	if (merged)
+	{
+		merged->bIsHidden = hidden;
+		if (merged->Mesh)
+		{
+			if (merged->Mesh->bHiddenInGame != hidden)
+				merged->Mesh->SetHiddenInGame(hidden);
+			++hiddenOrShown;
+		}
+	}
+
+	return hiddenOrShown;
+}
+
+// Returns the number of floors and walls in use
+int ALabGeometry::GetNumInstances() const
+{
+	return FloorInstanceOwners.Num() + WallInstanceOwners.Num();
+}
+// Returns the number of components drawing the geometry
+int ALabGeometry::GetNumPrimitives() const
+{
+	return (FloorInstanceOwners.Num() > 0 ? 1 : 0) + (WallInstanceOwners.Num() > 0 ? 1 : 0) + MergedMeshes.Num() - MergedPool.Num();
+}
+
+// Copies everything that affects drawing and collision from the template
+void ALabGeometry::CopyFromTemplate(UPrimitiveComponent * component, const UStaticMeshComponent * meshTemplate)
+{
+	UStaticMeshComponent* staticMesh = Cast<UStaticMeshComponent>(component);
+	if (staticMesh)
+		staticMesh->SetStaticMesh(meshTemplate->GetStaticMesh());
+	for (int i = 0; i < meshTemplate->GetNumMaterials(); ++i)
+		component->SetMaterial(i, meshTemplate->GetMaterial(i));
+	component->SetCastShadow(meshTemplate->CastShadow);
+	component->BodyInstance.CopyBodyInstancePropertiesFrom(&meshTemplate->BodyInstance);
+	component->SetCollisionEnabled(meshTemplate->GetCollisionEnabled());
+}
+// Returns the transform the piece would have as an actor placed with PlaceObject
+FTransform ALabGeometry::GetPieceTransform(const FTransform & meshTransform, const int botLeftX, const int botLeftY, const int sizeX, const int sizeY)
+{
+	// Floors and walls are placed facing up, their base size is one cell
+	FVector location = FVector::ZeroVector;
+	AMainGameMode::GridToWorld(botLeftX, botLeftY, sizeX, sizeY, location.X, location.Y);
+	FTransform actorTransform = FTransform(FQuat::Identity, location, FVector(sizeY, sizeX, 1.f)); // We reverse x and y
+
+	return meshTransform * actorTransform;
+}
+// Adds an instance to the owner's floors or walls
+void ALabGeometry::AddInstance(const void * owner, const bool isWall, const FTransform & transform)
+{
+	UHierarchicalInstancedStaticMeshComponent* component = isWall ? InstancedWalls : InstancedFloors;
+	if (!component)
+		return;
+
+	int32 index = component->AddInstanceWorldSpace(transform);
+	(isWall ? WallInstanceOwners : FloorInstanceOwners).Add(owner);
+	FInstancedPiecesStruct& pieces = InstancedPieces.FindOrAdd(owner);
+	(isWall ? pieces.Walls : pieces.Floors).Add(index);
+}
+// Removes the instance by moving the last instance of the mesh in its place, so indices of other owners stay correct
+void ALabGeometry::RemoveInstance(const bool isWall, const int32 index)
+{
+	UHierarchicalInstancedStaticMeshComponent* component = isWall ? InstancedWalls : InstancedFloors;
+	TArray<const void*>& owners = isWall ? WallInstanceOwners : FloorInstanceOwners;
+	int32 last = owners.Num() - 1;
+	if (!component || !owners.IsValidIndex(index))
+		return;
+
+	if (index != last)
+	{
+		FTransform transform;
+		component->GetInstanceTransform(last, transform, true);
+		component->UpdateInstanceTransform(index, transform, true, false, true);
+
+		// The moved instance keeps its owner
+		const void* movedOwner = owners[last];
+		owners[index] = movedOwner;
+		FInstancedPiecesStruct& moved = InstancedPieces[movedOwner];
+		TArray<int32>& movedIndices = isWall ? moved.Walls : moved.Floors;
+		movedIndices[movedIndices.Find(last)] = index;
+	}
+
+	// Removing the last instance never moves any other
+	component->RemoveInstance(last);
+	owners.Pop(false);
+}
+
+// Adds a piece to the owner's merged mesh
+void ALabGeometry::AddMergedPiece(const void * owner, const FBox & box, const bool isWall)
+{
+	FMergedPiecesStruct* found = MergedPieces.Find(owner);
+	if (!found || !found->Host)
+		SetMergedHost(owner, owner);
+
+	FMergedPiecesStruct& pieces = MergedPieces[owner];
+	(isWall ? pieces.Walls : pieces.Floors).Add(box);
+	MergedChanged.Add(pieces.Host);
+}
+// Returns the host's boxes relative to the returned origin, the key of built meshes with the same dimensions
+FVector ALabGeometry::GetMergedBoxes(const void * host, TArray<FBox>& floors, TArray<FBox>& walls, FIntPoint & dimensions) const
+{
+	for (const void* part : MergedHosts[host].Parts)
+	{
+		const FMergedPiecesStruct& pieces = MergedPieces[part];
+		floors.Append(pieces.Floors);
+		walls.Append(pieces.Walls);
+	}
+
+	FBox bounds(ForceInit);
+	for (const FBox& box : floors)
+		bounds += box;
+	for (const FBox& box : walls)
+		bounds += box;
+	if (!bounds.IsValid)
+	{
+		dimensions = FIntPoint::ZeroValue;
+		return FVector::ZeroVector;
+	}
+
+	// Boxes are moved next to the origin so rooms of the same shape have the same boxes
+	FVector origin = FVector(bounds.Min.X, bounds.Min.Y, 0.f);
+	for (FBox& box : floors)
+		box = box.ShiftBy(-origin);
+	for (FBox& box : walls)
+		box = box.ShiftBy(-origin);
+
+	FVector size = bounds.GetSize();
+	dimensions = FIntPoint(FMath::RoundToInt(size.X), FMath::RoundToInt(size.Y));
+	return origin;
+}
+// Returns a built mesh with the same boxes or nullptr
+TSharedPtr<const FMergedMeshStruct, ESPMode::ThreadSafe> ALabGeometry::FindMergedMesh(const FIntPoint & dimensions, const TArray<FBox>& floors, const TArray<FBox>& walls) const
+{
+	// Boxes moved next to the origin can be off by a rounding error
+	auto sameBoxes = [](const TArray<FBox>& a, const TArray<FBox>& b)
+	{
+		if (a.Num() != b.Num())
+			return false;
+		for (int i = 0; i < a.Num(); ++i)
+			if (!a[i].Min.Equals(b[i].Min, 1.f) || !a[i].Max.Equals(b[i].Max, 1.f))
+				return false;
+		return true;
+	};
+
+	TArray<TSharedRef<const FMergedMeshStruct, ESPMode::ThreadSafe>> built;
+	BuiltMergedMeshes.MultiFind(dimensions, built);
+	for (const TSharedRef<const FMergedMeshStruct, ESPMode::ThreadSafe>& mesh : built)
+		if (sameBoxes(mesh->Floors, floors) && sameBoxes(mesh->Walls, walls))
+			return mesh;
+
+	return nullptr;
+}
+// Keeps the built mesh for rooms of the same shape
+void ALabGeometry::CacheMergedMesh(const FIntPoint & dimensions, const TSharedRef<const FMergedMeshStruct, ESPMode::ThreadSafe>& mesh)
+{
+	// Rooms of the same shape could be built at the same time
+	if (BuiltMergedMeshes.Num(dimensions) >= MaxBuiltMergedMeshes || FindMergedMesh(dimensions, mesh->Floors, mesh->Walls).IsValid())
+		return;
+
+	BuiltMergedMeshes.Add(dimensions, mesh);
+}
+// Starts building the host's merged mesh on a worker thread unless a mesh with the same boxes was built before
+void ALabGeometry::BuildMerged(const void * host, const bool now)
+{
+	FMergedHostStruct& merged = MergedHosts[host];
+	int serial = merged.BuildSerial = ++LastBuildSerial;
+
+	// Boxes are copied into the mesh so the host can change while it's built
+	TSharedRef<FMergedMeshStruct, ESPMode::ThreadSafe> mesh = MakeShared<FMergedMeshStruct, ESPMode::ThreadSafe>();
+	FIntPoint dimensions;
+	FVector origin = GetMergedBoxes(host, mesh->Floors, mesh->Walls, dimensions);
+
+	// Rooms of the same shape take the mesh built for the first of them
+	TSharedPtr<const FMergedMeshStruct, ESPMode::ThreadSafe> built = FindMergedMesh(dimensions, mesh->Floors, mesh->Walls);
+	if (built.IsValid())
+	{
+		ApplyMerged(host, serial, origin, *built, now);
+		return;
+	}
+
+	if (now)
+	{
+		BuildMergedMesh(*mesh);
+		CacheMergedMesh(dimensions, mesh);
+		ApplyMerged(host, serial, origin, *mesh, true);
+		return;
+	}
+
+	TWeakObjectPtr<ALabGeometry> geometry = this;
+	FFunctionGraphTask::CreateAndDispatchWhenReady([geometry, host, serial, origin, dimensions, mesh]()
+	{
+		BuildMergedMesh(*mesh);
+
+		// Components can only be changed on the game thread
+		FFunctionGraphTask::CreateAndDispatchWhenReady([geometry, host, serial, origin, dimensions, mesh]()
+		{
+			if (!geometry.IsValid())
+				return;
+			geometry->CacheMergedMesh(dimensions, mesh);
+			geometry->ApplyMerged(host, serial, origin, *mesh);
+		}, TStatId(), nullptr, ENamedThreads::GameThread);
+	}, TStatId(), nullptr, ENamedThreads::AnyThread);
+}
+// Builds a mesh from boxes, only reads its arguments so it can be called from worker threads
+void ALabGeometry::BuildMergedMesh(FMergedMeshStruct & mesh)
+{
+	const TArray<FBox>* boxesBySection[2] = { &mesh.Floors, &mesh.Walls };
+	for (int section = 0; section < 2; ++section)
+	{
+		FMergedSectionStruct& result = mesh.Sections[section];
+		for (const FBox& box : *boxesBySection[section])
+		{
+			// A box around the origin is moved to its place
+			TArray<FVector> vertices;
+			TArray<int32> triangles;
+			TArray<FVector> normals;
+			TArray<FVector2D> uvs;
+			TArray<FProcMeshTangent> tangents;
+			UKismetProceduralMeshLibrary::GenerateBoxMesh(box.GetExtent(), vertices, triangles, normals, uvs, tangents);
+
+			int firstVertex = result.Vertices.Num();
+			FVector center = box.GetCenter();
+			for (const FVector& vertex : vertices)
+				result.Vertices.Add(vertex + center);
+			for (int32 index : triangles)
+				result.Triangles.Add(index + firstVertex);
+			result.Normals.Append(normals);
+			result.UVs.Append(uvs);
+			result.Tangents.Append(tangents);
+
+			// Every wall is a box in the same body, floors collide with the floor collision
+			if (section == 0)
+				continue;
+			TArray<FVector>& convex = mesh.Convexes[mesh.Convexes.AddDefaulted()];
+			for (int corner = 0; corner < 8; ++corner)
+				convex.Add(FVector(corner & 1 ? box.Max.X : box.Min.X, corner & 2 ? box.Max.Y : box.Min.Y, corner & 4 ? box.Max.Z : box.Min.Z));
+		}
+	}
+}
+// Gives the built mesh to the host if it's still the last build started, collision is cooked on the game thread if cookNow is true
+void ALabGeometry::ApplyMerged(const void * host, const int serial, const FVector & origin, const FMergedMeshStruct & mesh, const bool cookNow)
+{
+	FMergedHostStruct* merged = MergedHosts.Find(host);
+	if (!merged || merged->BuildSerial != serial)
+		return;
+
+	// Hosts without floors and walls don't need a mesh
+	if (mesh.Sections[0].Vertices.Num() == 0 && mesh.Sections[1].Vertices.Num() == 0)
+	{
+		if (merged->Mesh)
+			PoolMergedMesh(merged->Mesh);
+		merged->Mesh = nullptr;
+		return;
+	}
+
+	if (!merged->Mesh)
+	{
+		merged->Mesh = GetMergedMesh();
+		merged->Mesh->SetHiddenInGame(merged->bIsHidden);
+	}
+	UProceduralMeshComponent* component = merged->Mesh;
+	component->SetWorldLocation(origin);
+
+	for (int section = 0; section < 2; ++section)
+	{
+		const FMergedSectionStruct& data = mesh.Sections[section];
+		if (data.Vertices.Num() == 0)
+			component->ClearMeshSection(section);
+		else
+			component->CreateMeshSection(section, data.Vertices, data.Triangles, data.Normals, data.UVs, TArray<FColor>(), data.Tangents, false);
+	}
+
+	// Pieces around the player can't wait for a worker to cook their collision
+	component->bUseAsyncCooking = !cookNow;
+	component->SetCollisionConvexMeshes(mesh.Convexes);
+}
+// Removes the host and pools its mesh
+void ALabGeometry::RemoveMergedHost(const void * host)
+{
+	FMergedHostStruct merged;
+	if (MergedHosts.RemoveAndCopyValue(host, merged) && merged.Mesh)
+		PoolMergedMesh(merged.Mesh);
+	MergedChanged.Remove(host);
+	UpdateFloorCollision();
+}
+// Returns a pooled empty mesh or a new one
+UProceduralMeshComponent * ALabGeometry::GetMergedMesh()
+{
+	if (MergedPool.Num() > 0)
+		return MergedPool.Pop();
+
+	UProceduralMeshComponent* mesh = NewObject<UProceduralMeshComponent>(this);
+	mesh->SetupAttachment(RootComponent);
+	mesh->SetMobility(EComponentMobility::Movable);
+	mesh->bUseComplexAsSimpleCollision = false;
+	mesh->bUseAsyncCooking = true;
+
+	// The mesh collides like walls, floors and walls are drawn with the materials of their templates
+	if (WallTemplate)
+		CopyFromTemplate(mesh, WallTemplate);
+	if (FloorTemplate)
+		mesh->SetMaterial(0, FloorTemplate->GetMaterial(0));
+	if (WallTemplate)
+		mesh->SetMaterial(1, WallTemplate->GetMaterial(0));
+
+	mesh->RegisterComponent();
+	MergedMeshes.Add(mesh);
+	return mesh;
+}
+// Removes the mesh's sections and collision and pools it
+void ALabGeometry::PoolMergedMesh(UProceduralMeshComponent * mesh)
+{
+	mesh->ClearAllMeshSections();
+	mesh->ClearCollisionConvexMeshes();
+	mesh->SetHiddenInGame(false);
+	MergedPool.Add(mesh);
+}
+// Lets floors collide only while there are merged meshes
+void ALabGeometry::UpdateFloorCollision()
+{
+	if (!FloorCollision || !FloorTemplate)
+		return;
+
+	ECollisionEnabled::Type collision = MergedHosts.Num() > 0 ? FloorTemplate->GetCollisionEnabled() : ECollisionEnabled::NoCollision;
+	if (FloorCollision->GetCollisionEnabled() != collision)
+		FloorCollision->SetCollisionEnabled(collision);
+}
+
+// Sets default values
+ALabGeometry::ALabGeometry()
+{
+	// Instances are in world space, instanced meshes are created in Init and merged meshes for rooms as they spawn
+	USceneComponent* root = CreateDefaultSubobject<USceneComponent>(TEXT("Root"));
+	SetRootComponent(root);
+
+	// Merged meshes are built once a frame
+	PrimaryActorTick.bCanEverTick = true;
+}
+
+// Called every frame
+void ALabGeometry::Tick(const float deltaTime)
+{
+	Super::Tick(deltaTime);
+
+	for (const void* host : MergedChanged)
+		BuildMerged(host);
+	MergedChanged.Empty();
+
+	SET_DWORD_STAT(STAT_GeometryInstances, GetNumInstances());
+	SET_DWORD_STAT(STAT_GeometryPrimitives, GetNumPrimitives());
+}
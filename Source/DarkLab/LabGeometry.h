@@ -0,0 +1,191 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GameFramework/Actor.h"
+#include "ProceduralMeshComponent.h"
+#include "LabGeometry.generated.h"
+
+// How floors and walls are spawned
+UENUM(BlueprintType)
+enum class EGeometryModeEnum : uint8
+{
+	VE_Actors 	UMETA(DisplayName = "Actors"),
+	VE_Instanced 	UMETA(DisplayName = "Instanced"),
+	VE_Merged	UMETA(DisplayName = "Merged")
+};
+
+// Floors or walls of one room merged into a single section
+struct FMergedSectionStruct
+{
+	TArray<FVector> Vertices;
+	TArray<int32> Triangles;
+	TArray<FVector> Normals;
+	TArray<FVector2D> UVs;
+	TArray<FProcMeshTangent> Tangents;
+};
+
+// Floors and walls of one room and its passages merged into one mesh, relative to the mesh's origin
+struct FMergedMeshStruct
+{
+	// Boxes the mesh is built from, rooms with the same boxes share the same built mesh
+	TArray<FBox> Floors;
+	TArray<FBox> Walls;
+	// Floors are the first section and walls are the second, each with the material of its template
+	FMergedSectionStruct Sections[2];
+	// A box per wall, all in one body, floors collide with the laboratory's floor collision instead
+	TArray<TArray<FVector>> Convexes;
+};
+
+// Floors and walls of one owner drawn as instances of the shared floor and wall meshes
+struct FInstancedPiecesStruct
+{
+	// Indices of the owner's instances
+	TArray<int32> Floors;
+	TArray<int32> Walls;
+};
+
+// Floors and walls of one owner that are merged
+struct FMergedPiecesStruct
+{
+	TArray<FBox> Floors;
+	TArray<FBox> Walls;
+	// The owner whose mesh the pieces are merged into, passages are merged into one of their rooms
+	const void* Host = nullptr;
+};
+
+// The merged mesh of one room and its passages
+struct FMergedHostStruct
+{
+	// Owners whose pieces are in the mesh
+	TArray<const void*> Parts;
+	// The mesh and the last build started for it
+	class UProceduralMeshComponent* Mesh = nullptr;
+	int BuildSerial = 0;
+	// True if the host is culled
+	bool bIsHidden = false;
+};
+
+// Floors and walls of the whole laboratory drawn as instances of one floor and one wall mesh, or merged into one mesh per room, instead of per piece
+UCLASS()
+class DARKLAB_API ALabGeometry : public AActor
+{
+	GENERATED_BODY()
+
+public:
+	// Takes mesh, materials and collision from the floor and wall blueprints' meshes
+	void Init(class UStaticMeshComponent* floorTemplate, class UStaticMeshComponent* wallTemplate);
+	// Returns true if both floors and walls have meshes to instance
+	bool IsReady() const;
+
+	// Adds a floor or a wall that belongs to the owner, sizes are the same PlaceObject takes
+	// Merged pieces are built into the mesh of the owner's host off the game thread at the end of the frame
+	void AddFloor(const void* owner, const int botLeftX, const int botLeftY, const int sizeX, const int sizeY, const EGeometryModeEnum mode = EGeometryModeEnum::VE_Instanced);
+	void AddWall(const void* owner, const int botLeftX, const int botLeftY, const int sizeX, const int sizeY, const EGeometryModeEnum mode = EGeometryModeEnum::VE_Instanced);
+	// Merges the owner's pieces into the host's mesh, owners host themselves by default
+	void SetMergedHost(const void* owner, const void* host);
+	// Removes all floors and walls of the owner, owners it hosted start hosting themselves
+	void RemoveAll(const void* owner);
+	// Builds merged meshes that changed right away on the game thread, collision is cooked right away too
+	void BuildMergedNow();
+	// Same, but only for the mesh the owner's pieces are merged into
+	void BuildMergedNow(const void* owner);
+	// Stops or resumes drawing the owner's merged mesh, collision is kept, returns the number of components hidden or shown
+	// Owners merged into another owner's mesh are drawn with it
+	// Instanced meshes are shared by the whole laboratory and cull their own clusters
+	int SetHidden(const void* owner, const bool hidden);
+
+	// Returns the number of floors and walls in use
+	int GetNumInstances() const;
+	// Returns the number of components drawing the geometry
+	int GetNumPrimitives() const;
+
+private:
+	// Copies everything that affects drawing and collision from the template
+	static void CopyFromTemplate(class UPrimitiveComponent* component, const class UStaticMeshComponent* meshTemplate);
+	// Returns the transform the piece would have as an actor placed with PlaceObject
+	static FTransform GetPieceTransform(const FTransform& meshTransform, const int botLeftX, const int botLeftY, const int sizeX, const int sizeY);
+	// Adds an instance to the owner's floors or walls
+	void AddInstance(const void* owner, const bool isWall, const FTransform& transform);
+	// Removes the instance by moving the last instance of the mesh in its place, so indices of other owners stay correct
+	void RemoveInstance(const bool isWall, const int32 index);
+
+	// Adds a piece to the owner's merged mesh
+	void AddMergedPiece(const void* owner, const FBox& box, const bool isWall);
+	// Returns the host's boxes relative to the returned origin, the key of built meshes with the same dimensions
+	FVector GetMergedBoxes(const void* host, TArray<FBox>& floors, TArray<FBox>& walls, FIntPoint& dimensions) const;
+	// Returns a built mesh with the same boxes or nullptr
+	TSharedPtr<const FMergedMeshStruct, ESPMode::ThreadSafe> FindMergedMesh(const FIntPoint& dimensions, const TArray<FBox>& floors, const TArray<FBox>& walls) const;
+	// Keeps the built mesh for rooms of the same shape
+	void CacheMergedMesh(const FIntPoint& dimensions, const TSharedRef<const FMergedMeshStruct, ESPMode::ThreadSafe>& mesh);
+	// Starts building the host's merged mesh on a worker thread unless a mesh with the same boxes was built before
+	// Builds it right away on the game thread if now is true
+	void BuildMerged(const void* host, const bool now = false);
+	// Builds a mesh from boxes, only reads its arguments so it can be called from worker threads
+	static void BuildMergedMesh(FMergedMeshStruct& mesh);
+	// Gives the built mesh to the host if it's still the last build started, collision is cooked on the game thread if cookNow is true
+	void ApplyMerged(const void* host, const int serial, const FVector& origin, const FMergedMeshStruct& mesh, const bool cookNow = false);
+	// Removes the host and pools its mesh
+	void RemoveMergedHost(const void* host);
+	// Returns a pooled empty mesh or a new one
+	class UProceduralMeshComponent* GetMergedMesh();
+	// Removes the mesh's sections and collision and pools it
+	void PoolMergedMesh(class UProceduralMeshComponent* mesh);
+	// Lets floors collide only while there are merged meshes
+	void UpdateFloorCollision();
+
+protected:
+	// Instances of all floors and walls
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Geometry: Components")
+	class UHierarchicalInstancedStaticMeshComponent* InstancedFloors;
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Geometry: Components")
+	class UHierarchicalInstancedStaticMeshComponent* InstancedWalls;
+	// All merged meshes, used or pooled
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Geometry: Components")
+	TArray<class UProceduralMeshComponent*> MergedMeshes;
+	// Collision of all merged floors, merged meshes only collide with walls
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Geometry: Components")
+	class UBoxComponent* FloorCollision;
+
+private:
+	// Transforms of the template meshes relative to their actors
+	FTransform FloorMeshTransform;
+	FTransform WallMeshTransform;
+	// Bounds of one cell pieces relative to their actors
+	FBox FloorBounds = FBox(ForceInit);
+	FBox WallBounds = FBox(ForceInit);
+	// Templates merged meshes take materials and collision from
+	UPROPERTY()
+	class UStaticMeshComponent* FloorTemplate;
+	UPROPERTY()
+	class UStaticMeshComponent* WallTemplate;
+
+	// Instanced pieces by owner and owners by instance index
+	TMap<const void*, FInstancedPiecesStruct> InstancedPieces;
+	TArray<const void*> FloorInstanceOwners;
+	TArray<const void*> WallInstanceOwners;
+
+	// Merged pieces by owner, merged meshes by host and hosts whose meshes have to be built
+	TMap<const void*, FMergedPiecesStruct> MergedPieces;
+	TMap<const void*, FMergedHostStruct> MergedHosts;
+	TSet<const void*> MergedChanged;
+	// Built meshes by the rounded size of their boxes, so rooms of the same shape skip building
+	TMultiMap<FIntPoint, TSharedRef<const FMergedMeshStruct, ESPMode::ThreadSafe>> BuiltMergedMeshes;
+	// Merged meshes without sections
+	TArray<class UProceduralMeshComponent*> MergedPool;
+	// Every build gets a new serial so late results can be told apart
+	int LastBuildSerial = 0;
+
+	// Half the size of the floor collision, it covers the whole laboratory
+	static const float FloorCollisionExtent;
+	// How many built meshes with the same dimensions are kept
+	static const int MaxBuiltMergedMeshes;
+
+public:
+	// Sets default values
+	ALabGeometry();
+
+	// Called every frame
+	virtual void Tick(const float deltaTime) override;
+};
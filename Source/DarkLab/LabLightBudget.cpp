@@ -0,0 +1,217 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "LabLightBudget.h"
+#include "HAL/IConsoleManager.h"
+#include "Components/PointLightComponent.h"
+#include "UObject/UObjectIterator.h"
+#include "BasicDeactivatableObject.h"
+#include "LabRoomGraph.h"
+#include "LabScalability.h"
+#include "DarkLab.h"
+
+// Other constants
+const float LabLightBudget::CarriedImportance = 3.f;
+const float LabLightBudget::BehindViewFactor = 0.25f;
+const float LabLightBudget::HiddenRoomFactor = 0.1f;
+
+// Stats
+DECLARE_CYCLE_STAT(TEXT("Light budget"), STAT_LightBudget, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Light budget: ranked"), STAT_LightBudgetRanked, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Light budget: shadowed"), STAT_LightBudgetShadowed, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Light budget: not drawn"), STAT_LightBudgetNotDrawn, STATGROUP_DarkLab);
+
+// Console variables
+static TAutoConsoleVariable<int32> CVarLightBudget(
+	TEXT("lab.Light.Budget"),
+	1,
+	TEXT("If 1, only the most important lights cast shadows and the least important ones are not drawn, as lab.Light.MaxShadowed and lab.Light.MaxDrawn say"),
+	ECVF_Default);
+
+// Ranks visible lights of the world by their size on screen and whether their rooms can be seen, then applies the limits
+void LabLightBudget::Update(UWorld* world, const AActor* pawn, const FVector viewLocation, const FVector viewDirection, const LabRoomGraph& graph, const TSet<LabRoom*>& visibleRooms)
+{
+	SCOPE_CYCLE_COUNTER(STAT_LightBudget);
+
+	if (CVarLightBudget.GetValueOnGameThread() == 0)
+	{
+		Restore();
+		return;
+	}
+
+	// Destroyed lights have nothing to give back
+	for (auto it = Unshadowed.CreateIterator(); it; ++it)
+		if (!it->IsValid())
+			it.RemoveCurrent();
+	for (auto it = NotDrawn.CreateIterator(); it; ++it)
+		if (!it->IsValid())
+			it.RemoveCurrent();
+	for (auto it = ShadowsDenied.CreateIterator(); it; ++it)
+		if (!it->IsValid())
+			it.RemoveCurrent();
+
+	// Same lights as GetLightingAmount uses
+	TArray<FRankedLightStruct> ranked;
+	for (TObjectIterator<UPointLightComponent> Itr; Itr; ++Itr)
+	{
+		// World Check
+		if (Itr->GetWorld() != world)
+			continue;
+
+		// Invisible lights are not drawn anyway
+		if ((!Itr->IsVisible()) || Itr->bHiddenInGame || !Itr->GetOwner() || Itr->GetOwner()->bHidden)
+			continue;
+
+		// Lights of culled rooms are left to culling and lights of parked objects to parking
+		ABasicDeactivatableObject* owner = Cast<ABasicDeactivatableObject>(Itr->GetOwner());
+		if (owner && (owner->IsCulled() || owner->IsParked()))
+			continue;
+
+		// Lights drawn by something else are not ours to take
+		if (!Itr->bAffectsWorld && !NotDrawn.Contains(*Itr))
+			continue;
+
+		FRankedLightStruct light;
+		light.Light = *Itr;
+		light.Importance = GetImportance(*Itr, pawn, viewLocation, viewDirection, graph, visibleRooms);
+		ranked.Add(light);
+	}
+	ranked.Sort([](const FRankedLightStruct& a, const FRankedLightStruct& b) { return a.Importance > b.Importance; });
+
+	int maxShadowed = LabScalability::GetMaxShadowedLights();
+	int maxDrawn = LabScalability::GetMaxDrawnLights();
+	int shadowed = 0;
+	for (int i = 0; i < ranked.Num(); ++i)
+	{
+		UPointLightComponent* light = ranked[i].Light;
+		bool drawn = maxDrawn <= 0 || i < maxDrawn;
+		SetDrawn(light, drawn);
+
+		// Denied lights don't count towards the limit
+		if (ShadowsDenied.Contains(light))
+		{
+			SetShadowed(light, false);
+			continue;
+		}
+
+		// Only lights that have shadows of their own count towards the limit
+		if (!light->CastShadows && !Unshadowed.Contains(light))
+			continue;
+		bool hasShadows = drawn && (maxShadowed <= 0 || shadowed < maxShadowed);
+		SetShadowed(light, hasShadows);
+		if (hasShadows)
+			++shadowed;
+	}
+
+	NumRanked = ranked.Num();
+	NumShadowed = shadowed;
+
+	SET_DWORD_STAT(STAT_LightBudgetRanked, NumRanked);
+	SET_DWORD_STAT(STAT_LightBudgetShadowed, NumShadowed);
+	SET_DWORD_STAT(STAT_LightBudgetNotDrawn, NotDrawn.Num());
+}
+// Gives every light back its drawing and the shadows it's allowed to have
+void LabLightBudget::Restore()
+{
+	// Denied lights keep their shadows off, including the ones the budget hasn't ranked yet
+	for (const TWeakObjectPtr<UPointLightComponent>& light : ShadowsDenied)
+		if (light.IsValid())
+			SetShadowed(light.Get(), false);
+	for (auto it = Unshadowed.CreateIterator(); it; ++it)
+	{
+		if (ShadowsDenied.Contains(*it))
+			continue;
+		if (it->IsValid())
+			(*it)->SetCastShadows(true);
+		it.RemoveCurrent();
+	}
+	for (const TWeakObjectPtr<UPointLightComponent>& light : NotDrawn)
+		if (light.IsValid())
+			light->SetAffectsWorld(true);
+	NotDrawn.Empty();
+
+	NumRanked = 0;
+	NumShadowed = 0;
+}
+// Lights that never cast shadows whatever their rank, the game mode denies them to lamps of rooms lit long ago
+void LabLightBudget::SetShadowsDenied(const TSet<UPointLightComponent*>& lights)
+{
+	// Lights that are allowed again get their shadows back when they are ranked
+	ShadowsDenied.Empty(lights.Num());
+	for (UPointLightComponent* light : lights)
+		if (light)
+			ShadowsDenied.Add(light);
+}
+
+// Returns the number of lights ranked, casting shadows and not drawn last update
+int LabLightBudget::GetNumRanked() const
+{
+	return NumRanked;
+}
+int LabLightBudget::GetNumShadowed() const
+{
+	return NumShadowed;
+}
+int LabLightBudget::GetNumNotDrawn() const
+{
+	return NotDrawn.Num();
+}
+
+// Returns how much the light matters, lights the pawn carries and then lights around the camera matter more than any other
+float LabLightBudget::GetImportance(const UPointLightComponent* light, const AActor* pawn, const FVector viewLocation, const FVector viewDirection, const LabRoomGraph& graph, const TSet<LabRoom*>& visibleRooms)
+{
+	// The flashlight and the lighter are attached to the pawn, the camera looks from high above so it's not always inside their lights
+	if (pawn)
+		for (const AActor* actor = light->GetOwner(); actor; actor = actor->GetAttachParentActor())
+			if (actor == pawn)
+				return CarriedImportance;
+
+	FVector lightLocation = light->GetComponentLocation();
+	FVector toLight = lightLocation - viewLocation;
+	float distance = toLight.Size();
+	float radius = FMath::Max(light->AttenuationRadius, 1.f);
+
+	// The camera is inside the light
+	if (distance <= radius)
+		return 2.f - distance / radius;
+
+	// Roughly the part of the screen the light's sphere takes
+	float importance = FMath::Square(radius / distance);
+
+	// No part of the sphere is in front of the camera
+	if (FVector::DotProduct(toLight, viewDirection) < -radius)
+		importance *= BehindViewFactor;
+
+	// Light of rooms behind closed doors can only be seen through walls
+	LabRoom* room = graph.GetRoomAt(lightLocation);
+	if (room && !visibleRooms.Contains(room))
+		importance *= HiddenRoomFactor;
+
+	return importance;
+}
+// Turns shadows and drawing of the light on or off, only what the budget took is given back
+void LabLightBudget::SetShadowed(UPointLightComponent* light, const bool shadowed)
+{
+	if (shadowed)
+	{
+		if (Unshadowed.Remove(light) > 0)
+			light->SetCastShadows(true);
+	}
+	else if (light->CastShadows)
+	{
+		light->SetCastShadows(false);
+		Unshadowed.Add(light);
+	}
+}
+void LabLightBudget::SetDrawn(UPointLightComponent* light, const bool drawn)
+{
+	if (drawn)
+	{
+		if (NotDrawn.Remove(light) > 0)
+			light->SetAffectsWorld(true);
+	}
+	else if (light->bAffectsWorld)
+	{
+		light->SetAffectsWorld(false);
+		NotDrawn.Add(light);
+	}
+}
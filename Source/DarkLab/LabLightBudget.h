@@ -0,0 +1,61 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+class LabRoom;
+class LabRoomGraph;
+
+// A light and how much it matters to the player this frame
+struct FRankedLightStruct
+{
+	class UPointLightComponent* Light = nullptr;
+	float Importance = 0.f;
+};
+
+// Keeps the most important lights casting shadows and stops drawing the least important ones, set with lab.Light.Budget
+// Limits are lab.Light.MaxShadowed and lab.Light.MaxDrawn, both set by sg.LabLightBudgetQuality
+// Only changes whether lights are drawn, never whether they are visible, so light level queries and lamp states are not affected
+class DARKLAB_API LabLightBudget
+{
+public:
+	// Ranks visible lights of the world by their size on screen and whether their rooms can be seen, then applies the limits
+	// Visible rooms are the ones seen through open passages, lights the pawn carries always rank first
+	void Update(UWorld* world, const class AActor* pawn, const FVector viewLocation, const FVector viewDirection, const LabRoomGraph& graph, const TSet<LabRoom*>& visibleRooms);
+	// Gives every light back its drawing and the shadows it's allowed to have
+	void Restore();
+	// Lights that never cast shadows whatever their rank, the game mode denies them to lamps of rooms lit long ago
+	// The budget owns shadows of all lights, so lights stop being denied by not being in the next set
+	void SetShadowsDenied(const TSet<class UPointLightComponent*>& lights);
+
+	// Returns the number of lights ranked, casting shadows and not drawn last update
+	int GetNumRanked() const;
+	int GetNumShadowed() const;
+	int GetNumNotDrawn() const;
+
+private:
+	// Returns how much the light matters, lights the pawn carries and then lights around the camera matter more than any other
+	static float GetImportance(const class UPointLightComponent* light, const class AActor* pawn, const FVector viewLocation, const FVector viewDirection, const LabRoomGraph& graph, const TSet<LabRoom*>& visibleRooms);
+	// Turns shadows and drawing of the light on or off, only what the budget took is given back
+	void SetShadowed(class UPointLightComponent* light, const bool shadowed);
+	void SetDrawn(class UPointLightComponent* light, const bool drawn);
+
+private:
+	// Lights that had shadows and had them taken by the budget
+	TSet<TWeakObjectPtr<class UPointLightComponent>> Unshadowed;
+	// Lights the budget stopped drawing
+	TSet<TWeakObjectPtr<class UPointLightComponent>> NotDrawn;
+	// Lights that are not allowed to have shadows
+	TSet<TWeakObjectPtr<class UPointLightComponent>> ShadowsDenied;
+
+	// Counts of the last update
+	int NumRanked = 0;
+	int NumShadowed = 0;
+
+	// Importance of lights the pawn carries, above that of any other light
+	static const float CarriedImportance;
+	// Importance of lights in front of the camera and in rooms seen through open passages is not lowered
+	static const float BehindViewFactor;
+	static const float HiddenRoomFactor;
+};
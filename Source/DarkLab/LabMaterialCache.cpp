@@ -0,0 +1,116 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "LabMaterialCache.h"
+#include "HAL/IConsoleManager.h"
+#include "Components/MeshComponent.h"
+#include "Materials/MaterialInstanceDynamic.h"
+#include "UObject/Package.h"
+#include "DarkLab.h"
+
+// Stats
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Shared material instances"), STAT_SharedMaterialInstances, STATGROUP_DarkLab);
+
+// Console variables
+static TAutoConsoleVariable<int32> CVarSharedMaterials(
+	TEXT("lab.SharedMaterials"),
+	1,
+	TEXT("If 1, colored lamps and doorcards share material instances by color instead of having one each"),
+	ECVF_Default);
+
+// The parameter colored materials use
+static const FName ColorParameter = FName("Color");
+
+// Sets the Color parameter of all materials of the mesh, by giving it shared instances or with an instance of its own
+void LabMaterialCache::SetMeshColor(UMeshComponent* mesh, const FLinearColor color)
+{
+	if (!mesh)
+		return;
+
+	LabMaterialCache& cache = Get();
+	bool shared = CVarSharedMaterials.GetValueOnGameThread() != 0;
+	for (int i = 0; i < mesh->GetNumMaterials(); ++i)
+	{
+		UMaterialInterface* material = mesh->GetMaterial(i);
+		UMaterialInterface* parent = cache.GetSharedParent(material);
+
+		if (shared)
+		{
+			// Instances the mesh got while sharing was off are not shared, so they are not what instances are made from
+			UMaterialInstanceDynamic* instance = cache.GetInstance(GetBaseMaterial(material), color);
+			// Setting a material recreates render state, so it's only done if the color actually changes
+			if (instance && instance != material)
+				mesh->SetMaterial(i, instance);
+		}
+		// Shared instances must not be changed, the mesh gets its own one instead
+		else if (parent)
+			mesh->SetMaterial(i, parent);
+	}
+
+	// Same as it was before instances were shared
+	if (!shared)
+		mesh->SetVectorParameterValueOnMaterials(ColorParameter, FVector(color.R, color.G, color.B));
+}
+// Returns the number of shared instances
+int LabMaterialCache::GetNumInstances()
+{
+	return Get().Shared.Num();
+}
+
+// Keeps shared instances from being garbage collected
+void LabMaterialCache::AddReferencedObjects(FReferenceCollector& collector)
+{
+	for (TPair<UMaterialInterface*, TMap<FLinearColor, UMaterialInstanceDynamic*>>& pair : Instances)
+	{
+		collector.AddReferencedObject(pair.Key);
+		for (TPair<FLinearColor, UMaterialInstanceDynamic*>& instance : pair.Value)
+			collector.AddReferencedObject(instance.Value);
+	}
+}
+
+// The only cache, created when first used
+LabMaterialCache& LabMaterialCache::Get()
+{
+	static LabMaterialCache cache;
+	return cache;
+}
+
+// Returns the shared instance of the material with the color
+UMaterialInstanceDynamic* LabMaterialCache::GetInstance(UMaterialInterface* material, const FLinearColor color)
+{
+	if (!material)
+		return nullptr;
+
+	TMap<FLinearColor, UMaterialInstanceDynamic*>& colors = Instances.FindOrAdd(material);
+	UMaterialInstanceDynamic** found = colors.Find(color);
+	if (found)
+		return *found;
+
+	// Instances belong to no mesh so any mesh can use them
+	UMaterialInstanceDynamic* instance = UMaterialInstanceDynamic::Create(material, GetTransientPackage());
+	instance->SetVectorParameterValue(ColorParameter, FLinearColor(color.R, color.G, color.B));
+	colors.Add(color, instance);
+	Shared.Add(instance);
+
+	UE_LOG(LogDarkLab, Verbose, TEXT("Shared material instance of %s, color %s"), *material->GetName(), *color.ToString());
+	SET_DWORD_STAT(STAT_SharedMaterialInstances, Shared.Num());
+	return instance;
+}
+// Returns the material dynamic instances of the mesh, shared or its own, were made from
+UMaterialInterface* LabMaterialCache::GetBaseMaterial(UMaterialInterface* material)
+{
+	UMaterialInstanceDynamic* instance = Cast<UMaterialInstanceDynamic>(material);
+	while (instance && instance->Parent)
+	{
+		material = instance->Parent;
+		instance = Cast<UMaterialInstanceDynamic>(material);
+	}
+	return material;
+}
+// Returns the material the instance was made from if it's one of the shared instances
+UMaterialInterface* LabMaterialCache::GetSharedParent(UMaterialInterface* material) const
+{
+	UMaterialInstanceDynamic* instance = Cast<UMaterialInstanceDynamic>(material);
+	if (!instance || !Shared.Contains(instance))
+		return nullptr;
+	return instance->Parent;
+}
@@ -0,0 +1,36 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "UObject/GCObject.h"
+
+// Dynamic material instances shared by every mesh of the same material and color, set with lab.SharedMaterials
+// Colored objects only ever use a few colors, so they don't need an instance each
+class DARKLAB_API LabMaterialCache : public FGCObject
+{
+public:
+	// Sets the Color parameter of all materials of the mesh, by giving it shared instances or with an instance of its own
+	static void SetMeshColor(class UMeshComponent* mesh, const FLinearColor color);
+	// Returns the number of shared instances
+	static int GetNumInstances();
+
+	// Keeps shared instances from being garbage collected
+	virtual void AddReferencedObjects(FReferenceCollector& collector) override;
+
+private:
+	// The only cache, created when first used
+	static LabMaterialCache& Get();
+
+	// Returns the shared instance of the material with the color
+	class UMaterialInstanceDynamic* GetInstance(class UMaterialInterface* material, const FLinearColor color);
+	// Returns the material dynamic instances of the mesh, shared or its own, were made from
+	static class UMaterialInterface* GetBaseMaterial(class UMaterialInterface* material);
+	// Returns the material the instance was made from if it's one of the shared instances
+	class UMaterialInterface* GetSharedParent(class UMaterialInterface* material) const;
+
+	// Shared instances by the material they were made from and color
+	TMap<class UMaterialInterface*, TMap<FLinearColor, class UMaterialInstanceDynamic*>> Instances;
+	// All shared instances, to tell them apart from instances of single meshes
+	TSet<class UMaterialInstanceDynamic*> Shared;
+};
@@ -0,0 +1,122 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "LabNativeEvents.h"
+#include "HAL/IConsoleManager.h"
+#include "Engine/World.h"
+#include "UObject/UObjectGlobals.h"
+#include "BasicDeactivatableObject.h"
+#include "BasicPlaceableObject.h"
+#include "BasicActivatableObject.h"
+
+// Console variables
+static TAutoConsoleVariable<int32> CVarNativeEvents(
+	TEXT("lab.NativeEvents"),
+	1,
+	TEXT("If 1, interface events of objects that don't override them in blueprints call C++ implementations directly"),
+	ECVF_Default);
+
+// Set by benchmarks, -1 means the console variable is used
+static int EnabledOverride = -1;
+// Whether classes override events, filled when a class is first seen
+static TMap<TWeakObjectPtr<const UClass>, TMap<FName, bool>> OverriddenEvents;
+// True once the cache is bound to be cleared
+static bool bClearBound = false;
+
+// Returns true if calls skip reflection
+bool LabNativeEvents::IsEnabled()
+{
+	return EnabledOverride >= 0 ? EnabledOverride > 0 : CVarNativeEvents.GetValueOnGameThread() != 0;
+}
+// Used instead of lab.NativeEvents if not negative, so benchmarks don't depend on who set the variable
+void LabNativeEvents::SetEnabledOverride(const int enabled)
+{
+	EnabledOverride = enabled;
+}
+
+// Returns true if a blueprint in the class hierarchy implements the event, results are cached per class
+bool LabNativeEvents::IsOverridden(const UClass* cl, const FName eventName)
+{
+	if (!cl)
+		return true;
+
+	// Blueprints can change while the game runs in the editor and classes can be unloaded with their world
+	if (!bClearBound)
+	{
+		bClearBound = true;
+		FWorldDelegates::OnWorldCleanup.AddLambda([](UWorld* world, bool sessionEnded, bool cleanupResources) { ClearOverridden(); });
+#if WITH_EDITOR
+		// Compiled blueprints replace the instances of their classes
+		FCoreUObjectDelegates::OnObjectsReplaced.AddLambda([](const TMap<UObject*, UObject*>& replaced) { ClearOverridden(); });
+#endif
+	}
+
+	TMap<FName, bool>& events = OverriddenEvents.FindOrAdd(cl);
+	const bool* overridden = events.Find(eventName);
+	if (overridden)
+		return *overridden;
+
+	return events.Add(eventName, cl->IsFunctionImplementedInBlueprint(eventName));
+}
+// Forgets which classes override events, called when worlds are cleaned up and blueprints are compiled
+void LabNativeEvents::ClearOverridden()
+{
+	OverriddenEvents.Empty();
+}
+
+// Deactivatable
+void LabNativeEvents::SetActive(UObject* object, const bool active)
+{
+	ABasicDeactivatableObject* native = IsEnabled() ? Cast<ABasicDeactivatableObject>(object) : nullptr;
+	if (native && !IsOverridden(native->GetClass(), GET_FUNCTION_NAME_CHECKED(ABasicDeactivatableObject, SetActive)))
+		native->SetActive_Implementation(active);
+	else
+		IDeactivatable::Execute_SetActive(object, active);
+}
+
+// Placeable
+bool LabNativeEvents::SetSize(UObject* object, const FIntVector size)
+{
+	ABasicPlaceableObject* native = IsEnabled() ? Cast<ABasicPlaceableObject>(object) : nullptr;
+	if (native && !IsOverridden(native->GetClass(), GET_FUNCTION_NAME_CHECKED(ABasicPlaceableObject, SetSize)))
+		return native->SetSize_Implementation(size);
+	return IPlaceable::Execute_SetSize(object, size);
+}
+bool LabNativeEvents::SetSizeXY(UObject* object, const int x, const int y)
+{
+	ABasicPlaceableObject* native = IsEnabled() ? Cast<ABasicPlaceableObject>(object) : nullptr;
+	if (native && !IsOverridden(native->GetClass(), GET_FUNCTION_NAME_CHECKED(ABasicPlaceableObject, SetSizeXY)))
+		return native->SetSizeXY_Implementation(x, y);
+	return IPlaceable::Execute_SetSizeXY(object, x, y);
+}
+void LabNativeEvents::Place(UObject* object, const FIntVector botLeftLoc, const EDirectionEnum direction)
+{
+	ABasicPlaceableObject* native = IsEnabled() ? Cast<ABasicPlaceableObject>(object) : nullptr;
+	if (native && !IsOverridden(native->GetClass(), GET_FUNCTION_NAME_CHECKED(ABasicPlaceableObject, Place)))
+		native->Place_Implementation(botLeftLoc, direction);
+	else
+		IPlaceable::Execute_Place(object, botLeftLoc, direction);
+}
+// Returns true if ABasicPlaceableObject::PlaceAtOnce does the same as the events would for the object
+bool LabNativeEvents::CanPlaceAtOnce(const UObject* object)
+{
+	const ABasicPlaceableObject* native = Cast<ABasicPlaceableObject>(object);
+	if (!native)
+		return false;
+
+	// PlaceAtOnce repeats what the C++ implementations of all of these do
+	const UClass* cl = native->GetClass();
+	return !IsOverridden(cl, GET_FUNCTION_NAME_CHECKED(ABasicPlaceableObject, SetSize)) &&
+		!IsOverridden(cl, GET_FUNCTION_NAME_CHECKED(ABasicPlaceableObject, SetSizeXY)) &&
+		!IsOverridden(cl, GET_FUNCTION_NAME_CHECKED(ABasicPlaceableObject, Place)) &&
+		!IsOverridden(cl, GET_FUNCTION_NAME_CHECKED(ABasicPlaceableObject, GetSize));
+}
+
+// Activatable
+void LabNativeEvents::ActivateIndirectly(UObject* object)
+{
+	ABasicActivatableObject* native = IsEnabled() ? Cast<ABasicActivatableObject>(object) : nullptr;
+	if (native && !IsOverridden(native->GetClass(), GET_FUNCTION_NAME_CHECKED(ABasicActivatableObject, ActivateIndirectly)))
+		native->ActivateIndirectly_Implementation();
+	else
+		IActivatable::Execute_ActivateIndirectly(object);
+}
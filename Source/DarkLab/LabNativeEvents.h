@@ -0,0 +1,35 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Placeable.h"
+
+// Calls events of our interfaces on our own objects without ProcessEvent, set with lab.NativeEvents
+// Execute_ functions always go through reflection, so they are only used for classes that override the event in a blueprint
+class DARKLAB_API LabNativeEvents
+{
+public:
+	// Returns true if calls skip reflection
+	static bool IsEnabled();
+	// Used instead of lab.NativeEvents if not negative, so benchmarks don't depend on who set the variable
+	static void SetEnabledOverride(const int enabled);
+
+	// Returns true if a blueprint in the class hierarchy implements the event, results are cached per class
+	static bool IsOverridden(const UClass* cl, const FName eventName);
+	// Forgets which classes override events, called when worlds are cleaned up and blueprints are compiled
+	static void ClearOverridden();
+
+	// Deactivatable
+	static void SetActive(UObject* object, const bool active);
+
+	// Placeable
+	static bool SetSize(UObject* object, const FIntVector size);
+	static bool SetSizeXY(UObject* object, const int x, const int y);
+	static void Place(UObject* object, const FIntVector botLeftLoc, const EDirectionEnum direction);
+	// Returns true if ABasicPlaceableObject::PlaceAtOnce does the same as the events would for the object
+	static bool CanPlaceAtOnce(const UObject* object);
+
+	// Activatable
+	static void ActivateIndirectly(UObject* object);
+};
@@ -0,0 +1,620 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "LabRoomGraph.h"
+#include "LabRoom.h"
+#include "LabPassage.h"
+#include "MainGameMode.h"
+#include "Templates/Function.h"
+
+// Other constants
+const float LabRoomGraph::DoorCost = 200.f;
+
+// Keeps track of the room for spatial queries
+void LabRoomGraph::AddRoom(LabRoom * room)
+{
+	if (!room)
+		return;
+
+	FIntPoint min = GetBucket(room->BotLeftX, room->BotLeftY);
+	FIntPoint max = GetBucket(room->BotLeftX + room->SizeX - 1, room->BotLeftY + room->SizeY - 1);
+	for (int x = min.X; x <= max.X; ++x)
+		for (int y = min.Y; y <= max.Y; ++y)
+			Buckets.FindOrAdd(FIntPoint(x, y)).AddUnique(room);
+
+	HopsToLight.Add(room, MaxHopsToLight);
+	HopsChanged.Add(room);
+}
+// Forgets the room and cuts cached paths that go through it
+// Should be called before the room is deleted
+void LabRoomGraph::RemoveRoom(LabRoom * room)
+{
+	if (!room)
+		return;
+
+	FIntPoint min = GetBucket(room->BotLeftX, room->BotLeftY);
+	FIntPoint max = GetBucket(room->BotLeftX + room->SizeX - 1, room->BotLeftY + room->SizeY - 1);
+	for (int x = min.X; x <= max.X; ++x)
+	{
+		for (int y = min.Y; y <= max.Y; ++y)
+		{
+			TArray<LabRoom*>* bucket = Buckets.Find(FIntPoint(x, y));
+			if (!bucket)
+				continue;
+			bucket->Remove(room);
+			if (bucket->Num() == 0)
+				Buckets.Remove(FIntPoint(x, y));
+		}
+	}
+
+	// Neighbours may now be further from light
+	for (LabPassage* passage : room->Passages)
+	{
+		LabRoom* other = GetOtherRoom(passage, room);
+		if (other)
+			HopsChanged.Add(other);
+	}
+	HopsToLight.Remove(room);
+	LitRooms.Remove(room);
+	HopsChanged.Remove(room);
+	bFlowFieldDirty = true;
+
+	for (TPair<const void*, FRoomPathStruct>& pair : CachedPaths)
+	{
+		if (pair.Value.Goal == room)
+			pair.Value.Goal = nullptr;
+		int index = pair.Value.Rooms.Find(room);
+		if (index != INDEX_NONE)
+			CutPath(pair.Value, index);
+	}
+}
+// Cuts cached paths that go through the passage
+// Should be called before the passage is deleted
+void LabRoomGraph::RemovePassage(LabPassage * passage)
+{
+	if (!passage)
+		return;
+
+	MarkPassagesChanged(passage->From);
+	MarkPassagesChanged(passage->To);
+
+	for (TPair<const void*, FRoomPathStruct>& pair : CachedPaths)
+	{
+		int index = pair.Value.Passages.Find(passage);
+		if (index != INDEX_NONE)
+			CutPath(pair.Value, index + 1);
+	}
+}
+// Forgets all rooms and paths
+void LabRoomGraph::Empty()
+{
+	Buckets.Empty();
+	CachedPaths.Empty();
+	HopsToLight.Empty();
+	LitRooms.Empty();
+	HopsChanged.Empty();
+	FlowField.Empty();
+	FlowGoal = nullptr;
+	bFlowFieldDirty = true;
+}
+
+// Returns the room that contains the grid cell, rooms whose floor contains it are preferred over rooms whose wall does
+LabRoom * LabRoomGraph::GetRoomAt(const int x, const int y) const
+{
+	const TArray<LabRoom*>* bucket = Buckets.Find(GetBucket(x, y));
+	if (!bucket)
+		return nullptr;
+
+	LabRoom* onWall = nullptr;
+	for (LabRoom* room : *bucket)
+	{
+		if (x < room->BotLeftX || y < room->BotLeftY || x > room->BotLeftX + room->SizeX - 1 || y > room->BotLeftY + room->SizeY - 1)
+			continue;
+
+		// Neighbouring rooms share walls
+		if (x > room->BotLeftX && y > room->BotLeftY && x < room->BotLeftX + room->SizeX - 1 && y < room->BotLeftY + room->SizeY - 1)
+			return room;
+		if (!onWall)
+			onWall = room;
+	}
+
+	return onWall;
+}
+LabRoom * LabRoomGraph::GetRoomAt(const FVector location) const
+{
+	int x, y;
+	AMainGameMode::WorldToGrid(location.X, location.Y, x, y);
+	return GetRoomAt(x, y);
+}
+
+// Finds the shortest path between rooms with A*, returns false if there is none
+bool LabRoomGraph::FindPath(LabRoom * start, LabRoom * goal, FRoomPathStruct & path) const
+{
+	path = FRoomPathStruct();
+	path.Goal = goal;
+
+	if (!start || !goal)
+		return false;
+	if (start == goal)
+	{
+		path.Rooms.Add(start);
+		return true;
+	}
+
+	// Heuristic is the distance to the goal room's area, passages of the goal are on its edge
+	FVector goalCenter = GetRoomCenter(goal);
+	FVector2D goalExtent = FVector2D(goal->SizeY * 25.f, goal->SizeX * 25.f); // We reverse x and y
+	auto heuristic = [goalCenter, goalExtent](const FVector& location)
+	{
+		float dx = FMath::Max(FMath::Abs(location.X - goalCenter.X) - goalExtent.X, 0.f);
+		float dy = FMath::Max(FMath::Abs(location.Y - goalCenter.Y) - goalExtent.Y, 0.f);
+		return FMath::Sqrt(dx * dx + dy * dy);
+	};
+
+	// Rooms are entered through passages, the passage's center is where the room's cost is measured from
+	TMap<LabRoom*, float> costs;
+	TMap<LabRoom*, LabPassage*> cameThrough;
+	TMap<LabRoom*, FVector> entries;
+	TSet<LabRoom*> closed;
+	TArray<TPair<float, LabRoom*>> open;
+	auto lowestFirst = [](const TPair<float, LabRoom*>& a, const TPair<float, LabRoom*>& b) { return a.Key < b.Key; };
+
+	costs.Add(start, 0.f);
+	entries.Add(start, GetRoomCenter(start));
+	open.HeapPush(TPair<float, LabRoom*>(heuristic(entries[start]), start), lowestFirst);
+	while (open.Num() > 0 && closed.Num() < MaxSearchedRooms)
+	{
+		TPair<float, LabRoom*> node;
+		open.HeapPop(node, lowestFirst);
+		LabRoom* room = node.Value;
+		if (room == goal)
+			break;
+		if (closed.Contains(room))
+			continue;
+		closed.Add(room);
+
+		float cost = costs[room];
+		FVector entry = entries[room];
+		for (LabPassage* passage : room->Passages)
+		{
+			LabRoom* other = GetOtherRoom(passage, room);
+			if (!other || closed.Contains(other))
+				continue;
+
+			FVector waypoint = AMainGameMode::GetPassageLocation(passage);
+			float otherCost = cost + FVector::Dist2D(entry, waypoint) + (passage->bIsDoor ? DoorCost : 0.f);
+			float* oldCost = costs.Find(other);
+			if (oldCost && *oldCost <= otherCost)
+				continue;
+
+			costs.Add(other, otherCost);
+			cameThrough.Add(other, passage);
+			entries.Add(other, waypoint);
+			open.HeapPush(TPair<float, LabRoom*>(otherCost + heuristic(waypoint), other), lowestFirst);
+		}
+	}
+
+	if (!cameThrough.Contains(goal))
+		return false;
+
+	// We go back from the goal
+	for (LabRoom* room = goal; room != start; )
+	{
+		LabPassage* passage = cameThrough[room];
+		path.Rooms.Insert(room, 0);
+		path.Passages.Insert(passage, 0);
+		room = GetOtherRoom(passage, room);
+	}
+	path.Rooms.Insert(start, 0);
+
+	return true;
+}
+// Same but reuses the path cached for the owner, repairing only the parts that changed
+// Returned path is valid until the graph changes
+const FRoomPathStruct * LabRoomGraph::FindCachedPath(const void * owner, LabRoom * start, LabRoom * goal)
+{
+	if (!start || !goal)
+		return nullptr;
+
+	FRoomPathStruct* path = CachedPaths.Find(owner);
+	if (path)
+	{
+		ValidatePath(*path);
+		int startIndex = path->Rooms.Find(start);
+		if (startIndex != INDEX_NONE)
+		{
+			// Rooms that are already behind are not needed
+			path->Rooms.RemoveAt(0, startIndex);
+			path->Passages.RemoveAt(0, startIndex);
+
+			// Goal moved along the path
+			int goalIndex = path->Rooms.Find(goal);
+			if (goalIndex != INDEX_NONE)
+			{
+				CutPath(*path, goalIndex + 1);
+				path->Goal = goal;
+				return path;
+			}
+
+			// Goal moved somewhere else or the path was cut, so only the end is searched again
+			FRoomPathStruct end;
+			if (FindPath(path->Rooms.Last(), goal, end))
+			{
+				for (int i = 1; i < end.Rooms.Num(); ++i)
+				{
+					// We don't want loops when the new end goes back
+					int index = path->Rooms.Find(end.Rooms[i]);
+					if (index != INDEX_NONE)
+					{
+						CutPath(*path, index + 1);
+						continue;
+					}
+					path->Passages.Add(end.Passages[i - 1]);
+					path->Rooms.Add(end.Rooms[i]);
+				}
+				path->Goal = goal;
+				return path;
+			}
+		}
+	}
+
+	FRoomPathStruct newPath;
+	if (!FindPath(start, goal, newPath))
+	{
+		CachedPaths.Remove(owner);
+		return nullptr;
+	}
+	return &CachedPaths.Add(owner, newPath);
+}
+// Forgets the path cached for the owner
+void LabRoomGraph::ForgetCachedPath(const void * owner)
+{
+	CachedPaths.Remove(owner);
+}
+// Returns the passage to go through from the room to get closer to the goal, nullptr if there is none
+// All rooms share one search from the goal that is only done again when the goal or passages change
+LabPassage * LabRoomGraph::GetPassageTowards(LabRoom * goal, LabRoom * room)
+{
+	if (!goal || !room || goal == room)
+		return nullptr;
+
+	if (goal != FlowGoal || bFlowFieldDirty)
+		BuildFlowField(goal);
+
+	LabPassage** passage = FlowField.Find(room);
+	return passage ? *passage : nullptr;
+}
+
+// Room's passages changed so distances to light around it have to be found again
+void LabRoomGraph::MarkPassagesChanged(LabRoom * room)
+{
+	bFlowFieldDirty = true;
+	if (room && HopsToLight.Contains(room))
+		HopsChanged.Add(room);
+}
+// Room became lit or dark
+void LabRoomGraph::SetRoomLit(LabRoom * room, const bool lit)
+{
+	if (!room || !HopsToLight.Contains(room) || LitRooms.Contains(room) == lit)
+		return;
+
+	if (lit)
+		LitRooms.Add(room);
+	else
+		LitRooms.Remove(room);
+	HopsChanged.Add(room);
+}
+// Returns the number of passages between the room and the nearest lit room, MaxHopsToLight if it's that far or further
+int LabRoomGraph::GetHopsToLight(LabRoom * room)
+{
+	UpdateHopsToLight();
+
+	const int* hops = HopsToLight.Find(room);
+	return hops ? *hops : MaxHopsToLight;
+}
+// Returns the neighbour furthest from light and the passage to it, nullptr if no neighbour is darker
+LabRoom * LabRoomGraph::GetDarkerNeighbour(LabRoom * room, LabPassage *& through)
+{
+	through = nullptr;
+	if (!room)
+		return nullptr;
+
+	LabRoom* darkest = nullptr;
+	int darkestHops = GetHopsToLight(room);
+	for (LabPassage* passage : room->Passages)
+	{
+		LabRoom* other = GetOtherRoom(passage, room);
+		const int* hops = other ? HopsToLight.Find(other) : nullptr;
+		if (!hops || *hops <= darkestHops)
+			continue;
+
+		darkest = other;
+		darkestHops = *hops;
+		through = passage;
+	}
+
+	return darkest;
+}
+
+// Finds a random floor cell at a distance band from the location in a room at least minHopsToLight passages from light
+// Returns false if there is no such cell
+bool LabRoomGraph::FindDarkCell(const FVector location, const float minDistance, const float maxDistance, const int minHopsToLight, FIntPoint & cell)
+{
+	UpdateHopsToLight();
+
+	// Only buckets that can hold the band are checked
+	int minX, minY, maxX, maxY;
+	AMainGameMode::WorldToGrid(location.X - maxDistance, location.Y - maxDistance, minX, minY);
+	AMainGameMode::WorldToGrid(location.X + maxDistance, location.Y + maxDistance, maxX, maxY);
+	FIntPoint minBucket = GetBucket(FMath::Min(minX, maxX), FMath::Min(minY, maxY));
+	FIntPoint maxBucket = GetBucket(FMath::Max(minX, maxX), FMath::Max(minY, maxY));
+
+	// Every suitable room has the same chance to be chosen
+	TSet<LabRoom*> checked;
+	int found = 0;
+	for (int x = minBucket.X; x <= maxBucket.X; ++x)
+	{
+		for (int y = minBucket.Y; y <= maxBucket.Y; ++y)
+		{
+			const TArray<LabRoom*>* bucket = Buckets.Find(FIntPoint(x, y));
+			if (!bucket)
+				continue;
+
+			for (LabRoom* room : *bucket)
+			{
+				if (checked.Contains(room))
+					continue;
+				checked.Add(room);
+
+				if (HopsToLight[room] < minHopsToLight)
+					continue;
+
+				FIntPoint roomCell;
+				if (!GetRandomCellInBand(room, location, minDistance, maxDistance, roomCell))
+					continue;
+
+				++found;
+				if (FMath::RandRange(1, found) == 1)
+					cell = roomCell;
+			}
+		}
+	}
+
+	return found > 0;
+}
+bool LabRoomGraph::FindDarkCell(LabRoom * start, const int minHops, const int maxHops, const int minHopsToLight, FIntPoint & cell)
+{
+	if (!start || !HopsToLight.Contains(start))
+		return false;
+
+	UpdateHopsToLight();
+
+	// Rooms are taken in order of passages from start
+	TArray<LabRoom*> reachable;
+	reachable.Add(start);
+	TSet<LabRoom*> visited(reachable);
+	LabRoom* chosen = nullptr;
+	int found = 0;
+	for (int i = 0, hops = 0; hops <= maxHops && i < reachable.Num(); ++hops)
+	{
+		for (int end = reachable.Num(); i < end; ++i)
+		{
+			LabRoom* room = reachable[i];
+			if (hops >= minHops && HopsToLight[room] >= minHopsToLight && FMath::RandRange(1, ++found) == 1)
+				chosen = room;
+
+			for (LabPassage* passage : room->Passages)
+			{
+				LabRoom* other = GetOtherRoom(passage, room);
+				if (other && HopsToLight.Contains(other) && !visited.Contains(other))
+				{
+					visited.Add(other);
+					reachable.Add(other);
+				}
+			}
+		}
+	}
+
+	// Any floor cell of the room will do
+	return chosen && GetRandomCellInBand(chosen, FVector::ZeroVector, 0.f, BIG_NUMBER, cell);
+}
+
+// Returns the room on the other side of the passage
+LabRoom * LabRoomGraph::GetOtherRoom(LabPassage * passage, LabRoom * room)
+{
+	if (!passage)
+		return nullptr;
+	if (passage->From == room)
+		return passage->To;
+	if (passage->To == room)
+		return passage->From;
+	return nullptr;
+}
+// Returns the world location of the room's center on the floor level
+FVector LabRoomGraph::GetRoomCenter(LabRoom * room)
+{
+	if (!room)
+		return FVector::ZeroVector;
+
+	float centerX, centerY;
+	AMainGameMode::GridToWorld(room->BotLeftX, room->BotLeftY, room->SizeX, room->SizeY, centerX, centerY);
+	return FVector(centerX, centerY, 0);
+}
+
+// Keeps rooms before roomIndex and the passages between them
+void LabRoomGraph::CutPath(FRoomPathStruct & path, const int roomIndex)
+{
+	path.Rooms.SetNum(FMath::Clamp(roomIndex, 0, path.Rooms.Num()));
+	path.Passages.SetNum(FMath::Clamp(roomIndex - 1, 0, path.Passages.Num()));
+}
+// Cuts the path where rooms stop being connected
+void LabRoomGraph::ValidatePath(FRoomPathStruct & path)
+{
+	// Passages can be reconnected to other rooms
+	for (int i = 0; i < path.Passages.Num(); ++i)
+	{
+		if (GetOtherRoom(path.Passages[i], path.Rooms[i]) != path.Rooms[i + 1])
+		{
+			CutPath(path, i + 1);
+			return;
+		}
+	}
+}
+// Returns the bucket of the spatial index that contains the grid cell
+FIntPoint LabRoomGraph::GetBucket(const int x, const int y)
+{
+	return FIntPoint(FMath::FloorToInt((float)x / BucketSize), FMath::FloorToInt((float)y / BucketSize));
+}
+// Returns a random floor cell of the room that is in the distance band, false if there is none
+bool LabRoomGraph::GetRandomCellInBand(LabRoom * room, const FVector location, const float minDistance, const float maxDistance, FIntPoint & cell)
+{
+	if (!room || room->SizeX < 3 || room->SizeY < 3)
+		return false;
+
+	// Rooms entirely inside or outside the band are skipped right away
+	FVector center = GetRoomCenter(room);
+	FVector2D extent = FVector2D(room->SizeY * 25.f, room->SizeX * 25.f); // We reverse x and y
+	float dx = FMath::Abs(location.X - center.X);
+	float dy = FMath::Abs(location.Y - center.Y);
+	float closest = FVector2D(FMath::Max(dx - extent.X, 0.f), FMath::Max(dy - extent.Y, 0.f)).Size();
+	float farthest = FVector2D(dx + extent.X, dy + extent.Y).Size();
+	if (closest > maxDistance || farthest < minDistance)
+		return false;
+
+	// Walls are not floor
+	for (int i = 0; i < MaxCellTries; ++i)
+	{
+		int x = FMath::RandRange(room->BotLeftX + 1, room->BotLeftX + room->SizeX - 2);
+		int y = FMath::RandRange(room->BotLeftY + 1, room->BotLeftY + room->SizeY - 2);
+		float worldX, worldY;
+		AMainGameMode::GridToWorld(x, y, worldX, worldY);
+		float distance = FVector2D(worldX - location.X, worldY - location.Y).Size();
+		if (distance >= minDistance && distance <= maxDistance)
+		{
+			cell = FIntPoint(x, y);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Finds distances to light again around changed rooms
+void LabRoomGraph::UpdateHopsToLight()
+{
+	if (HopsChanged.Num() == 0)
+		return;
+
+	// Only known rooms are neighbours, pooled rooms can still be on the other side of passages
+	auto forEachNeighbour = [this](LabRoom* room, TFunctionRef<void(LabRoom*)> function)
+	{
+		for (LabPassage* passage : room->Passages)
+		{
+			LabRoom* other = GetOtherRoom(passage, room);
+			if (other && HopsToLight.Contains(other))
+				function(other);
+		}
+	};
+
+	// Any distance that can change belongs to a room at most MaxHopsToLight passages away from a change
+	TArray<LabRoom*> region = HopsChanged.Array();
+	TSet<LabRoom*> inRegion(region);
+	HopsChanged.Empty();
+	for (int i = 0, d = 0; d < MaxHopsToLight; ++d)
+	{
+		for (int end = region.Num(); i < end; ++i)
+		{
+			forEachNeighbour(region[i], [&region, &inRegion](LabRoom* other)
+			{
+				if (!inRegion.Contains(other))
+				{
+					inRegion.Add(other);
+					region.Add(other);
+				}
+			});
+		}
+	}
+
+	// Distances are found again from lit rooms in the region and from rooms around it that didn't change
+	TArray<TArray<LabRoom*>> byHops;
+	byHops.SetNum(MaxHopsToLight);
+	for (LabRoom* room : region)
+	{
+		int hops = LitRooms.Contains(room) ? 0 : MaxHopsToLight;
+		forEachNeighbour(room, [this, &inRegion, &hops](LabRoom* other)
+		{
+			if (!inRegion.Contains(other))
+				hops = FMath::Min(hops, HopsToLight[other] + 1);
+		});
+		HopsToLight[room] = hops;
+		if (hops < MaxHopsToLight)
+			byHops[hops].Add(room);
+	}
+
+	// Every passage is one hop so rooms are simply taken in order of their distance
+	for (int hops = 0; hops < MaxHopsToLight - 1; ++hops)
+	{
+		for (int i = 0; i < byHops[hops].Num(); ++i)
+		{
+			LabRoom* room = byHops[hops][i];
+			if (HopsToLight[room] != hops)
+				continue;
+
+			forEachNeighbour(room, [this, &inRegion, &byHops, hops](LabRoom* other)
+			{
+				if (inRegion.Contains(other) && HopsToLight[other] > hops + 1)
+				{
+					HopsToLight[other] = hops + 1;
+					byHops[hops + 1].Add(other);
+				}
+			});
+		}
+	}
+}
+// Finds the way towards the goal from every room that can reach it
+void LabRoomGraph::BuildFlowField(LabRoom * goal)
+{
+	FlowField.Empty(FlowField.Num());
+	FlowGoal = goal;
+	bFlowFieldDirty = false;
+
+	// Same costs as FindPath, but searched from the goal with no heuristic
+	TMap<LabRoom*, float> costs;
+	TMap<LabRoom*, FVector> entries;
+	TSet<LabRoom*> closed;
+	TArray<TPair<float, LabRoom*>> open;
+	auto lowestFirst = [](const TPair<float, LabRoom*>& a, const TPair<float, LabRoom*>& b) { return a.Key < b.Key; };
+
+	costs.Add(goal, 0.f);
+	entries.Add(goal, GetRoomCenter(goal));
+	open.HeapPush(TPair<float, LabRoom*>(0.f, goal), lowestFirst);
+	while (open.Num() > 0 && closed.Num() < MaxSearchedRooms)
+	{
+		TPair<float, LabRoom*> node;
+		open.HeapPop(node, lowestFirst);
+		LabRoom* room = node.Value;
+		if (closed.Contains(room))
+			continue;
+		closed.Add(room);
+
+		float cost = costs[room];
+		FVector entry = entries[room];
+		for (LabPassage* passage : room->Passages)
+		{
+			LabRoom* other = GetOtherRoom(passage, room);
+			if (!other || closed.Contains(other))
+				continue;
+
+			FVector waypoint = AMainGameMode::GetPassageLocation(passage);
+			float otherCost = cost + FVector::Dist2D(entry, waypoint) + (passage->bIsDoor ? DoorCost : 0.f);
+			float* oldCost = costs.Find(other);
+			if (oldCost && *oldCost <= otherCost)
+				continue;
+
+			// The other room goes back through the same passage
+			costs.Add(other, otherCost);
+			FlowField.Add(other, passage);
+			entries.Add(other, waypoint);
+			open.HeapPush(TPair<float, LabRoom*>(otherCost, other), lowestFirst);
+		}
+	}
+}
@@ -0,0 +1,118 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+class LabRoom;
+class LabPassage;
+
+// A path through the laboratory, passages are the waypoints between rooms
+struct FRoomPathStruct
+{
+	// Rooms[i] and Rooms[i + 1] are connected by Passages[i]
+	TArray<LabRoom*> Rooms;
+	TArray<LabPassage*> Passages;
+	LabRoom* Goal = nullptr;
+
+	// True if the path reaches its goal
+	bool IsComplete() const { return Rooms.Num() > 0 && Rooms.Last() == Goal; }
+};
+
+// Rooms and passages of the laboratory seen as a graph
+// Keeps a spatial index of rooms and paths cached for their owners
+class DARKLAB_API LabRoomGraph
+{
+public:
+	// Keeps track of the room for spatial queries
+	void AddRoom(LabRoom* room);
+	// Forgets the room and cuts cached paths that go through it
+	// Should be called before the room is deleted
+	void RemoveRoom(LabRoom* room);
+	// Cuts cached paths that go through the passage
+	// Should be called before the passage is deleted
+	void RemovePassage(LabPassage* passage);
+	// Forgets all rooms and paths
+	void Empty();
+
+	// Returns the room that contains the grid cell, rooms whose floor contains it are preferred over rooms whose wall does
+	LabRoom* GetRoomAt(const int x, const int y) const;
+	LabRoom* GetRoomAt(const FVector location) const;
+
+	// Finds the shortest path between rooms with A*, returns false if there is none
+	bool FindPath(LabRoom* start, LabRoom* goal, FRoomPathStruct& path) const;
+	// Same but reuses the path cached for the owner, repairing only the parts that changed
+	// Returned path is valid until the graph changes
+	const FRoomPathStruct* FindCachedPath(const void* owner, LabRoom* start, LabRoom* goal);
+	// Forgets the path cached for the owner
+	void ForgetCachedPath(const void* owner);
+	// Returns the passage to go through from the room to get closer to the goal, nullptr if there is none
+	// All rooms share one search from the goal that is only done again when the goal or passages change
+	LabPassage* GetPassageTowards(LabRoom* goal, LabRoom* room);
+
+	// Room's passages changed so distances to light around it have to be found again
+	void MarkPassagesChanged(LabRoom* room);
+	// Room became lit or dark
+	void SetRoomLit(LabRoom* room, const bool lit);
+	// Returns the number of passages between the room and the nearest lit room, MaxHopsToLight if it's that far or further
+	int GetHopsToLight(LabRoom* room);
+	// Returns the neighbour furthest from light and the passage to it, nullptr if no neighbour is darker
+	LabRoom* GetDarkerNeighbour(LabRoom* room, LabPassage*& through);
+
+	// Finds a random floor cell at a distance band from the location in a room at least minHopsToLight passages from light
+	// Returns false if there is no such cell
+	bool FindDarkCell(const FVector location, const float minDistance, const float maxDistance, const int minHopsToLight, FIntPoint& cell);
+	// Same but the band is measured in passages from the room
+	bool FindDarkCell(LabRoom* start, const int minHops, const int maxHops, const int minHopsToLight, FIntPoint& cell);
+
+	// Returns the room on the other side of the passage
+	static LabRoom* GetOtherRoom(LabPassage* passage, LabRoom* room);
+	// Returns the world location of the room's center on the floor level
+	static FVector GetRoomCenter(LabRoom* room);
+
+private:
+	// Keeps rooms before roomIndex and the passages between them
+	static void CutPath(FRoomPathStruct& path, const int roomIndex);
+	// Cuts the path where rooms stop being connected
+	static void ValidatePath(FRoomPathStruct& path);
+	// Returns the bucket of the spatial index that contains the grid cell
+	static FIntPoint GetBucket(const int x, const int y);
+	// Finds distances to light again around changed rooms
+	void UpdateHopsToLight();
+	// Finds the way towards the goal from every room that can reach it
+	void BuildFlowField(LabRoom* goal);
+	// Returns a random floor cell of the room that is in the distance band, false if there is none
+	static bool GetRandomCellInBand(LabRoom* room, const FVector location, const float minDistance, const float maxDistance, FIntPoint& cell);
+
+private:
+	// Rooms of the spatial index by bucket
+	TMap<FIntPoint, TArray<LabRoom*>> Buckets;
+	// Paths cached for their owners
+	TMap<const void*, FRoomPathStruct> CachedPaths;
+	// Distances to the nearest lit room, every known room is here
+	TMap<LabRoom*, int> HopsToLight;
+	// Rooms that are lit
+	TSet<LabRoom*> LitRooms;
+	// Rooms around which distances to light have to be found again
+	TSet<LabRoom*> HopsChanged;
+	// Passages that lead towards FlowGoal by room
+	TMap<LabRoom*, LabPassage*> FlowField;
+	LabRoom* FlowGoal = nullptr;
+	// True if passages changed since the flow field was built
+	bool bFlowFieldDirty = true;
+
+public:
+	// Distances to light are not tracked further than this
+	static const int MaxHopsToLight = 8;
+
+private:
+
+	// Size of the spatial index's buckets in grid cells
+	static const int BucketSize = 16;
+	// Random cells tried in a room before giving up on it
+	static const int MaxCellTries = 8;
+	// The most rooms a single search can look at
+	static const int MaxSearchedRooms = 4096;
+	// Extra cost of going through a door
+	static const float DoorCost;
+};
@@ -0,0 +1,149 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "LabScalability.h"
+#include "HAL/IConsoleManager.h"
+#include "Misc/ConfigCacheIni.h"
+#include "DarkLab.h"
+
+// Applies a preset from the scalability ini
+static void ApplyQualityGroup(const TCHAR* groupName, IConsoleVariable* variable)
+{
+	int32 quality = FMath::Clamp(variable->GetInt(), 0, 3);
+	UE_LOG(LogDarkLab, Log, TEXT("Applying %s preset %d"), groupName, quality);
+	ApplyCVarSettingsGroupFromIni(groupName, quality, *GScalabilityIni, ECVF_SetByScalability);
+}
+static void OnGenerationQualityChanged(IConsoleVariable* variable)
+{
+	ApplyQualityGroup(TEXT("LabGenerationQuality"), variable);
+}
+static void OnLightQueryQualityChanged(IConsoleVariable* variable)
+{
+	ApplyQualityGroup(TEXT("LabLightQueryQuality"), variable);
+}
+static void OnLightBudgetQualityChanged(IConsoleVariable* variable)
+{
+	ApplyQualityGroup(TEXT("LabLightBudgetQuality"), variable);
+}
+
+// Scalability groups
+static TAutoConsoleVariable<int32> CVarLabGenerationQuality(
+	TEXT("sg.LabGenerationQuality"),
+	3,
+	TEXT("Labyrinth generation quality, 0:low, 1:medium, 2:high, 3:epic"),
+	FConsoleVariableDelegate::CreateStatic(&OnGenerationQualityChanged),
+	ECVF_ScalabilityGroup);
+static TAutoConsoleVariable<int32> CVarLabLightQueryQuality(
+	TEXT("sg.LabLightQueryQuality"),
+	3,
+	TEXT("Precision of light level queries, 0:low, 1:medium, 2:high, 3:epic"),
+	FConsoleVariableDelegate::CreateStatic(&OnLightQueryQualityChanged),
+	ECVF_ScalabilityGroup);
+static TAutoConsoleVariable<int32> CVarLabLightBudgetQuality(
+	TEXT("sg.LabLightBudgetQuality"),
+	3,
+	TEXT("Number of lamp lights drawn and casting shadows, 0:low, 1:medium, 2:high, 3:epic"),
+	FConsoleVariableDelegate::CreateStatic(&OnLightBudgetQualityChanged),
+	ECVF_ScalabilityGroup);
+
+// Values set by the groups, defaults match epic
+static TAutoConsoleVariable<int32> CVarLightSampleStep(
+	TEXT("lab.Light.SampleStep"),
+	2,
+	TEXT("Step between grid cells sampled for room and passage illumination"),
+	ECVF_Scalability);
+static TAutoConsoleVariable<int32> CVarDarknessLightSamples(
+	TEXT("lab.Light.DarknessSamples"),
+	11,
+	TEXT("Number of points sampled around the darkness: 1, 7 or 11"),
+	ECVF_Scalability);
+static TAutoConsoleVariable<int32> CVarMaxExpandDepth(
+	TEXT("lab.Gen.MaxExpandDepth"),
+	6,
+	TEXT("Highest depth of room expansion around the player"),
+	ECVF_Scalability);
+static TAutoConsoleVariable<int32> CVarMaxSpawnFillDepth(
+	TEXT("lab.Gen.MaxSpawnFillDepth"),
+	5,
+	TEXT("Highest depth of spawned rooms around the player"),
+	ECVF_Scalability);
+static TAutoConsoleVariable<int32> CVarMaxRoomsWithShadowedLamps(
+	TEXT("lab.Light.MaxRoomsWithShadowedLamps"),
+	0,
+	TEXT("Most rooms with lamps casting shadows at the same time, lamps of older lit rooms stay on without shadows, 0 means no limit"),
+	ECVF_Scalability);
+static TAutoConsoleVariable<int32> CVarMaxShadowedLights(
+	TEXT("lab.Light.MaxShadowed"),
+	8,
+	TEXT("Most lights casting shadows at the same time, the most important ones keep them, 0 means no limit"),
+	ECVF_Scalability);
+static TAutoConsoleVariable<int32> CVarMaxDrawnLights(
+	TEXT("lab.Light.MaxDrawn"),
+	32,
+	TEXT("Most lights drawn at the same time, the least important ones only light level queries see, 0 means no limit"),
+	ECVF_Scalability);
+
+// Settings version is changed when any of the values change
+static uint32 SettingsVersion = 0;
+static uint32 LastSettingsHash = 0;
+static void OnConsoleVariablesChanged()
+{
+	uint32 hash = GetTypeHash(LabScalability::GetLightSampleStep());
+	hash = HashCombine(hash, GetTypeHash(LabScalability::GetDarknessLightSamples()));
+	hash = HashCombine(hash, GetTypeHash(LabScalability::GetMaxExpandDepth()));
+	hash = HashCombine(hash, GetTypeHash(LabScalability::GetMaxSpawnFillDepth()));
+	hash = HashCombine(hash, GetTypeHash(LabScalability::GetMaxRoomsWithShadowedLamps()));
+	hash = HashCombine(hash, GetTypeHash(LabScalability::GetMaxShadowedLights()));
+	hash = HashCombine(hash, GetTypeHash(LabScalability::GetMaxDrawnLights()));
+	if (hash != LastSettingsHash)
+	{
+		LastSettingsHash = hash;
+		++SettingsVersion;
+	}
+}
+static FAutoConsoleVariableSink CVarLabScalabilitySink(FConsoleCommandDelegate::CreateStatic(&OnConsoleVariablesChanged));
+
+// Step between grid cells sampled for room and passage illumination
+int LabScalability::GetLightSampleStep()
+{
+	return FMath::Max(1, CVarLightSampleStep.GetValueOnGameThread());
+}
+// Same, but small enough for at least one of the given number of cells to be sampled
+int LabScalability::GetLightSampleStep(const int cells)
+{
+	return FMath::Min(GetLightSampleStep(), FMath::Max(1, cells));
+}
+// Number of points sampled around the darkness: 1, 7 or 11
+int LabScalability::GetDarknessLightSamples()
+{
+	int samples = CVarDarknessLightSamples.GetValueOnGameThread();
+	return samples >= 11 ? 11 : samples >= 7 ? 7 : 1;
+}
+// Limits for generation depths
+int LabScalability::GetMaxExpandDepth()
+{
+	return FMath::Max(2, CVarMaxExpandDepth.GetValueOnGameThread());
+}
+int LabScalability::GetMaxSpawnFillDepth()
+{
+	return FMath::Max(1, CVarMaxSpawnFillDepth.GetValueOnGameThread());
+}
+// Limit for rooms with lamps casting shadows at the same time, 0 means no limit
+int LabScalability::GetMaxRoomsWithShadowedLamps()
+{
+	return FMath::Max(0, CVarMaxRoomsWithShadowedLamps.GetValueOnGameThread());
+}
+// Limits for lights casting shadows and lights drawn at all, 0 means no limit
+int LabScalability::GetMaxShadowedLights()
+{
+	return FMath::Max(0, CVarMaxShadowedLights.GetValueOnGameThread());
+}
+int LabScalability::GetMaxDrawnLights()
+{
+	return FMath::Max(0, CVarMaxDrawnLights.GetValueOnGameThread());
+}
+
+// Changes every time one of the values above changes
+uint32 LabScalability::GetSettingsVersion()
+{
+	return SettingsVersion;
+}
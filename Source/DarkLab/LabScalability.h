@@ -0,0 +1,29 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+// Game specific scalability, set with sg.LabGenerationQuality, sg.LabLightQueryQuality and sg.LabLightBudgetQuality
+// Presets are in the [LabGenerationQuality@N], [LabLightQueryQuality@N] and [LabLightBudgetQuality@N] sections of DefaultScalability.ini
+class DARKLAB_API LabScalability
+{
+public:
+	// Step between grid cells sampled for room and passage illumination
+	static int GetLightSampleStep();
+	// Same, but small enough for at least one of the given number of cells to be sampled
+	static int GetLightSampleStep(const int cells);
+	// Number of points sampled around the darkness: 1, 7 or 11
+	static int GetDarknessLightSamples();
+	// Limits for generation depths
+	static int GetMaxExpandDepth();
+	static int GetMaxSpawnFillDepth();
+	// Limit for rooms with lamps casting shadows at the same time, 0 means no limit
+	static int GetMaxRoomsWithShadowedLamps();
+	// Limits for lights casting shadows and lights drawn at all, 0 means no limit
+	static int GetMaxShadowedLights();
+	static int GetMaxDrawnLights();
+
+	// Changes every time one of the values above changes
+	static uint32 GetSettingsVersion();
+};
@@ -6,7 +6,12 @@
 #include "Components/SpotLightComponent.h"
 #include "UObject/UObjectIterator.h"
 #include "DrawDebugHelpers.h"
+#include "ConvexVolume.h"
+#include "SceneManagement.h"
+#include "Camera/PlayerCameraManager.h"
 #include "UObject/ConstructorHelpers.h"
+#include "BasicDeactivatableObject.h"
+#include "BasicPlaceableObject.h"
 #include "BasicFloor.h"
 #include "BasicWall.h"
 #include "BasicDoor.h"
@@ -15,14 +20,23 @@
 #include "Lighter.h"
 #include "Doorcard.h"
 #include "ExitVolume.h"
+#include "LabGeometry.h"
 #include "LabPassage.h"
 #include "LabRoom.h"
+#include "LabScalability.h"
+#include "LabNativeEvents.h"
 // #include "LabHallway.h"
 #include "DarknessController.h"
 #include "Darkness.h"
+#include "DarknessManager.h"
 #include "MainPlayerController.h"
 #include "MainCharacter.h"
 #include "GameHUD.h"
+#include "DarkLab.h"
+#include "HAL/IConsoleManager.h"
+#include "Async/ParallelFor.h"
+#include "Containers/BitArray.h"
+#include "Async/TaskGraphInterfaces.h"
 // For on screen debug
 #include "EngineGlobals.h"
 #include "Engine/Engine.h"
@@ -48,6 +62,191 @@ const float AMainGameMode::RedProbability = 0.08f;
 const float AMainGameMode::BlackProbability = 0.06f;
 // Other constants
 const float AMainGameMode::ReshapeDarknessTick = 4.f;
+const float AMainGameMode::SpawnQueueFrameBudget = 2.f;
+const float AMainGameMode::PredictionRadius = 600.f;
+const float AMainGameMode::PredictionMinAlignment = 0.6f;
+const float AMainGameMode::PredictionVelocityWeight = 0.7f;
+const float AMainGameMode::GovernorSmoothing = 0.25f;
+const float AMainGameMode::GovernorCooldown = 2.f;
+const float AMainGameMode::GovernorRaiseFraction = 0.5f;
+const float AMainGameMode::GovernorTickScalePerLevel = 0.5f;
+const float AMainGameMode::GovernorProbabilityScalePerLevel = 0.15f;
+const float AMainGameMode::ParkingDepth = 100000.f;
+const float AMainGameMode::ParkingSpacing = 2000.f;
+const float AMainGameMode::CullingRoomHeight = 500.f;
+
+// Stats
+DECLARE_CYCLE_STAT(TEXT("Process spawn queue"), STAT_ProcessSpawnQueue, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Spawn queue depth"), STAT_SpawnQueueDepth, STATGROUP_DarkLab);
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("Worst spawn queue frame (ms)"), STAT_WorstSpawnFrameMs, STATGROUP_DarkLab);
+DECLARE_CYCLE_STAT(TEXT("Reshape darkness"), STAT_ReshapeDarkness, STATGROUP_DarkLab);
+DECLARE_CYCLE_STAT(TEXT("Classify illumination"), STAT_ClassifyIllumination, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Reshape rooms checked"), STAT_ReshapeRoomsChecked, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Reshape verify mismatches"), STAT_ReshapeMismatches, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Reshape job phase"), STAT_ReshapePhase, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Last reshape job frames"), STAT_LastReshapeFrames, STATGROUP_DarkLab);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Reshape jobs finished"), STAT_ReshapeJobsFinished, STATGROUP_DarkLab);
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("Governor: enter room cost (ms)"), STAT_GovernorEnterRoomMs, STATGROUP_DarkLab);
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("Governor: reshape cost (ms)"), STAT_GovernorReshapeMs, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Governor: level"), STAT_GovernorLevel, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Governor: expand depth"), STAT_GovernorExpandDepth, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Governor: spawn fill depth"), STAT_GovernorSpawnFillDepth, STATGROUP_DarkLab);
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("Governor: reshape interval (s)"), STAT_GovernorReshapeTick, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Pools: live objects"), STAT_PoolLive, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Pools: idle objects"), STAT_PoolIdle, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Pools: high-water marks"), STAT_PoolHighWater, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Pools: hits"), STAT_PoolHits, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Pools: misses"), STAT_PoolMisses, STATGROUP_DarkLab);
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("Pools: hit ratio"), STAT_PoolHitRatio, STATGROUP_DarkLab);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Pools: trimmed"), STAT_PoolTrimmed, STATGROUP_DarkLab);
+DECLARE_CYCLE_STAT(TEXT("Culling"), STAT_Culling, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Culling: rooms"), STAT_CulledRooms, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Culling: primitives"), STAT_CulledPrimitives, STATGROUP_DarkLab);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Culling: lights"), STAT_CulledLights, STATGROUP_DarkLab);
+
+// Console variables
+static TAutoConsoleVariable<int32> CVarIncrementalReshape(
+	TEXT("lab.Reshape.Incremental"),
+	1,
+	TEXT("If 1, reshaping only checks rooms that changed since the last reshape and their neighbours"),
+	ECVF_Default);
+static TAutoConsoleVariable<int32> CVarVerifyReshape(
+	TEXT("lab.Reshape.Verify"),
+	0,
+	TEXT("If 1, incremental reshaping also checks every room and logs rooms it classified differently from a full reshape"),
+	ECVF_Cheat);
+static TAutoConsoleVariable<int32> CVarParallelIllumination(
+	TEXT("lab.Reshape.Parallel"),
+	1,
+	TEXT("If 1, illumination of rooms is checked on worker threads during reshaping"),
+	ECVF_Default);
+static TAutoConsoleVariable<int32> CVarAdaptiveSampling(
+	TEXT("lab.Light.Adaptive"),
+	1,
+	TEXT("If 1, room interiors are sampled adaptively when checking illumination"),
+	ECVF_Default);
+static TAutoConsoleVariable<int32> CVarGeometryMode(
+	TEXT("lab.Geometry.Mode"),
+	1,
+	TEXT("How floors and walls are spawned: 0 as actors, 1 as instances of one floor and one wall mesh for the whole laboratory, 2 merged into one mesh per room with its passages"),
+	ECVF_Default);
+static TAutoConsoleVariable<int32> CVarPrewarmFloors(
+	TEXT("lab.Pool.Prewarm.Floors"),
+	150,
+	TEXT("Floors spawned into the pool while the level loads, only if floors are actors"),
+	ECVF_Default);
+static TAutoConsoleVariable<int32> CVarPrewarmWalls(
+	TEXT("lab.Pool.Prewarm.Walls"),
+	400,
+	TEXT("Walls spawned into the pool while the level loads, only if walls are actors"),
+	ECVF_Default);
+static TAutoConsoleVariable<int32> CVarPrewarmDoors(
+	TEXT("lab.Pool.Prewarm.Doors"),
+	40,
+	TEXT("Doors spawned into the pool while the level loads"),
+	ECVF_Default);
+static TAutoConsoleVariable<int32> CVarPrewarmLamps(
+	TEXT("lab.Pool.Prewarm.Lamps"),
+	60,
+	TEXT("Wall lamps spawned into the pool while the level loads"),
+	ECVF_Default);
+static TAutoConsoleVariable<int32> CVarPrewarmFlashlights(
+	TEXT("lab.Pool.Prewarm.Flashlights"),
+	8,
+	TEXT("Flashlights spawned into the pool while the level loads"),
+	ECVF_Default);
+static TAutoConsoleVariable<int32> CVarPrewarmDoorcards(
+	TEXT("lab.Pool.Prewarm.Doorcards"),
+	8,
+	TEXT("Doorcards spawned into the pool while the level loads"),
+	ECVF_Default);
+static TAutoConsoleVariable<int32> CVarPrewarmExitVolumes(
+	TEXT("lab.Pool.Prewarm.ExitVolumes"),
+	1,
+	TEXT("Exit volumes spawned into the pool while the level loads"),
+	ECVF_Default);
+static TAutoConsoleVariable<int32> CVarPoolTrim(
+	TEXT("lab.Pool.Trim"),
+	1,
+	TEXT("If 1, idle pooled objects above the target are destroyed during quiet frames"),
+	ECVF_Default);
+static TAutoConsoleVariable<float> CVarPoolIdleRatio(
+	TEXT("lab.Pool.IdleRatio"),
+	0.25f,
+	TEXT("Idle objects a pool keeps as a part of its high-water mark, never less than it prewarmed"),
+	ECVF_Default);
+static TAutoConsoleVariable<int32> CVarPoolTrimPerFrame(
+	TEXT("lab.Pool.TrimPerFrame"),
+	4,
+	TEXT("The most idle objects destroyed in a single frame"),
+	ECVF_Default);
+static TAutoConsoleVariable<int32> CVarPoolStrategy(
+	TEXT("lab.Pool.Strategy"),
+	0,
+	TEXT("How pooled objects are deactivated: 0 hidden with collision disabled, 1 parked far from the laboratory keeping render and physics state of their meshes"),
+	ECVF_Default);
+static TAutoConsoleVariable<int32> CVarCulling(
+	TEXT("lab.Culling"),
+	1,
+	TEXT("If 1, rooms that can't be seen through open passages and are outside the camera frustum are not drawn and don't tick"),
+	ECVF_Default);
+static TAutoConsoleVariable<int32> CVarCullingPortalDepth(
+	TEXT("lab.Culling.PortalDepth"),
+	6,
+	TEXT("How many open passages away from the player's room rooms can be seen through, farther rooms are only drawn if they are in the camera frustum"),
+	ECVF_Default);
+static TAutoConsoleVariable<int32> CVarGovernorEnable(
+	TEXT("lab.Governor.Enable"),
+	1,
+	TEXT("If 1, generation depths and reshape frequency adapt to measured costs"),
+	ECVF_Default);
+static TAutoConsoleVariable<float> CVarGovernorTargetMs(
+	TEXT("lab.Governor.TargetMs"),
+	4.f,
+	TEXT("Milliseconds that entering a room or a frame of reshaping should take"),
+	ECVF_Default);
+// Values below are set by the governor and only show its state
+static TAutoConsoleVariable<int32> CVarGovernorLevel(
+	TEXT("lab.Governor.Level"),
+	0,
+	TEXT("Current governor level, 0 is default, higher does less work"),
+	ECVF_ReadOnly);
+static TAutoConsoleVariable<int32> CVarGovernorExpandDepth(
+	TEXT("lab.Governor.ExpandDepth"),
+	0,
+	TEXT("Current expand depth"),
+	ECVF_ReadOnly);
+static TAutoConsoleVariable<int32> CVarGovernorSpawnFillDepth(
+	TEXT("lab.Governor.SpawnFillDepth"),
+	0,
+	TEXT("Current spawn fill depth"),
+	ECVF_ReadOnly);
+static TAutoConsoleVariable<int32> CVarGovernorReshapeDepth(
+	TEXT("lab.Governor.ReshapeDepth"),
+	0,
+	TEXT("Current reshape darkness depth"),
+	ECVF_ReadOnly);
+static TAutoConsoleVariable<float> CVarGovernorReshapeInterval(
+	TEXT("lab.Governor.ReshapeInterval"),
+	0.f,
+	TEXT("Current interval between timed reshapes (s)"),
+	ECVF_ReadOnly);
+static TAutoConsoleVariable<float> CVarGovernorEnterRoomMs(
+	TEXT("lab.Governor.EnterRoomMs"),
+	0.f,
+	TEXT("Average cost of entering a room (ms)"),
+	ECVF_ReadOnly);
+static TAutoConsoleVariable<float> CVarGovernorReshapeMs(
+	TEXT("lab.Governor.ReshapeMs"),
+	0.f,
+	TEXT("Average cost of a reshape or a frame of reshape job (ms)"),
+	ECVF_ReadOnly);
+static TAutoConsoleVariable<float> CVarReshapeTimeSlice(
+	TEXT("lab.Reshape.TimeSlice"),
+	1.f,
+	TEXT("Milliseconds per frame spent on reshaping darkness\n")
+	TEXT("0 reshapes everything in a single frame"),
+	ECVF_Default);
 
 // Returns true with certain probability
 bool AMainGameMode::RandBool(const float probability)
@@ -121,30 +320,7 @@ float AMainGameMode::GetLightingAmount(FVector & lightLoc, const TArray<FVector>
 float AMainGameMode::GetLightingAmount(FVector& lightLoc, const AActor* actor, const FVector location, const bool sixPoints, const float sixPointsRadius, const bool fourMore, const bool returnFirstPositive)
 {
 	TArray<FVector> locations;
-	locations.Add(location);
-	if (sixPoints)
-	{
-		// We add six locations around the point
-		locations.Add(location + FVector::UpVector * sixPointsRadius);
-		locations.Add(location - FVector::UpVector * sixPointsRadius);
-		locations.Add(location + FVector::RightVector * sixPointsRadius);
-		locations.Add(location - FVector::RightVector * sixPointsRadius);
-		locations.Add(location + FVector::ForwardVector * sixPointsRadius);
-		locations.Add(location - FVector::ForwardVector * sixPointsRadius);
-
-		// We add four more locations around the point (diagonally)
-		if (fourMore)
-		{
-			FVector temp = FVector(1, 1, 0);
-			temp.Normalize();
-			locations.Add(location + temp * sixPointsRadius);
-			locations.Add(location - temp * sixPointsRadius);
-			temp = FVector(-1, 1, 0);
-			temp.Normalize();
-			locations.Add(location + temp * sixPointsRadius);
-			locations.Add(location - temp * sixPointsRadius);
-		}
-	}
+	GetSamplePointsAround(location, locations, sixPoints, sixPointsRadius, fourMore);
 	return GetLightingAmount(lightLoc, actor, locations, returnFirstPositive);
 }
 float AMainGameMode::GetLightingAmount(FVector& lightLoc, const AActor* actor, const TArray<FVector> locations, const bool returnFirstPositive)
@@ -166,6 +342,11 @@ float AMainGameMode::GetLightingAmount(FVector& lightLoc, const AActor* actor, c
 		if ((!Itr->IsVisible()) || Itr->bHiddenInGame || Itr->GetOwner()->bHidden)
 			continue;
 
+		// Lights of parked objects are far from the laboratory
+		ABasicDeactivatableObject* owner = Cast<ABasicDeactivatableObject>(Itr->GetOwner());
+		if (owner && owner->IsParked())
+			continue;
+
 		pointLights.Add(*Itr);
 	}
 
@@ -230,6 +411,66 @@ float AMainGameMode::GetLightingAmount(FVector& lightLoc, const AActor* actor, c
 	// UE_LOG(LogTemp, Warning, TEXT("Final %f"), result);
 	return result;
 }
+// Returns the point and the points around it that GetLightingAmount samples
+void AMainGameMode::GetSamplePointsAround(const FVector location, TArray<FVector>& locations, const bool sixPoints, const float sixPointsRadius, const bool fourMore)
+{
+	locations.Add(location);
+	if (sixPoints)
+	{
+		// We add six locations around the point
+		locations.Add(location + FVector::UpVector * sixPointsRadius);
+		locations.Add(location - FVector::UpVector * sixPointsRadius);
+		locations.Add(location + FVector::RightVector * sixPointsRadius);
+		locations.Add(location - FVector::RightVector * sixPointsRadius);
+		locations.Add(location + FVector::ForwardVector * sixPointsRadius);
+		locations.Add(location - FVector::ForwardVector * sixPointsRadius);
+
+		// We add four more locations around the point (diagonally)
+		if (fourMore)
+		{
+			FVector temp = FVector(1, 1, 0);
+			temp.Normalize();
+			locations.Add(location + temp * sixPointsRadius);
+			locations.Add(location - temp * sixPointsRadius);
+			temp = FVector(-1, 1, 0);
+			temp.Normalize();
+			locations.Add(location + temp * sixPointsRadius);
+			locations.Add(location - temp * sixPointsRadius);
+		}
+	}
+}
+// Same, but with lights gathered beforehand, only reads the world so it can be called from worker threads
+float AMainGameMode::GetLightingAmount(UWorld * world, FVector & lightLoc, const AActor * actor, const TArray<FVector>& locations, const TArray<FLightSampleStruct>& lights)
+{
+	float result = 0.0f;
+
+	// Same traces as CanSee
+	FCollisionQueryParams params = FCollisionQueryParams(FName(TEXT("LightTrace")), true);
+	if (actor)
+		params.AddIgnoredActor(actor);
+
+	for (const FVector& location : locations)
+	{
+		for (const FLightSampleStruct& light : lights)
+		{
+			if (!IsInLightReach(location, light))
+				continue;
+
+			// Same falloff as above, 0 near the edge and brightness in center
+			float temp = (1 - FMath::Square(FVector::Dist(location, light.Location) / light.Radius)) * light.Brightness;
+			if (temp <= result)
+				continue;
+
+			if (world->LineTraceTestByChannel(location, light.Location, ECC_Visibility, params) || world->LineTraceTestByChannel(light.Location, location, ECC_Visibility, params))
+				continue;
+
+			result = temp;
+			lightLoc = light.Location;
+		}
+	}
+
+	return result;
+}
 // Returns true if one actor/location can see other actor/location
 // Its not about visibility to human eye, doesn't take light into account
 bool AMainGameMode::CanSee(const AActor * actor1, const AActor * actor2)
@@ -323,26 +564,20 @@ bool AMainGameMode::CanSee(const AActor * actor1, const FVector location1, const
 	return !bHit;
 }
 
-// Returns the light level for a passage
-float AMainGameMode::GetPassageLightingAmount(LabPassage * passage, bool oneSide, bool innerSide, const bool returnFirstPositive)
+// Return points used to check illumination
+void AMainGameMode::GetPassageSamplePoints(LabPassage * passage, TArray<FVector>& locations, bool oneSide, bool innerSide)
 {
-	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::GetPassageLightingAmount"));
-
 	if (!passage)
-		return 0.f;
-
-	TArray<FVector> locations;
-
-	float centerX, centerY;
-	GridToWorld(passage->BotLeftX, passage->BotLeftY, passage->GridDirection == EDirectionEnum::VE_Up || passage->GridDirection == EDirectionEnum::VE_Down ? passage->Width : 1, passage->GridDirection == EDirectionEnum::VE_Up || passage->GridDirection == EDirectionEnum::VE_Down ? 1 : passage->Width, centerX, centerY);
+		return;
 
-	FVector center = FVector(centerX, centerY, 30); // Small offset to avoid floor
+	FVector center = GetPassageLocation(passage) + FVector(0, 0, 30); // Small offset to avoid floor
 
 	// We create vectors for points assuming GridDirection is Up and innerSide is true
 	// Then we rotate them based on actual direction and bool value
 	TArray<FVector> localPoints;
 	// localPoints.Add(FVector(-25, 0, 0));
-	int step = 2; // TODO make constant
+	// Narrow passages still get a point on each side of the center
+	int step = LabScalability::GetLightSampleStep(passage->Width - 1);
 	for (int x = step; 2 * x - step < passage->Width; x += step)
 	{
 		localPoints.Add(FVector(-25, x * 50.f - step * 50.f / 2, 0));
@@ -379,46 +614,25 @@ float AMainGameMode::GetPassageLightingAmount(LabPassage * passage, bool oneSide
 	if(!oneSide)
 		for (FVector localPoint : localPoints)
 			locations.Add(center - localPoint);
-
-	FVector lightLoc;	
-	return GetLightingAmount(lightLoc, locations, returnFirstPositive);
-}
-// Returns true if passage is illuminated
-bool AMainGameMode::IsPassageIlluminated(LabPassage * passage, bool oneSide, bool innerSide)
-{
-	return GetPassageLightingAmount(passage, oneSide, innerSide, true) > 0.f;
 }
-// Returns the light level for a room
-float AMainGameMode::GetRoomLightingAmount(LabRoom * room, const bool returnFirstPositive)
+void AMainGameMode::GetRoomSamplePoints(LabRoom * room, TArray<FVector>& locations, const bool interior)
 {
-	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::GetRoomLightingAmount"));
-
 	if (!room)
-		return 0.f;
-
-	float light = 0.f;
-
-	// for (LabPassage* passage : room->Passages)
-	for (int i = 0; i < room->Passages.Num(); ++i)
-	{
-		LabPassage* passage = room->Passages[i];
-
-		if (!passage)
-			continue;
+		return;
 
-		// TODO shouldn't always be oneSide
-		float temp = GetPassageLightingAmount(passage, true, passage->From == room, returnFirstPositive);
-		light = temp > light ? temp : light;
-		if (returnFirstPositive && light > 0.f)
-			return light;
+	// TODO shouldn't always be oneSide
+	for (LabPassage* passage : room->Passages)
+		GetPassageSamplePoints(passage, locations, true, passage && passage->From == room);
 
-	}
+	if (!interior)
+		return;
 
-	TArray<FVector> locations;
-	int step = 2; // TODO make constant
-	for (int x = step; x < room->SizeX - 1; x += step)
+	// Small rooms still get at least one point inside
+	int stepX = LabScalability::GetLightSampleStep(room->SizeX - 2);
+	int stepY = LabScalability::GetLightSampleStep(room->SizeY - 2);
+	for (int x = stepX; x < room->SizeX - 1; x += stepX)
 	{
-		for (int y = step; y < room->SizeY - 1; y += step)
+		for (int y = stepY; y < room->SizeY - 1; y += stepY)
 		{
 			float pointX, pointY;
 			GridToWorld(room->BotLeftX + x, room->BotLeftY + y, pointX, pointY);
@@ -427,84 +641,614 @@ float AMainGameMode::GetRoomLightingAmount(LabRoom * room, const bool returnFirs
 			locations.Add(point);
 		}
 	}
-	FVector lightLoc;
-	float temp = GetLightingAmount(lightLoc, locations, returnFirstPositive);
-	light = temp > light ? temp : light;
+}
 
-	return light;
+// Returns visible lights, gathered at most once per frame
+const TArray<FLightSampleStruct>& AMainGameMode::GetFrameLightSamples()
+{
+	if (FrameLightSamplesFrame != GFrameCounter)
+	{
+		FrameLightSamples = GatherLightSamples();
+		FrameLightSamplesFrame = GFrameCounter;
+	}
+	return FrameLightSamples;
 }
-// Returns true if the room is in light
-bool AMainGameMode::IsRoomIlluminated(LabRoom * room)
+
+// Returns the graph of all created rooms
+LabRoomGraph & AMainGameMode::GetRoomGraph()
 {
-	return SpawnedRoomObjects.Contains(room) && GetRoomLightingAmount(room, true) > 0.f;
+	return RoomGraph;
 }
 
-// Changes world location into grid location
-void AMainGameMode::WorldToGrid(const float worldX, const float worldY, int & gridX, int & gridY)
+// Returns the manager of all darkness hunters
+ADarknessManager * AMainGameMode::GetDarknessManager()
 {
-	// We reverse x and y
-	gridX = worldY / 50 + (worldY >= 0 ? 0 : -1);
-	gridY = worldX / 50 + (worldX >= 0 ? 0 : -1);
+	return DarknessManager;
 }
-// Changes grid location into world location
-void AMainGameMode::GridToWorld(const int gridX, const int gridY, float & worldX, float & worldY)
+
+// Returns false if the room has no interior to sample
+bool AMainGameMode::GetRoomSampleLattice(LabRoom * room, FSampleLatticeStruct & lattice)
 {
-	GridToWorld(gridX, gridY, 1, 1, worldX, worldY);
+	if (!room || room->SizeX < 3 || room->SizeY < 3)
+		return false;
+
+	// Same points as GetRoomSamplePoints
+	int stepX = LabScalability::GetLightSampleStep(room->SizeX - 2);
+	int stepY = LabScalability::GetLightSampleStep(room->SizeY - 2);
+	float firstX, firstY, secondX, secondY;
+	GridToWorld(room->BotLeftX + stepX, room->BotLeftY + stepY, firstX, firstY);
+	GridToWorld(room->BotLeftX + 2 * stepX, room->BotLeftY + 2 * stepY, secondX, secondY);
+	lattice.Origin = FVector2D(firstX, firstY);
+	lattice.Step = FVector2D(secondX - firstX, secondY - firstY);
+	lattice.Size = FIntPoint((room->SizeX - 2) / stepX, (room->SizeY - 2) / stepY);
+
+	return lattice.Size.X > 0 && lattice.Size.Y > 0;
 }
-void AMainGameMode::GridToWorld(const int botLeftX, const int botLeftY, const int sizeX, const int sizeY, float & worldX, float & worldY)
+// Returns the outer edges of the room's walls and the passages through them
+void AMainGameMode::GetRoomWalls(LabRoom * room, FRoomWallsStruct & walls)
 {
-	// We reverse x and y
-	worldX = botLeftY * 50.f + sizeY * 25.f; // -25.f
-	worldY = botLeftX * 50.f + sizeX * 25.f; // -25.f
+	walls = FRoomWallsStruct();
+	if (!room)
+		return;
+
+	// Corners of the cells, not centers
+	float minX, minY, maxX, maxY;
+	GridToWorld(room->BotLeftX, room->BotLeftY, 0, 0, minX, minY);
+	GridToWorld(room->BotLeftX + room->SizeX, room->BotLeftY + room->SizeY, 0, 0, maxX, maxY);
+	walls.Bounds = FBox2D(FVector2D(minX, minY), FVector2D(maxX, maxY));
+
+	for (LabPassage* passage : room->Passages)
+	{
+		if (!passage)
+			continue;
+
+		bool vertical = passage->GridDirection == EDirectionEnum::VE_Up || passage->GridDirection == EDirectionEnum::VE_Down;
+		GridToWorld(passage->BotLeftX, passage->BotLeftY, 0, 0, minX, minY);
+		GridToWorld(passage->BotLeftX + (vertical ? passage->Width : 1), passage->BotLeftY + (vertical ? 1 : passage->Width), 0, 0, maxX, maxY);
+		walls.Openings.Add(FBox2D(FVector2D(minX, minY), FVector2D(maxX, maxY)));
+	}
 }
 
-// Places an object on the map
-// TODO return false if can't place?
-void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const int botLeftX, const int botLeftY, const EDirectionEnum direction)
+// Returns visible lights that can make something illuminated
+TArray<FLightSampleStruct> AMainGameMode::GatherLightSamples()
 {
-	PlaceObject(object, FIntVector(botLeftX, botLeftY, 0), direction);
+	TArray<FLightSampleStruct> lights;
+
+	// Same lights as GetLightingAmount uses
+	UWorld* gameWorld = GetWorld();
+	for (TObjectIterator<UPointLightComponent> Itr; Itr; ++Itr)
+	{
+		// World Check
+		if (Itr->GetWorld() != gameWorld)
+			continue;
+
+		// We don't care about invisible lights
+		if ((!Itr->IsVisible()) || Itr->bHiddenInGame || Itr->GetOwner()->bHidden)
+			continue;
+
+		// Lights of parked objects are far from the laboratory
+		ABasicDeactivatableObject* owner = Cast<ABasicDeactivatableObject>(Itr->GetOwner());
+		if (owner && owner->IsParked())
+			continue;
+
+		// Lights that give no light level in GetLightingAmount
+		FLinearColor lightColor = Itr->GetLightColor();
+		if (Itr->Intensity <= 0.f || Itr->AttenuationRadius <= 0.f || lightColor.R + lightColor.G + lightColor.B <= 0.f)
+			continue;
+
+		// Same as in GetLightingAmount
+		float brightness = Itr->Intensity / 150.f * FMath::Pow((lightColor.R * lightColor.R + lightColor.G * lightColor.G + lightColor.B * lightColor.B) / 3.0f, 0.35f);
+
+		USpotLightComponent* spotLight = Cast<USpotLightComponent>(*Itr);
+		lights.Add(FLightSampleStruct(Itr->GetComponentLocation(), spotLight ? spotLight->GetDirection() : FVector::ZeroVector, Itr->AttenuationRadius, spotLight ? FMath::Cos(spotLight->GetHalfConeAngle()) : -1.f, brightness));
+	}
+
+	return lights;
 }
-void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const int botLeftX, const int botLeftY, const int sizeX, const int sizeY)
+// Returns true if any of the locations is lit by any of the lights
+// Only reads the world so it can be called from worker threads
+bool AMainGameMode::IsAnyLocationLit(UWorld * world, const TArray<FVector>& locations, const TArray<FLightSampleStruct>& lights)
 {
-	PlaceObject(object, FIntVector(botLeftX, botLeftY, 0), EDirectionEnum::VE_Up, sizeX, sizeY);
+	for (const FVector& location : locations)
+		for (const FLightSampleStruct& light : lights)
+			if (IsInLightReach(location, light) && IsLightVisible(world, location, light))
+				return true;
+
+	return false;
 }
-void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const int botLeftX, const int botLeftY, const int sizeX, const int sizeY, const int sizeZ)
+// Returns true if location is inside the light's radius and cone
+bool AMainGameMode::IsInLightReach(const FVector & location, const FLightSampleStruct & light)
 {
-	PlaceObject(object, FIntVector(botLeftX, botLeftY, 0), EDirectionEnum::VE_Up, sizeX, sizeY, sizeZ);
+	FVector toLocation = location - light.Location;
+	if (toLocation.SizeSquared() >= light.Radius * light.Radius)
+		return false;
+
+	// Spot light cone
+	return light.CosConeAngle <= -1.f || FVector::DotProduct(toLocation.GetSafeNormal(), light.Direction) >= light.CosConeAngle;
 }
-void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const int botLeftX, const int botLeftY, const EDirectionEnum direction, const int sizeX, const int sizeY)
+// Returns true if nothing blocks the light on its way to location
+bool AMainGameMode::IsLightVisible(UWorld * world, const FVector & location, const FLightSampleStruct & light)
 {
-	PlaceObject(object, FIntVector(botLeftX, botLeftY, 0), direction, sizeX, sizeY);
+	// Scene queries take the physics scene read lock themselves
+	FCollisionQueryParams params = FCollisionQueryParams(FName(TEXT("LightTrace")), true);
+
+	// Same as CanSee, traces in both directions
+	return !world->LineTraceTestByChannel(location, light.Location, ECC_Visibility, params) && !world->LineTraceTestByChannel(light.Location, location, ECC_Visibility, params);
 }
-void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const int botLeftX, const int botLeftY, const EDirectionEnum direction, const int sizeX, const int sizeY, const int sizeZ)
+// Returns what blocks the light on its way to location, nullptr if nothing does
+const UPrimitiveComponent * AMainGameMode::GetLightBlocker(UWorld * world, const FVector & location, const FLightSampleStruct & light)
 {
-	PlaceObject(object, FIntVector(botLeftX, botLeftY, 0), direction, sizeX, sizeY, sizeZ);
+	FCollisionQueryParams params = FCollisionQueryParams(FName(TEXT("LightTrace")), true);
+
+	// Same as IsLightVisible, traces in both directions
+	FHitResult hit;
+	if (world->LineTraceSingleByChannel(hit, light.Location, location, ECC_Visibility, params) || world->LineTraceSingleByChannel(hit, location, light.Location, ECC_Visibility, params))
+		return hit.GetComponent();
+	return nullptr;
 }
-void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const FIntVector botLeftLoc, const EDirectionEnum direction)
+// Returns true if any point of the lattice is lit by any of the lights
+// Starts from the point closest to each light and refines with a quadtree only where corners of a quad disagree
+// Every point is traced once, the budget is the number of traces per light before the rest of the lattice is traced densely
+bool AMainGameMode::IsLatticeLit(UWorld * world, const FSampleLatticeStruct & lattice, const float z, const FRoomWallsStruct & walls, const TArray<FLightSampleStruct>& lights, const int32 budget)
 {
-	UObject* obj = object->_getUObject();
-	object->Execute_Place(obj, botLeftLoc, direction);
+	if (lattice.Size.X <= 0 || lattice.Size.Y <= 0)
+		return false;
+
+	FIntPoint last = lattice.Size - FIntPoint(1, 1);
+	FBox2D area = GetLatticeBounds(lattice, FIntPoint::ZeroValue, last);
+	for (const FLightSampleStruct& light : lights)
+	{
+		FVector closest = FVector(FMath::Clamp(light.Location.X, area.Min.X, area.Max.X), FMath::Clamp(light.Location.Y, area.Min.Y, area.Max.Y), z);
+		if (FVector::DistSquared(closest, light.Location) >= light.Radius * light.Radius)
+			continue; // The light can't reach any part of the area
+		if (IsQuadEnclosed(area, walls, light))
+			continue; // Only walls are between the light and the area
+
+		TMap<FIntPoint, FLatticePointStruct> samples;
+		int32 lightBudget = budget;
+		bool outOfBudget = false;
+
+		// The point closest to the light is the most likely to be lit
+		FIntPoint closestIndex = FIntPoint(
+			lattice.Step.X != 0.f ? FMath::Clamp(FMath::RoundToInt((light.Location.X - lattice.Origin.X) / lattice.Step.X), 0, last.X) : 0,
+			lattice.Step.Y != 0.f ? FMath::Clamp(FMath::RoundToInt((light.Location.Y - lattice.Origin.Y) / lattice.Step.Y), 0, last.Y) : 0);
+		FLatticePointStruct sample;
+		if (SampleLatticePoint(world, lattice, closestIndex, z, walls, light, samples, lightBudget, sample) && sample.bLit)
+			return true;
+
+		if (IsQuadLit(world, lattice, FIntPoint::ZeroValue, last, z, walls, light, samples, lightBudget, outOfBudget))
+			return true;
+		if (!outOfBudget)
+			continue;
+
+		// Running out of budget says nothing about the rest of the room, so it gets the dense lattice
+		for (int x = 0; x <= last.X; ++x)
+		{
+			for (int y = 0; y <= last.Y; ++y)
+			{
+				if (samples.Contains(FIntPoint(x, y)))
+					continue;
+				FVector point = FVector(lattice.Origin + lattice.Step * FVector2D(x, y), z);
+				if (IsInLightReach(point, light) && IsLightVisible(world, point, light))
+					return true;
+			}
+		}
+	}
+
+	return false;
 }
-void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const FIntVector botLeftLoc, const int sizeX, const int sizeY)
+// Returns false if the budget ran out before the quad could be told lit or not, outOfBudget is set then
+bool AMainGameMode::IsQuadLit(UWorld * world, const FSampleLatticeStruct & lattice, const FIntPoint min, const FIntPoint max, const float z, const FRoomWallsStruct & walls, const FLightSampleStruct & light, TMap<FIntPoint, FLatticePointStruct>& samples, int32 & budget, bool & outOfBudget)
 {
-	PlaceObject(object, botLeftLoc, EDirectionEnum::VE_Up, sizeX, sizeY);
+	// Quads out of the light's reach or behind walls are skipped
+	FBox2D quad = GetLatticeBounds(lattice, min, max);
+	FVector closest = FVector(FMath::Clamp(light.Location.X, quad.Min.X, quad.Max.X), FMath::Clamp(light.Location.Y, quad.Min.Y, quad.Max.Y), z);
+	bool quadInReach = FVector::DistSquared(closest, light.Location) < light.Radius * light.Radius;
+	if (!quadInReach || IsQuadEnclosed(quad, walls, light))
+		return false;
+
+	// Corners and the center, neighbouring quads share corners and they are only traced once
+	FIntPoint center = (min + max) / 2;
+	FIntPoint indices[5] = { min, FIntPoint(min.X, max.Y), FIntPoint(max.X, min.Y), max, center };
+	FLatticePointStruct points[5];
+	for (int i = 0; i < 5; ++i)
+	{
+		if (!SampleLatticePoint(world, lattice, indices[i], z, walls, light, samples, budget, points[i]))
+		{
+			outOfBudget = true;
+			return false;
+		}
+		if (points[i].bLit)
+			return true;
+	}
+
+	// Every point of the quad is a corner
+	bool splitX = max.X - min.X > 1;
+	bool splitY = max.Y - min.Y > 1;
+	if (!splitX && !splitY)
+		return false;
+
+	// Points blocked by the same thing with their ways through the same passages have the rest of the quad between them in the same shadow
+	// The light still reaches some part of a quad none of whose points it reaches
+	bool agree = points[0].bInReach;
+	for (int i = 1; i < 5 && agree; ++i)
+		agree = points[i].bInReach == points[0].bInReach && points[i].Blocker == points[0].Blocker && points[i].Openings == points[0].Openings;
+	if (agree)
+		return false;
+
+	// Children share their edges, long quads are only split along the long side
+	TArray<TPair<FIntPoint, FIntPoint>, TInlineAllocator<4>> children;
+	if (splitX && splitY)
+	{
+		children.Add(TPair<FIntPoint, FIntPoint>(min, center));
+		children.Add(TPair<FIntPoint, FIntPoint>(center, max));
+		children.Add(TPair<FIntPoint, FIntPoint>(FIntPoint(min.X, center.Y), FIntPoint(center.X, max.Y)));
+		children.Add(TPair<FIntPoint, FIntPoint>(FIntPoint(center.X, min.Y), FIntPoint(max.X, center.Y)));
+	}
+	else if (splitX)
+	{
+		children.Add(TPair<FIntPoint, FIntPoint>(min, FIntPoint(center.X, max.Y)));
+		children.Add(TPair<FIntPoint, FIntPoint>(FIntPoint(center.X, min.Y), max));
+	}
+	else
+	{
+		children.Add(TPair<FIntPoint, FIntPoint>(min, FIntPoint(max.X, center.Y)));
+		children.Add(TPair<FIntPoint, FIntPoint>(FIntPoint(min.X, center.Y), max));
+	}
+
+	for (const TPair<FIntPoint, FIntPoint>& child : children)
+		if (IsQuadLit(world, lattice, child.Key, child.Value, z, walls, light, samples, budget, outOfBudget))
+			return true;
+		else if (outOfBudget)
+			return false;
+
+	return false;
 }
-void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const FIntVector botLeftLoc, const int sizeX, const int sizeY, const int sizeZ)
+// Traces the light to the point of the lattice unless it was already traced, returns false if the budget ran out
+bool AMainGameMode::SampleLatticePoint(UWorld * world, const FSampleLatticeStruct & lattice, const FIntPoint index, const float z, const FRoomWallsStruct & walls, const FLightSampleStruct & light, TMap<FIntPoint, FLatticePointStruct>& samples, int32 & budget, FLatticePointStruct & sample)
 {
-	PlaceObject(object, botLeftLoc, EDirectionEnum::VE_Up, sizeX, sizeY, sizeZ);
+	const FLatticePointStruct* found = samples.Find(index);
+	if (found)
+	{
+		sample = *found;
+		return true;
+	}
+
+	FVector point = FVector(lattice.Origin + lattice.Step * FVector2D(index), z);
+	sample = FLatticePointStruct();
+	sample.bInReach = IsInLightReach(point, light);
+	if (sample.bInReach)
+	{
+		// Only traces are paid for
+		if (budget <= 0)
+			return false;
+		--budget;
+
+		sample.Blocker = GetLightBlocker(world, point, light);
+		sample.bLit = sample.Blocker == nullptr;
+
+		// Light from outside the room can only come in through its passages
+		if (!sample.bLit && !walls.Bounds.IsInside(FVector2D(light.Location)))
+		{
+			FVector start = FVector(FVector2D(point), 0.f);
+			FVector end = FVector(FVector2D(light.Location), 0.f);
+			for (int i = 0; i < walls.Openings.Num() && i < 32; ++i)
+				if (FMath::LineBoxIntersection(FBox(FVector(walls.Openings[i].Min, -1.f), FVector(walls.Openings[i].Max, 1.f)), start, end, end - start))
+					sample.Openings |= 1u << i;
+		}
+	}
+
+	samples.Add(index, sample);
+	return true;
 }
-void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const FIntVector botLeftLoc, const EDirectionEnum direction, const int sizeX, const int sizeY)
+// Returns the bounds of the lattice's points from min to max
+FBox2D AMainGameMode::GetLatticeBounds(const FSampleLatticeStruct & lattice, const FIntPoint min, const FIntPoint max)
 {
-	UObject* obj = object->_getUObject();
-	object->Execute_SetSizeXY(obj, sizeX, sizeY);
-	object->Execute_Place(obj, botLeftLoc, direction);
+	// Steps can be negative, so corners are added instead of taken as min and max
+	FBox2D bounds = FBox2D(ForceInit);
+	bounds += lattice.Origin + lattice.Step * FVector2D(min);
+	bounds += lattice.Origin + lattice.Step * FVector2D(max);
+	return bounds;
 }
-void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const FIntVector botLeftLoc, const EDirectionEnum direction, const int sizeX, const int sizeY, const int sizeZ)
+// Returns true if the room's walls hide the whole quad from the light, which is only certain when no passage is in the way
+bool AMainGameMode::IsQuadEnclosed(const FBox2D & quad, const FRoomWallsStruct & walls, const FLightSampleStruct & light)
 {
-	UObject* obj = object->_getUObject();
-	object->Execute_SetSize(obj, FIntVector(sizeX, sizeY, sizeZ));
-	object->Execute_Place(obj, botLeftLoc, direction);
-}
+	// Light inside the room is not behind its walls
+	FVector2D lightLocation = FVector2D(light.Location);
+	if (walls.Bounds.IsInside(lightLocation))
+		return false;
+
+	// Every ray from the light to the quad crosses the walls inside this box, either on a wall or in a passage
+	FBox2D rays = quad;
+	rays += lightLocation;
+	for (const FBox2D& opening : walls.Openings)
+		if (opening.Intersect(rays))
+			return false;
+
+	return true;
+}
+// Checks illumination of all rooms at once, on worker threads if parallel is true
+// Returns bit per room, true if room is illuminated
+TBitArray<> AMainGameMode::ClassifyRoomsIllumination(const TArray<LabRoom*>& rooms, const bool parallel, const bool adaptive)
+{
+	SCOPE_CYCLE_COUNTER(STAT_ClassifyIllumination);
+
+	TBitArray<> result(false, rooms.Num());
+
+	UWorld* gameWorld = GetWorld();
+	if (!gameWorld || rooms.Num() == 0)
+		return result;
+
+	// Everything that touches game objects is done here on the game thread
+	TArray<FLightSampleStruct> lights = GatherLightSamples();
+	TArray<TArray<FVector>> roomLocations;
+	roomLocations.SetNum(rooms.Num());
+	// Interiors sampled adaptively, budget of 0 means no interior
+	bool useAreas = adaptive && CVarAdaptiveSampling.GetValueOnGameThread() != 0;
+	TArray<FSampleLatticeStruct> roomLattices;
+	TArray<FRoomWallsStruct> roomWalls;
+	TArray<int32> roomBudgets;
+	roomLattices.SetNum(rooms.Num());
+	roomWalls.SetNum(rooms.Num());
+	roomBudgets.SetNumZeroed(rooms.Num());
+	for (int i = 0; i < rooms.Num(); ++i)
+	{
+		// Rooms that are not spawned are never illuminated
+		if (!rooms[i] || !SpawnedRoomObjects.Contains(rooms[i]))
+			continue;
+
+		GetRoomSamplePoints(rooms[i], roomLocations[i], !useAreas);
+		if (useAreas && GetRoomSampleLattice(rooms[i], roomLattices[i]))
+		{
+			GetRoomWalls(rooms[i], roomWalls[i]);
+			roomBudgets[i] = roomLattices[i].Size.X * roomLattices[i].Size.Y;
+		}
+	}
+
+	// Bits share memory so every thread writes into its own byte
+	TArray<uint8> lit;
+	lit.SetNumZeroed(rooms.Num());
+	ParallelFor(rooms.Num(), [gameWorld, &roomLocations, &roomLattices, &roomWalls, &roomBudgets, &lights, &lit](int32 i)
+	{
+		bool bLit = IsAnyLocationLit(gameWorld, roomLocations[i], lights);
+		if (!bLit && roomBudgets[i] > 0)
+			bLit = IsLatticeLit(gameWorld, roomLattices[i], 30.f, roomWalls[i], lights, roomBudgets[i]); // Z is set to avoid interferance with floor
+		lit[i] = bLit ? 1 : 0;
+	}, !parallel || CVarParallelIllumination.GetValueOnGameThread() == 0);
+
+	for (int i = 0; i < rooms.Num(); ++i)
+		result[i] = lit[i] != 0;
+
+	return result;
+}
+// Classifies rooms and rooms behind their exits so IsRoomIlluminated doesn't have to
+void AMainGameMode::PrecomputeIllumination(const TArray<LabRoom*>& rooms)
+{
+	PrecomputedIllumination.Empty();
+
+	TArray<LabRoom*> toClassify;
+	for (LabRoom* room : rooms)
+	{
+		if (!room)
+			continue;
+
+		toClassify.AddUnique(room);
+		for (LabPassage* passage : room->Passages)
+		{
+			if (!passage || !passage->bIsDoor || passage->Width != ExitDoorWidth)
+				continue;
+			LabRoom* otherRoom = passage->To == room ? passage->From : passage->To;
+			if (otherRoom)
+				toClassify.AddUnique(otherRoom);
+		}
+	}
+
+	TBitArray<> lit = ClassifyRoomsIllumination(toClassify);
+	for (int i = 0; i < toClassify.Num(); ++i)
+		PrecomputedIllumination.Add(toClassify[i], lit[i]);
+}
+
+// Returns the light level for a passage
+float AMainGameMode::GetPassageLightingAmount(LabPassage * passage, bool oneSide, bool innerSide, const bool returnFirstPositive)
+{
+	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::GetPassageLightingAmount"));
+
+	if (!passage)
+		return 0.f;
+
+	TArray<FVector> locations;
+	GetPassageSamplePoints(passage, locations, oneSide, innerSide);
+
+	FVector lightLoc;	
+	return GetLightingAmount(lightLoc, locations, returnFirstPositive);
+}
+// Returns true if passage is illuminated
+bool AMainGameMode::IsPassageIlluminated(LabPassage * passage, bool oneSide, bool innerSide)
+{
+	return GetPassageLightingAmount(passage, oneSide, innerSide, true) > 0.f;
+}
+// Returns the light level for a room
+float AMainGameMode::GetRoomLightingAmount(LabRoom * room, const bool returnFirstPositive)
+{
+	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::GetRoomLightingAmount"));
+
+	if (!room)
+		return 0.f;
+
+	float light = 0.f;
+
+	// for (LabPassage* passage : room->Passages)
+	for (int i = 0; i < room->Passages.Num(); ++i)
+	{
+		LabPassage* passage = room->Passages[i];
+
+		if (!passage)
+			continue;
+
+		// TODO shouldn't always be oneSide
+		float temp = GetPassageLightingAmount(passage, true, passage->From == room, returnFirstPositive);
+		light = temp > light ? temp : light;
+		if (returnFirstPositive && light > 0.f)
+			return light;
+
+	}
+
+	TArray<FVector> locations;
+	// Small rooms still get at least one point inside
+	int stepX = LabScalability::GetLightSampleStep(room->SizeX - 2);
+	int stepY = LabScalability::GetLightSampleStep(room->SizeY - 2);
+	for (int x = stepX; x < room->SizeX - 1; x += stepX)
+	{
+		for (int y = stepY; y < room->SizeY - 1; y += stepY)
+		{
+			float pointX, pointY;
+			GridToWorld(room->BotLeftX + x, room->BotLeftY + y, pointX, pointY);
+			FVector point = FVector(pointX, pointY, 30); // Z is set to avoid interferance with floor
+
+			locations.Add(point);
+		}
+	}
+	FVector lightLoc;
+	float temp = GetLightingAmount(lightLoc, locations, returnFirstPositive);
+	light = temp > light ? temp : light;
+
+	return light;
+}
+// Returns true if the room is in light
+bool AMainGameMode::IsRoomIlluminated(LabRoom * room)
+{
+	const bool* precomputed = PrecomputedIllumination.Find(room);
+	if (precomputed)
+		return *precomputed;
+
+	if (!SpawnedRoomObjects.Contains(room))
+		return false;
+
+	// Adaptive sampling only needs the answer, not the light level
+	if (CVarAdaptiveSampling.GetValueOnGameThread() != 0)
+		return ClassifyRoomsIllumination(TArray<LabRoom*>({ room }), false)[0];
+
+	return GetRoomLightingAmount(room, true) > 0.f;
+}
+
+// Changes world location into grid location
+void AMainGameMode::WorldToGrid(const float worldX, const float worldY, int & gridX, int & gridY)
+{
+	// We reverse x and y
+	gridX = worldY / 50 + (worldY >= 0 ? 0 : -1);
+	gridY = worldX / 50 + (worldX >= 0 ? 0 : -1);
+}
+// Changes grid location into world location
+void AMainGameMode::GridToWorld(const int gridX, const int gridY, float & worldX, float & worldY)
+{
+	GridToWorld(gridX, gridY, 1, 1, worldX, worldY);
+}
+void AMainGameMode::GridToWorld(const int botLeftX, const int botLeftY, const int sizeX, const int sizeY, float & worldX, float & worldY)
+{
+	// We reverse x and y
+	worldX = botLeftY * 50.f + sizeY * 25.f; // -25.f
+	worldY = botLeftX * 50.f + sizeX * 25.f; // -25.f
+}
+// Returns world location of the passage's center on the floor level
+FVector AMainGameMode::GetPassageLocation(LabPassage * passage)
+{
+	if (!passage)
+		return FVector::ZeroVector;
+
+	bool vertical = passage->GridDirection == EDirectionEnum::VE_Up || passage->GridDirection == EDirectionEnum::VE_Down;
+	float centerX, centerY;
+	GridToWorld(passage->BotLeftX, passage->BotLeftY, vertical ? passage->Width : 1, vertical ? 1 : passage->Width, centerX, centerY);
+
+	return FVector(centerX, centerY, 0);
+}
+
+// Places an object on the map
+// TODO return false if can't place?
+void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const int botLeftX, const int botLeftY, const EDirectionEnum direction)
+{
+	PlaceObject(object, FIntVector(botLeftX, botLeftY, 0), direction);
+}
+void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const int botLeftX, const int botLeftY, const int sizeX, const int sizeY)
+{
+	PlaceObject(object, FIntVector(botLeftX, botLeftY, 0), EDirectionEnum::VE_Up, sizeX, sizeY);
+}
+void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const int botLeftX, const int botLeftY, const int sizeX, const int sizeY, const int sizeZ)
+{
+	PlaceObject(object, FIntVector(botLeftX, botLeftY, 0), EDirectionEnum::VE_Up, sizeX, sizeY, sizeZ);
+}
+void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const int botLeftX, const int botLeftY, const EDirectionEnum direction, const int sizeX, const int sizeY)
+{
+	PlaceObject(object, FIntVector(botLeftX, botLeftY, 0), direction, sizeX, sizeY);
+}
+void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const int botLeftX, const int botLeftY, const EDirectionEnum direction, const int sizeX, const int sizeY, const int sizeZ)
+{
+	PlaceObject(object, FIntVector(botLeftX, botLeftY, 0), direction, sizeX, sizeY, sizeZ);
+}
+void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const FIntVector botLeftLoc, const EDirectionEnum direction)
+{
+	UObject* obj = object->_getUObject();
+	// Our own objects are moved once instead of resized and then moved and rotated
+	if (LabNativeEvents::CanPlaceAtOnce(obj))
+		Cast<ABasicPlaceableObject>(obj)->PlaceAtOnce(botLeftLoc, direction);
+	else
+		LabNativeEvents::Place(obj, botLeftLoc, direction);
+}
+void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const FIntVector botLeftLoc, const int sizeX, const int sizeY)
+{
+	PlaceObject(object, botLeftLoc, EDirectionEnum::VE_Up, sizeX, sizeY);
+}
+void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const FIntVector botLeftLoc, const int sizeX, const int sizeY, const int sizeZ)
+{
+	PlaceObject(object, botLeftLoc, EDirectionEnum::VE_Up, sizeX, sizeY, sizeZ);
+}
+void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const FIntVector botLeftLoc, const EDirectionEnum direction, const int sizeX, const int sizeY)
+{
+	UObject* obj = object->_getUObject();
+	if (LabNativeEvents::CanPlaceAtOnce(obj))
+	{
+		Cast<ABasicPlaceableObject>(obj)->PlaceAtOnce(botLeftLoc, direction, FIntVector(sizeX, sizeY, 0));
+		return;
+	}
+	LabNativeEvents::SetSizeXY(obj, sizeX, sizeY);
+	LabNativeEvents::Place(obj, botLeftLoc, direction);
+}
+void AMainGameMode::PlaceObject(TScriptInterface<IPlaceable> object, const FIntVector botLeftLoc, const EDirectionEnum direction, const int sizeX, const int sizeY, const int sizeZ)
+{
+	UObject* obj = object->_getUObject();
+	if (LabNativeEvents::CanPlaceAtOnce(obj))
+	{
+		Cast<ABasicPlaceableObject>(obj)->PlaceAtOnce(botLeftLoc, direction, FIntVector(sizeX, sizeY, sizeZ));
+		return;
+	}
+	LabNativeEvents::SetSize(obj, FIntVector(sizeX, sizeY, sizeZ));
+	LabNativeEvents::Place(obj, botLeftLoc, direction);
+}
+// Spawns an object of the class already placed, its transform is only set once
+ABasicPlaceableObject* AMainGameMode::SpawnPlaced(UClass* cl, const FIntVector botLeftLoc, const EDirectionEnum direction, const FIntVector size)
+{
+	ABasicPlaceableObject* object = GetWorld()->SpawnActorDeferred<ABasicPlaceableObject>(cl, FTransform::Identity, nullptr, nullptr, ESpawnActorCollisionHandlingMethod::AlwaysSpawn);
+	if (!object)
+		return nullptr;
+
+	// Blueprints that change placing are placed the usual way after spawning
+	if (!LabNativeEvents::CanPlaceAtOnce(object))
+	{
+		object->FinishSpawning(FTransform::Identity);
+		if (size.X < 1 || size.Y < 1)
+			PlaceObject(object, botLeftLoc, direction);
+		else if (size.Z < 1)
+			PlaceObject(object, botLeftLoc, direction, size.X, size.Y);
+		else
+			PlaceObject(object, botLeftLoc, direction, size.X, size.Y, size.Z);
+		return object;
+	}
+
+	// Sizes of our objects are known before they finish spawning
+	FTransform transform = object->GetPlacementTransform(botLeftLoc, direction, size);
+	object->GridDirection = direction;
+	object->FinishSpawning(transform);
+	return object;
+}
 
 // Returns by reference character's location on the grid
 void AMainGameMode::GetCharacterLocation(int & x, int & y)
@@ -520,6 +1264,7 @@ LabRoom * AMainGameMode::GetCharacterRoom()
 	int x, y;
 	GetCharacterLocation(x, y);
 
+	LabRoom* lastActualRoom = ActualPlayerRoom;
 	if (!ActualPlayerRoom || !PlayerRoom)
 		MapSpaceIsFree(false, true, x, y, 1, 1, ActualPlayerRoom);
 	else
@@ -540,6 +1285,11 @@ LabRoom * AMainGameMode::GetCharacterRoom()
 		else
 			MapSpaceIsFree(false, true, x, y, 1, 1, ActualPlayerRoom);
 	}
+	if (lastActualRoom != ActualPlayerRoom)
+	{
+		MarkRoomDirty(lastActualRoom);
+		MarkRoomDirty(ActualPlayerRoom);
+	}
 	/*if (!(ActualPlayerRoom && ActualPlayerRoom->BotLeftX <= x && ActualPlayerRoom->BotLeftY <= y && ActualPlayerRoom->BotLeftX + ActualPlayerRoom->SizeX - 1 >= x && ActualPlayerRoom->BotLeftY + ActualPlayerRoom->SizeY - 1 >= y))
 		MapSpaceIsFree(false, true, x, y, 1, 1, ActualPlayerRoom);*/
 
@@ -558,6 +1308,8 @@ void AMainGameMode::OnEnterRoom() // LabRoom* lastRoom, LabRoom* newRoom)
 {
 	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::OnEnterRoom"));
 
+	double startTime = FPlatformTime::Seconds();
+
 	LabRoom* lastRoom = PlayerRoom;
 	PlayerRoom = ActualPlayerRoom;
 
@@ -586,10 +1338,109 @@ void AMainGameMode::OnEnterRoom() // LabRoom* lastRoom, LabRoom* newRoom)
 	if (toActivateLamps)
 		ActivateRoomLamps(PlayerRoom);
 
-	if(RandBool(ReshapeDarknessOnEnterProbability))
-		ReshapeAllDarkness();
-	ExpandInDepth(PlayerRoom, ExpandDepth);
-	SpawnFillInDepth(PlayerRoom, SpawnFillDepth);
+	// Rooms were kept only because character was in them
+	MarkRoomDirty(lastRoom);
+	MarkRoomDirty(PlayerRoom);
+
+	if(RandBool(CurrentReshapeDarknessOnEnterProbability))
+		ReshapeDarknessOnMap();
+	ExpandInDepth(PlayerRoom, CurrentExpandDepth);
+	SpawnFillInDepth(PlayerRoom, CurrentSpawnFillDepth);
+
+	// Prediction was made for the previous room
+	PredictedPassage = nullptr;
+	LookAheadStage = 0;
+
+	RecordCost(EnterRoomCostMs, startTime);
+	UpdateGovernor();
+}
+
+// Returns the passage of the player's room the character is most likely to go through next
+LabPassage * AMainGameMode::PredictNextPassage()
+{
+	if (!PlayerRoom || !MainPlayerController)
+		return nullptr;
+
+	ACharacter* character = MainPlayerController->GetCharacter();
+	if (!character)
+		return nullptr;
+
+	// Heading is mostly where character moves, but also where he looks
+	FVector velocity = character->GetVelocity().GetSafeNormal2D();
+	FVector facing = MainPlayerController->GetControlRotation().Vector().GetSafeNormal2D();
+	FVector heading = velocity.IsNearlyZero() ? facing : (velocity * PredictionVelocityWeight + facing * (1.f - PredictionVelocityWeight)).GetSafeNormal2D();
+	if (heading.IsNearlyZero())
+		return nullptr;
+
+	FVector characterLoc = character->GetActorLocation();
+	characterLoc.Z = 0;
+
+	LabPassage* bestPassage = nullptr;
+	float bestScore = 0.f;
+	for (LabPassage* passage : PlayerRoom->Passages)
+	{
+		if (!passage)
+			continue;
+
+		FVector toPassage = GetPassageLocation(passage) - characterLoc;
+		float distance = toPassage.Size2D();
+		if (distance > PredictionRadius)
+			continue;
+
+		float alignment = FVector::DotProduct(heading, toPassage.GetSafeNormal2D());
+		if (alignment < PredictionMinAlignment)
+			continue;
+
+		// Closer passages in front of the character are more likely
+		float score = alignment * (1.f - distance / PredictionRadius);
+		if (score > bestScore)
+		{
+			bestScore = score;
+			bestPassage = passage;
+		}
+	}
+
+	return bestPassage;
+}
+// Expands and spawns the room behind predicted passage, one step per frame
+void AMainGameMode::LookAhead()
+{
+	// Passages can be deleted while we wait
+	if (PredictedPassage && (!PlayerRoom || !PlayerRoom->Passages.Contains(PredictedPassage)))
+	{
+		PredictedPassage = nullptr;
+		LookAheadStage = 0;
+	}
+
+	LabPassage* passage = PredictNextPassage();
+	if (passage != PredictedPassage)
+	{
+		PredictedPassage = passage;
+		LookAheadStage = 0;
+	}
+
+	if (!PredictedPassage)
+		return;
+
+	LabRoom* nextRoom = PredictedPassage->From == PlayerRoom ? PredictedPassage->To : PredictedPassage->From;
+	if (!nextRoom)
+		return;
+
+	// The same work OnEnterRoom would do for the next room, split between frames
+	// Full depths reach one room further than the pass from the player's room did
+	// The next room is adjacent to the player's room, so it's already complete and only rooms beyond it are queued
+	switch (LookAheadStage)
+	{
+	case 0:
+		ExpandInDepth(nextRoom, CurrentExpandDepth, PredictedPassage);
+		break;
+	case 1:
+		SpawnFillInDepth(nextRoom, CurrentSpawnFillDepth, PredictedPassage, GetPassageLocation(PredictedPassage) + FVector(0, 0, 30), 1);
+		break;
+	default:
+		return;
+	}
+	++LookAheadStage;
 }
 
 // Called when character loses all of his lives
@@ -632,8 +1483,12 @@ void AMainGameMode::OnPickUp(TScriptInterface<class IPickupable> object)
 	LabRoom* room;
 	if (!MapSpaceIsFree(false, true, x, y, 1, 1, room))
 	{
-		if (SpawnedRoomObjects.Contains(room))
-			SpawnedRoomObjects[room].Remove(object->_getUObject());
+		if (SpawnedRoomObjects.Contains(room) && SpawnedRoomObjects[room].Remove(object->_getUObject()) > 0)
+		{
+			// The object won't come back to its pool
+			FPoolStatsStruct& stats = PoolStats.FindOrAdd(actor->GetClass());
+			stats.Live = FMath::Max(stats.Live - 1, 0);
+		}
 
 		// TODO also deallocate room space
 	}
@@ -658,6 +1513,9 @@ void AMainGameMode::OnExitOpened(ABasicDoor* door)
 	if (MapSpaceIsFree(false, true, x, y, 1, 1, intersected))
 		return;
 
+	// Exit room might still be waiting for its contents
+	SpawnFillRoom(intersected);
+
 	// Trying to find exit volume
 	for (TScriptInterface<IDeactivatable> object : SpawnedRoomObjects[intersected])
 	{
@@ -670,6 +1528,12 @@ void AMainGameMode::OnExitOpened(ABasicDoor* door)
 		break;
 	}
 }
+// Called when a door starts opening or closing since it changes what light can reach
+void AMainGameMode::OnDoorMoved(ABasicDoor * door)
+{
+	if (door)
+		MovingDoors.AddUnique(door);
+}
 
 // Gets the pool for the object/class
 TArray<TScriptInterface<IDeactivatable>>& AMainGameMode::GetCorrectPool(TScriptInterface<IDeactivatable> object)
@@ -680,47 +1544,354 @@ TArray<TScriptInterface<IDeactivatable>>& AMainGameMode::GetCorrectPool(TScriptI
 }
 TArray<TScriptInterface<IDeactivatable>>& AMainGameMode::GetCorrectPool(UClass * cl)
 {
-	if (cl == BasicFloorBP)
-		return BasicFloorPool;
-	if (cl == BasicWallBP)
-		return BasicWallPool;
-	if (cl == BasicDoorBP)
-		return BasicDoorPool;
-	if (cl == WallLampBP)
-		return WallLampPool;
-	if (cl == FlashlightBP)
-		return FlashlightPool;
-	if (cl == DoorcardBP)
-		return DoorcardPool;
-	if (cl == ExitVolumeBP)
-		return ExitVolumePool;
-	return DefaultPool;
+	TArray<TScriptInterface<IDeactivatable>>** pool = PoolRegistry.Find(cl);
+	if (pool)
+		return **pool;
+	return DefaultPools.FindOrAdd(cl);
 }
-
-// Deactivates and adds to a pool
-void AMainGameMode::PoolObject(TScriptInterface<IDeactivatable> object)
+// Makes GetCorrectPool return the pool for the class
+void AMainGameMode::RegisterPool(UClass * cl, TArray<TScriptInterface<IDeactivatable>>& pool)
 {
-	object->Execute_SetActive(object->_getUObject(), false);
-	GetCorrectPool(object).Add(object);
+	if (cl)
+		PoolRegistry.Add(cl, &pool);
 }
-void AMainGameMode::PoolObjects(TArray<TScriptInterface<IDeactivatable>>& objects)
+// Spawns inactive objects into the pools until each has as many as its lab.Pool.Prewarm variable says
+void AMainGameMode::PrewarmPools()
 {
-	for (TScriptInterface<IDeactivatable> object : objects)
-		PoolObject(object);
-}
+	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::PrewarmPools"));
 
-// Pool full parts of the lab
-void AMainGameMode::PoolRoom(LabRoom * room)
-{
-	DespawnRoom(room);
+	double startTime = FPlatformTime::Seconds();
+	int spawned = 0;
+	auto prewarm = [this, &spawned](UClass* cl, const int count)
+	{
+		if (!cl || !cl->ImplementsInterface(UDeactivatable::StaticClass()))
+			return;
 
-	AllocatedRoomSpace.Remove(room);
-	AllocatedRooms.Remove(room);
-	if (PlayerRoom == room)
-		PlayerRoom = nullptr;
-	if (ActualPlayerRoom == room)
+		TArray<TScriptInterface<IDeactivatable>>& pool = GetCorrectPool(cl);
+		pool.Reserve(count);
+		PoolStats.FindOrAdd(cl).Reserved = count;
+		while (pool.Num() < count)
+		{
+			// Not PoolObject since these were never in use
+			AActor* actor = GetWorld()->SpawnActor<AActor>(cl);
+			if (!actor)
+				return;
+			LabNativeEvents::SetActive(actor, false);
+			pool.Add(actor);
+			++spawned;
+		}
+	};
+
+	// Floors and walls are only actors in one of the geometry modes
+	if (GetGeometryMode() == EGeometryModeEnum::VE_Actors)
+	{
+		prewarm(BasicFloorBP, CVarPrewarmFloors.GetValueOnGameThread());
+		prewarm(BasicWallBP, CVarPrewarmWalls.GetValueOnGameThread());
+	}
+	prewarm(BasicDoorBP, CVarPrewarmDoors.GetValueOnGameThread());
+	prewarm(WallLampBP, CVarPrewarmLamps.GetValueOnGameThread());
+	prewarm(FlashlightBP, CVarPrewarmFlashlights.GetValueOnGameThread());
+	prewarm(DoorcardBP, CVarPrewarmDoorcards.GetValueOnGameThread());
+	prewarm(ExitVolumeBP, CVarPrewarmExitVolumes.GetValueOnGameThread());
+
+	UE_LOG(LogDarkLab, Log, TEXT("Pools prewarmed: %d objects spawned in %f ms"), spawned, (FPlatformTime::Seconds() - startTime) * 1000.0);
+}
+// Returns the number of idle objects the pool keeps when trimming
+int AMainGameMode::GetPoolTarget(const FPoolStatsStruct& stats) const
+{
+	return FMath::Max(stats.Reserved, FMath::CeilToInt(stats.HighWater * FMath::Max(CVarPoolIdleRatio.GetValueOnGameThread(), 0.f)));
+}
+// Updates pool stats and destroys some idle objects above the target if nothing else is going on
+void AMainGameMode::TrimPools()
+{
+	int live = 0, highWater = 0, hits = 0, misses = 0;
+	for (const TPair<UClass*, FPoolStatsStruct>& pair : PoolStats)
+	{
+		live += pair.Value.Live;
+		highWater += pair.Value.HighWater;
+		hits += pair.Value.Hits;
+		misses += pair.Value.Misses;
+	}
+	int idle = 0;
+	for (const TPair<UClass*, TArray<TScriptInterface<IDeactivatable>>*>& pair : PoolRegistry)
+		idle += pair.Value->Num();
+	for (const TPair<UClass*, TArray<TScriptInterface<IDeactivatable>>>& pair : DefaultPools)
+		idle += pair.Value.Num();
+	SET_DWORD_STAT(STAT_PoolLive, live);
+	SET_DWORD_STAT(STAT_PoolIdle, idle);
+	SET_DWORD_STAT(STAT_PoolHighWater, highWater);
+	SET_DWORD_STAT(STAT_PoolHits, hits);
+	SET_DWORD_STAT(STAT_PoolMisses, misses);
+	SET_FLOAT_STAT(STAT_PoolHitRatio, hits + misses > 0 ? (float)hits / (hits + misses) : 0.f);
+
+	// Objects are only destroyed when no rooms are being spawned or reshaped, so trimming never adds to a busy frame
+	if (CVarPoolTrim.GetValueOnGameThread() == 0 || SpawnQueue.Num() > 0 || ReshapeJob.Phase != EReshapePhaseEnum::VE_Idle)
+		return;
+
+	int budget = CVarPoolTrimPerFrame.GetValueOnGameThread();
+	for (const TPair<UClass*, FPoolStatsStruct>& pair : PoolStats)
+	{
+		if (budget <= 0)
+			break;
+
+		TArray<TScriptInterface<IDeactivatable>>& pool = GetCorrectPool(pair.Key);
+		int target = GetPoolTarget(pair.Value);
+		while (pool.Num() > target && budget > 0)
+		{
+			AActor* actor = Cast<AActor>(pool.Pop(false).GetObject());
+			if (actor)
+				actor->Destroy();
+			--budget;
+			INC_DWORD_STAT(STAT_PoolTrimmed);
+		}
+	}
+}
+
+// Deactivates and adds to a pool
+void AMainGameMode::PoolObject(TScriptInterface<IDeactivatable> object)
+{
+	DeactivatePooled(object, GetPoolingStrategy());
+	GetCorrectPool(object).Add(object);
+
+	FPoolStatsStruct& stats = PoolStats.FindOrAdd(object->_getUObject()->GetClass());
+	stats.Live = FMath::Max(stats.Live - 1, 0);
+}
+void AMainGameMode::PoolObjects(TArray<TScriptInterface<IDeactivatable>>& objects)
+{
+	// Objects of a room are mostly floors and walls in a row, so the pool and stats are only looked up when the class changes
+	EPoolingStrategyEnum strategy = GetPoolingStrategy();
+	UClass* lastClass = nullptr;
+	TArray<TScriptInterface<IDeactivatable>>* pool = nullptr;
+	FPoolStatsStruct* stats = nullptr;
+	for (TScriptInterface<IDeactivatable> object : objects)
+	{
+		UClass* cl = object->_getUObject()->GetClass();
+		if (cl != lastClass)
+		{
+			lastClass = cl;
+			pool = &GetCorrectPool(cl);
+			stats = &PoolStats.FindOrAdd(cl);
+		}
+
+		DeactivatePooled(object, strategy);
+		pool->Add(object);
+		stats->Live = FMath::Max(stats->Live - 1, 0);
+	}
+}
+// Deactivates the object the way lab.Pool.Strategy says
+void AMainGameMode::DeactivatePooled(TScriptInterface<IDeactivatable> object, const EPoolingStrategyEnum strategy)
+{
+	UObject* obj = object->_getUObject();
+
+	// Only our own objects know how to be parked
+	ABasicDeactivatableObject* parkable = strategy == EPoolingStrategyEnum::VE_Park ? Cast<ABasicDeactivatableObject>(obj) : nullptr;
+	if (parkable)
+		parkable->Park(GetParkingLocation());
+	else
+		LabNativeEvents::SetActive(obj, false);
+}
+// Returns a place far from the laboratory for the next parked object
+FVector AMainGameMode::GetParkingLocation()
+{
+	int slot = NextParkingSlot;
+	NextParkingSlot = (NextParkingSlot + 1) % (ParkingGridSize * ParkingGridSize);
+	return FVector((slot % ParkingGridSize) * ParkingSpacing, (slot / ParkingGridSize) * ParkingSpacing, -ParkingDepth);
+}
+
+// Returns true if the player could see through the passage
+bool AMainGameMode::IsPassageOpen(LabPassage * passage)
+{
+	if (!passage->bIsDoor)
+		return true;
+
+	// A door that isn't spawned yet leaves an empty doorway
+	TArray<TScriptInterface<IDeactivatable>>* objects = SpawnedPassageObjects.Find(passage);
+	if (!objects)
+		return true;
+	for (TScriptInterface<IDeactivatable> object : *objects)
+	{
+		ABasicDoor* door = Cast<ABasicDoor>(object.GetObject());
+		if (door && door->IsClosed())
+			return false;
+	}
+	return true;
+}
+// Finds spawned rooms that can be seen from the player's room through open passages, up to lab.Culling.PortalDepth passages away
+void AMainGameMode::GetPortalVisibleRooms(TSet<LabRoom*>& visible)
+{
+	// The character might stand in a passage between the two
+	TArray<LabRoom*> toVisit;
+	if (ActualPlayerRoom)
+		toVisit.Add(ActualPlayerRoom);
+	if (PlayerRoom && PlayerRoom != ActualPlayerRoom)
+		toVisit.Add(PlayerRoom);
+	visible.Append(toVisit);
+
+	// Only spawned rooms and passages are walked and only so far, so the cost doesn't grow with the allocated laboratory
+	// Rooms are visited a depth at a time
+	TArray<LabRoom*> nextToVisit;
+	for (int depth = CVarCullingPortalDepth.GetValueOnGameThread(); depth > 0 && toVisit.Num() > 0; --depth)
+	{
+		for (LabRoom* room : toVisit)
+		{
+			for (LabPassage* passage : room->Passages)
+			{
+				if (!passage || !SpawnedPassageObjects.Contains(passage))
+					continue;
+
+				LabRoom* otherRoom = RoomGraph.GetOtherRoom(passage, room);
+				if (!otherRoom || visible.Contains(otherRoom) || !SpawnedRoomObjects.Contains(otherRoom) || !IsPassageOpen(passage))
+					continue;
+
+				visible.Add(otherRoom);
+				nextToVisit.Add(otherRoom);
+			}
+		}
+		Swap(toVisit, nextToVisit);
+		nextToVisit.Reset();
+	}
+}
+// Returns false if there is no camera to take the frustum from
+bool AMainGameMode::GetViewFrustum(FConvexVolume & frustum)
+{
+	APlayerCameraManager* camera = MainPlayerController ? MainPlayerController->PlayerCameraManager : nullptr;
+	if (!camera)
+		return false;
+
+	int32 sizeX, sizeY;
+	MainPlayerController->GetViewportSize(sizeX, sizeY);
+	float aspectRatio = sizeX > 0 && sizeY > 0 ? (float)sizeX / sizeY : 16.f / 9.f;
+
+	// Same matrices the renderer builds for the view
+	FMatrix viewMatrix = FTranslationMatrix(-camera->GetCameraLocation()) * FInverseRotationMatrix(camera->GetCameraRotation()) * FMatrix(
+		FPlane(0, 0, 1, 0),
+		FPlane(1, 0, 0, 0),
+		FPlane(0, 1, 0, 0),
+		FPlane(0, 0, 0, 1));
+	float halfFOV = FMath::DegreesToRadians(camera->GetFOVAngle()) * 0.5f;
+	FMatrix projectionMatrix = FReversedZPerspectiveMatrix(halfFOV, halfFOV, 1.f, aspectRatio, GNearClippingPlane, GNearClippingPlane);
+
+	GetViewFrustumBounds(frustum, viewMatrix * projectionMatrix, false);
+	return true;
+}
+// Returns true if any part of the room is inside the frustum
+bool AMainGameMode::IsRoomInFrustum(LabRoom * room, const FConvexVolume & frustum)
+{
+	float x, y;
+	GridToWorld(room->BotLeftX, room->BotLeftY, room->SizeX, room->SizeY, x, y);
+
+	// We reverse x and y
+	FVector extent = FVector(room->SizeY * 25.f, room->SizeX * 25.f, CullingRoomHeight * 0.5f);
+	return frustum.IntersectBox(FVector(x, y, CullingRoomHeight * 0.5f), extent);
+}
+// Culls or unculls objects, instanced and merged geometry of the owner, adds what stays culled to the counts
+void AMainGameMode::CullObjects(const void * owner, TArray<TScriptInterface<IDeactivatable>>& objects, const bool culled, int & primitives, int & lights)
+{
+	for (TScriptInterface<IDeactivatable> object : objects)
+	{
+		ABasicDeactivatableObject* deactivatable = Cast<ABasicDeactivatableObject>(object.GetObject());
+		if (!deactivatable)
+			continue;
+
+		deactivatable->SetCulled(culled);
+		primitives += deactivatable->GetNumCulledPrimitives();
+		lights += deactivatable->GetNumCulledLights();
+	}
+
+	// Merged floors and walls of the owner, shared instanced meshes cull their own clusters
+	int geometry = Geometry ? Geometry->SetHidden(owner, culled) : 0;
+	if (culled)
+		primitives += geometry;
+}
+// Stops drawing and ticking rooms the player can't see and resumes the ones that became visible
+void AMainGameMode::UpdateCulling()
+{
+	SCOPE_CYCLE_COUNTER(STAT_Culling);
+
+	// The light budget uses these too
+	PortalVisibleRooms.Reset();
+	GetPortalVisibleRooms(PortalVisibleRooms);
+
+	// Without the player's room nothing is known to be hidden
+	bool enabled = CVarCulling.GetValueOnGameThread() != 0 && PortalVisibleRooms.Num() > 0;
+	TSet<LabRoom*> visible = PortalVisibleRooms;
+	FConvexVolume frustum;
+	bool hasFrustum = enabled && GetViewFrustum(frustum);
+
+	// Culled rooms are checked every frame since objects might have been spawned in them
+	// Visible rooms are only touched when they stop being culled
+	int primitives = 0;
+	int lights = 0;
+	TSet<LabRoom*> culledRooms;
+	for (TPair<LabRoom*, TArray<TScriptInterface<IDeactivatable>>>& pair : SpawnedRoomObjects)
+	{
+		LabRoom* room = pair.Key;
+		bool culled = enabled && !visible.Contains(room) && !(hasFrustum && IsRoomInFrustum(room, frustum));
+		if (culled)
+			culledRooms.Add(room);
+		else
+			visible.Add(room);
+		if (culled || CulledRooms.Contains(room))
+			CullObjects(room, pair.Value, culled, primitives, lights);
+	}
+
+	// Passages are drawn if any of the rooms they connect is, moving doors are never stopped
+	TSet<LabPassage*> culledPassages;
+	for (TPair<LabPassage*, TArray<TScriptInterface<IDeactivatable>>>& pair : SpawnedPassageObjects)
+	{
+		LabPassage* passage = pair.Key;
+		bool culled = enabled && !visible.Contains(passage->From) && !visible.Contains(passage->To);
+		for (int i = 0; culled && i < pair.Value.Num(); ++i)
+		{
+			ABasicDoor* door = Cast<ABasicDoor>(pair.Value[i].GetObject());
+			culled = !door || !door->IsMoving();
+		}
+		if (culled)
+			culledPassages.Add(passage);
+		if (culled || CulledPassages.Contains(passage))
+			CullObjects(passage, pair.Value, culled, primitives, lights);
+	}
+
+	// Despawned rooms and passages drop out, their pooled objects were unculled when deactivated
+	CulledRooms = MoveTemp(culledRooms);
+	CulledPassages = MoveTemp(culledPassages);
+	NumCulledPrimitives = primitives;
+	NumCulledLights = lights;
+
+	SET_DWORD_STAT(STAT_CulledRooms, CulledRooms.Num());
+	SET_DWORD_STAT(STAT_CulledPrimitives, NumCulledPrimitives);
+	SET_DWORD_STAT(STAT_CulledLights, NumCulledLights);
+}
+// Keeps the most important lights casting shadows and stops drawing the least important ones
+void AMainGameMode::UpdateLightBudget()
+{
+	APlayerCameraManager* camera = MainPlayerController ? MainPlayerController->PlayerCameraManager : nullptr;
+	if (!camera)
+		return;
+
+	LightBudget.Update(GetWorld(), MainPlayerController->GetPawn(), camera->GetCameraLocation(), camera->GetCameraRotation().Vector(), RoomGraph, PortalVisibleRooms);
+}
+
+// Pool full parts of the lab
+void AMainGameMode::PoolRoom(LabRoom * room)
+{
+	DespawnRoom(room);
+
+	// Neighbours will have passages leading nowhere
+	MarkRoomDirty(room, true);
+	DirtyRooms.Remove(room);
+	ForgetRoomInReshapeJob(room);
+
+	AllocatedRoomSpace.Remove(room);
+	AllocatedRooms.Remove(room);
+	// Another room might be created in its place
+	RoomContentPlans.Remove(GetRoomPlanKey(room));
+	if (PlayerRoom == room)
+		PlayerRoom = nullptr;
+	if (ActualPlayerRoom == room)
 		ActualPlayerRoom = nullptr;
 
+	RoomGraph.RemoveRoom(room);
 	delete room;
 }
 void AMainGameMode::PoolPassage(LabPassage* passage)
@@ -730,6 +1901,8 @@ void AMainGameMode::PoolPassage(LabPassage* passage)
 
 	PoolObjects(SpawnedPassageObjects[passage]);
 	SpawnedPassageObjects.Remove(passage);
+	if (Geometry)
+		Geometry->RemoveAll(passage);
 	// We don't delete passage from here as it's deleted during room's destruction
 }
 void AMainGameMode::PoolMap()
@@ -742,11 +1915,25 @@ void AMainGameMode::PoolMap()
 
 	// Should already be empty but we do this just in case
 	SpawnedRoomObjects.Empty();
+	CulledRooms.Empty();
+	CulledPassages.Empty();
 	AllocatedRoomSpace.Empty();
 	ExpandedRooms.Empty();
 	VisitedRooms.Empty();
 	RoomsWithLampsOn.Empty();
+	SpawnQueue.Empty();
+	RoomsAwaitingContents.Empty();
+	RoomContentPlans.Empty();
+	PlannedRooms.Empty();
+	LampsOnAfterContents.Empty();
+	DirtyRooms.Empty();
+	LastLightStates.Empty();
+	MovingDoors.Empty();
+	ReshapeJob = FReshapeJobStruct();
+	PredictedPassage = nullptr;
+	LookAheadStage = 0;
 	AllocatedRooms.Empty();
+	RoomGraph.Empty();
 	PlayerRoom = nullptr;
 	ActualPlayerRoom = nullptr;
 	VisitedOverall = 0;
@@ -760,8 +1947,27 @@ void AMainGameMode::PoolDarkness(LabRoom * start, int depth, TArray<LabRoom*>& t
 	if (!start)
 		return;
 
+	// Rooms that can be reached are classified at once
+	TArray<LabRoom*> reachable;
+	reachable.Add(start);
+	for (int i = 0, d = 0; d < depth; ++d)
+	{
+		for (int end = reachable.Num(); i < end; ++i)
+		{
+			for (LabPassage* passage : reachable[i]->Passages)
+			{
+				if (passage && passage->From)
+					reachable.AddUnique(passage->From);
+				if (passage && passage->To)
+					reachable.AddUnique(passage->To);
+			}
+		}
+	}
+	PrecomputeIllumination(reachable);
+
 	TArray<LabRoom*> toPool;
 	PoolDarkness(start, depth, toFix, toPool, stopAtFirstIfLit);
+	PrecomputedIllumination.Empty();
 
 	for (int i = toPool.Num() - 1; i >= 0; --i)
 	{
@@ -811,88 +2017,502 @@ void AMainGameMode::PoolDarkness(LabRoom * start, int depth, TArray<LabRoom*>& t
 		}
 	}
 
-	for (LabPassage* passage : start->Passages)
+	for (LabPassage* passage : start->Passages)
+	{
+		if (passage->From != start)
+			PoolDarkness(passage->From, depth - 1, toFix, toPool, stopAtFirstIfLit); // !!
+		else if (passage->To != start)
+			PoolDarkness(passage->To, depth - 1, toFix, toPool, stopAtFirstIfLit); // !!
+	}
+}
+
+// Pools dark area and fixes every room that needs fixing
+void AMainGameMode::ReshapeDarkness(LabRoom * start, int depth, bool stopAtFirstIfLit)
+{
+	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::ReshapeDarkness"));
+
+	TArray<LabRoom*> toFix;
+	PoolDarkness(start, depth, toFix, stopAtFirstIfLit);
+	for (LabRoom* roomToFix : toFix)
+		FixRoom(roomToFix);
+}
+// Reshapes darkness and expands, spawns and fills rooms
+void AMainGameMode::CompleteReshapeDarkness(LabRoom * start, bool stopAtFirstIfLit)
+{
+	ReshapeDarkness(start, CurrentReshapeDarknessDepth, stopAtFirstIfLit);
+	ExpandInDepth(start, CurrentExpandDepth);
+	SpawnFillInDepth(start, CurrentSpawnFillDepth);
+}
+// Reshapes darkness in player room
+void AMainGameMode::CompleteReshapeDarknessAround()
+{
+	if (!PlayerRoom)
+		return;
+
+	CompleteReshapeDarkness(PlayerRoom, false);
+}
+// Pools all dark rooms on the map and fixes every room that needs fixing
+void AMainGameMode::ReshapeAllDarkness()
+{
+	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::ReshapeAllDarkness"));
+
+	SCOPE_CYCLE_COUNTER(STAT_ReshapeDarkness);
+
+	// Everything is checked so changes up to this point don't matter anymore
+	MarkRoomsAroundChangedLights();
+	DirtyRooms.Empty();
+
+	TArray<LabRoom*> allRooms;
+	AllocatedRoomSpace.GetKeys(allRooms);	
+
+	TArray<LabRoom*> toPool;
+	TArray<LabRoom*> toFix;
+
+	PrecomputeIllumination(allRooms);
+	for (LabRoom* room : allRooms)
+	{
+		if (ShouldPoolDarkRoom(room))
+			toPool.AddUnique(room);
+		else
+			toFix.AddUnique(room);
+	}
+	PrecomputedIllumination.Empty();
+	SET_DWORD_STAT(STAT_ReshapeRoomsChecked, allRooms.Num());
+
+	for (int i = toPool.Num() - 1; i >= 0; --i)
+		PoolRoom(toPool[i]);
+	
+	// We want player's room to be fixed first so nothing interferes with it
+	FixRoom(PlayerRoom);
+	FixRoom(ActualPlayerRoom);
+	for (LabRoom* roomToFix : toFix)
+		FixRoom(roomToFix);
+}
+// Same as ReshapeAllDarkness but only looks at rooms that changed since the last reshape and their neighbours
+void AMainGameMode::ReshapeChangedDarkness()
+{
+	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::ReshapeChangedDarkness"));
+
+	SCOPE_CYCLE_COUNTER(STAT_ReshapeDarkness);
+
+	MarkRoomsAroundChangedLights();
+
+	// Rooms dirtied from here on are left for the next reshape
+	TArray<LabRoom*> toCheck = TakeDirtyRooms();
+
+	TArray<LabRoom*> toPool;
+	TArray<LabRoom*> toFix;
+
+	PrecomputeIllumination(toCheck);
+	for (LabRoom* room : toCheck)
+	{
+		if (ShouldPoolDarkRoom(room))
+			toPool.AddUnique(room);
+		else
+			toFix.AddUnique(room);
+	}
+	PrecomputedIllumination.Empty();
+	SET_DWORD_STAT(STAT_ReshapeRoomsChecked, toCheck.Num());
+
+	// Compares results with what full reshape would do
+	if (bVerifyReshape || CVarVerifyReshape.GetValueOnGameThread() != 0)
+	{
+		LastReshapeMismatches = CountReshapeMismatches(toPool);
+		SET_DWORD_STAT(STAT_ReshapeMismatches, LastReshapeMismatches);
+	}
+
+	for (int i = toPool.Num() - 1; i >= 0; --i)
+		PoolRoom(toPool[i]);
+
+	// Neighbours of pooled rooms were marked during pooling and now have passages leading nowhere
+	for (LabRoom* room : DirtyRooms)
+		toFix.AddUnique(room);
+
+	// We want player's room to be fixed first so nothing interferes with it
+	FixRoom(PlayerRoom);
+	FixRoom(ActualPlayerRoom);
+	for (LabRoom* roomToFix : toFix)
+	{
+		// Fixing may pool rooms that are still in the array
+		if (AllocatedRoomSpace.Contains(roomToFix))
+			FixRoom(roomToFix);
+	}
+}
+// Calls ReshapeChangedDarkness or ReshapeAllDarkness depending on settings
+void AMainGameMode::ReshapeDarknessOnMap()
+{
+	bool incremental = CVarIncrementalReshape.GetValueOnGameThread() != 0;
+
+	// Job pools rooms in later frames, so it expands and spawns around the player again after that
+	// Otherwise passages of the player's room could lead to pooled rooms until the next reshape
+	if (CVarReshapeTimeSlice.GetValueOnGameThread() > 0.f)
+	{
+		StartReshapeJob(!incremental, true);
+		return;
+	}
+
+	double startTime = FPlatformTime::Seconds();
+	if (incremental)
+		ReshapeChangedDarkness();
+	else
+		ReshapeAllDarkness();
+	RecordCost(ReshapeCostMs, startTime);
+}
+// Returns the number of rooms a full reshape would classify differently, logs each of them
+int AMainGameMode::CountReshapeMismatches(const TArray<LabRoom*>& toPool)
+{
+	int mismatches = 0;
+	for (const TPair<LabRoom*, TArray<FRectSpaceStruct>>& pair : AllocatedRoomSpace)
+	{
+		LabRoom* room = pair.Key;
+		if (ShouldPoolDarkRoom(room) == toPool.Contains(room))
+			continue;
+
+		++mismatches;
+		UE_LOG(LogDarkLab, Warning, TEXT("Incremental reshape mismatch: room x: %d, y: %d, sX: %d, sY: %d should %s"), room->BotLeftX, room->BotLeftY, room->SizeX, room->SizeY, toPool.Contains(room) ? TEXT("stay") : TEXT("be pooled"));
+	}
+	return mismatches;
+}
+// Returns true if reshaping should pool the room
+bool AMainGameMode::ShouldPoolDarkRoom(LabRoom * room)
+{
+	// If we found a room that is not in the darkness, we keep it, same if character is in that room
+	if (!room || PlayerRoom == room || ActualPlayerRoom == room || IsRoomIlluminated(room))
+		return false;
+
+	// We check if room has exit cause if it does, we only want to delete it when both this room and the room behind exit are going to be pooled 
+	for (LabPassage* passage : room->Passages)
+	{
+		// found exit
+		if (passage && passage->bIsDoor && passage->Width == ExitDoorWidth)
+		{
+			LabRoom* otherRoom = passage->To == room ? passage->From : passage->To;
+			if (PlayerRoom == otherRoom || ActualPlayerRoom == otherRoom || IsRoomIlluminated(otherRoom))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+// Returns dirty rooms with their neighbours and clears dirty rooms
+TArray<LabRoom*> AMainGameMode::TakeDirtyRooms()
+{
+	TSet<LabRoom*> dirty = MoveTemp(DirtyRooms);
+	DirtyRooms.Empty();
+
+	// Neighbours are checked too since the exit rule depends on them
+	TArray<LabRoom*> rooms;
+	for (LabRoom* room : dirty)
+	{
+		rooms.AddUnique(room);
+		for (LabPassage* passage : room->Passages)
+		{
+			if (!passage)
+				continue;
+			if (passage->From && passage->From != room)
+				rooms.AddUnique(passage->From);
+			if (passage->To && passage->To != room)
+				rooms.AddUnique(passage->To);
+		}
+	}
+
+	return rooms;
+}
+
+// Starts reshaping that is spread between frames, unless one is already running
+void AMainGameMode::StartReshapeJob(const bool allRooms, const bool complete)
+{
+	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::StartReshapeJob"));
+
+	// Running job will pick up the changes next time
+	if (ReshapeJob.Phase != EReshapePhaseEnum::VE_Idle)
+	{
+		ReshapeJob.bComplete = ReshapeJob.bComplete || complete;
+		return;
+	}
+
+	MarkRoomsAroundChangedLights();
+
+	ReshapeJob = FReshapeJobStruct();
+	ReshapeJob.bComplete = complete;
+	ReshapeJob.StartFrame = GFrameCounter;
+	if (allRooms)
+	{
+		AllocatedRoomSpace.GetKeys(ReshapeJob.ToCheck);
+		DirtyRooms.Empty();
+	}
+	else
+		ReshapeJob.ToCheck = TakeDirtyRooms();
+	ReshapeJob.Phase = EReshapePhaseEnum::VE_Classify;
+}
+// Continues reshaping until the time slice is spent
+void AMainGameMode::ProcessReshapeJob()
+{
+	SET_DWORD_STAT(STAT_ReshapePhase, (uint32)ReshapeJob.Phase);
+
+	if (ReshapeJob.Phase == EReshapePhaseEnum::VE_Idle)
+		return;
+
+	SCOPE_CYCLE_COUNTER(STAT_ReshapeDarkness);
+
+	double startTime = FPlatformTime::Seconds();
+	float timeSlice = CVarReshapeTimeSlice.GetValueOnGameThread();
+
+	// At least one step is made every frame so the job always finishes
+	while (StepReshapeJob() && (FPlatformTime::Seconds() - startTime) * 1000.0 < timeSlice);
+
+	RecordCost(ReshapeCostMs, startTime);
+	if (ReshapeJob.Phase == EReshapePhaseEnum::VE_Idle)
+		UpdateGovernor();
+}
+// Makes a single step of reshaping, returns false if there is nothing to do
+bool AMainGameMode::StepReshapeJob()
+{
+	switch (ReshapeJob.Phase)
+	{
+	case EReshapePhaseEnum::VE_Classify:
+		if (ReshapeJob.Index < ReshapeJob.ToCheck.Num())
+		{
+			// Rooms are classified in small batches on worker threads
+			TArray<LabRoom*> batch;
+			for (; ReshapeJob.Index < ReshapeJob.ToCheck.Num() && batch.Num() < ReshapeClassifyBatch; ++ReshapeJob.Index)
+			{
+				if (ReshapeJob.ToCheck[ReshapeJob.Index])
+					batch.Add(ReshapeJob.ToCheck[ReshapeJob.Index]);
+			}
+
+			PrecomputeIllumination(batch);
+			for (LabRoom* room : batch)
+			{
+				if (ShouldPoolDarkRoom(room))
+					ReshapeJob.ToPool.Add(room);
+				else
+					ReshapeJob.ToFix.Add(room);
+			}
+			PrecomputedIllumination.Empty();
+			SET_DWORD_STAT(STAT_ReshapeRoomsChecked, ReshapeJob.Index);
+			return true;
+		}
+		// Rooms are pooled in reverse order, same as in ReshapeAllDarkness
+		ReshapeJob.Phase = EReshapePhaseEnum::VE_Pool;
+		ReshapeJob.Index = ReshapeJob.ToPool.Num() - 1;
+		// Pooling starts next frame
+		return false;
+
+	case EReshapePhaseEnum::VE_Pool:
+		if (ReshapeJob.Index >= 0)
+		{
+			LabRoom* room = ReshapeJob.ToPool[ReshapeJob.Index--];
+			if (!room)
+				return true;
+
+			// Lights could change since classifying or since the last frame of pooling, rooms they reach are checked again
+			// Lights don't change within a frame, so they are scanned once a frame
+			if (ReshapeJob.LightsCheckFrame != GFrameCounter)
+			{
+				ReshapeJob.LightsCheckFrame = GFrameCounter;
+				MarkRoomsAroundChangedLights();
+			}
+
+			// Every room is pooled at once, but only if it's still dark
+			bool stale = ReshapeJob.Stale.Contains(room) || room == PlayerRoom || room == ActualPlayerRoom;
+			if (stale && !ShouldPoolDarkRoom(room))
+			{
+				ReshapeJob.ToFix.Add(room);
+				return true;
+			}
+
+			// Neighbours are fixed in the same step, so no passage leads to a pooled room in any frame
+			TArray<LabRoom*> neighbours;
+			for (LabPassage* passage : room->Passages)
+			{
+				LabRoom* otherRoom = passage ? RoomGraph.GetOtherRoom(passage, room) : nullptr;
+				if (otherRoom)
+					neighbours.AddUnique(otherRoom);
+			}
+
+			bReshapeJobIsPooling = true;
+			PoolRoom(room);
+			bReshapeJobIsPooling = false;
+
+			// Fixing may pool rooms too
+			for (LabRoom* neighbour : neighbours)
+				if (AllocatedRoomSpace.Contains(neighbour))
+					FixRoom(neighbour);
+			return true;
+		}
+		// We want player's room to be fixed first so nothing interferes with it
+		ReshapeJob.ToFix.Insert(ActualPlayerRoom, 0);
+		ReshapeJob.ToFix.Insert(PlayerRoom, 0);
+		for (LabRoom* room : DirtyRooms)
+			ReshapeJob.ToFix.AddUnique(room);
+		ReshapeJob.Phase = EReshapePhaseEnum::VE_Fix;
+		ReshapeJob.Index = 0;
+		return true;
+
+	case EReshapePhaseEnum::VE_Fix:
+		if (ReshapeJob.Index < ReshapeJob.ToFix.Num())
+		{
+			LabRoom* room = ReshapeJob.ToFix[ReshapeJob.Index++];
+			// Fixing may pool rooms that are still in the array
+			if (room && AllocatedRoomSpace.Contains(room))
+				FixRoom(room);
+			return true;
+		}
+		ReshapeJob.Phase = ReshapeJob.bComplete && PlayerRoom ? EReshapePhaseEnum::VE_Expand : EReshapePhaseEnum::VE_Idle;
+		break;
+
+	case EReshapePhaseEnum::VE_Expand:
+		ExpandInDepth(PlayerRoom, CurrentExpandDepth);
+		ReshapeJob.Phase = EReshapePhaseEnum::VE_Spawn;
+		// Expanding is heavy enough for one frame
+		return false;
+
+	case EReshapePhaseEnum::VE_Spawn:
+		SpawnFillInDepth(PlayerRoom, CurrentSpawnFillDepth);
+		ReshapeJob.Phase = EReshapePhaseEnum::VE_Idle;
+		break;
+
+	default:
+		return false;
+	}
+
+	// Job is finished
+	if (ReshapeJob.Phase == EReshapePhaseEnum::VE_Idle)
 	{
-		if (passage->From != start)
-			PoolDarkness(passage->From, depth - 1, toFix, toPool, stopAtFirstIfLit); // !!
-		else if (passage->To != start)
-			PoolDarkness(passage->To, depth - 1, toFix, toPool, stopAtFirstIfLit); // !!
+		LastReshapeFrames = (int)(GFrameCounter - ReshapeJob.StartFrame) + 1;
+		ReshapeJob = FReshapeJobStruct();
+		SET_DWORD_STAT(STAT_LastReshapeFrames, LastReshapeFrames);
+		INC_DWORD_STAT(STAT_ReshapeJobsFinished);
+		return false;
 	}
+	return true;
 }
-
-// Pools dark area and fixes every room that needs fixing
-void AMainGameMode::ReshapeDarkness(LabRoom * start, int depth, bool stopAtFirstIfLit)
+// Removes pooled room from reshaping
+void AMainGameMode::ForgetRoomInReshapeJob(LabRoom * room)
 {
-	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::ReshapeDarkness"));
+	if (ReshapeJob.Phase == EReshapePhaseEnum::VE_Idle)
+		return;
 
-	TArray<LabRoom*> toFix;
-	PoolDarkness(start, depth, toFix, stopAtFirstIfLit);
-	for (LabRoom* roomToFix : toFix)
-		FixRoom(roomToFix);
+	// Rooms are replaced so indices stay correct
+	for (LabRoom*& other : ReshapeJob.ToCheck)
+		if (other == room)
+			other = nullptr;
+	for (LabRoom*& other : ReshapeJob.ToPool)
+		if (other == room)
+			other = nullptr;
+	for (LabRoom*& other : ReshapeJob.ToFix)
+		if (other == room)
+			other = nullptr;
+	ReshapeJob.Stale.Remove(room);
 }
-// Reshapes darkness and expands, spawns and fills rooms
-void AMainGameMode::CompleteReshapeDarkness(LabRoom * start, bool stopAtFirstIfLit)
+
+// Room's lighting, visibility or passages changed, so it has to be checked during next reshape
+void AMainGameMode::MarkRoomDirty(LabRoom * room, const bool withNeighbours)
 {
-	ReshapeDarkness(start, ReshapeDarknessDepth, stopAtFirstIfLit);
-	ExpandInDepth(start, ExpandDepth);
-	SpawnFillInDepth(start, SpawnFillDepth);
+	if (!room)
+		return;
+
+	DirtyRooms.Add(room);
+
+	// Reshape job has to check such rooms again before pooling them
+	bool collectStale = !bReshapeJobIsPooling && (ReshapeJob.Phase == EReshapePhaseEnum::VE_Classify || ReshapeJob.Phase == EReshapePhaseEnum::VE_Pool);
+	if (collectStale)
+		ReshapeJob.Stale.Add(room);
+
+	if (!withNeighbours)
+		return;
+
+	for (LabPassage* passage : room->Passages)
+	{
+		if (!passage)
+			continue;
+		if (passage->From && passage->From != room)
+			MarkRoomDirty(passage->From);
+		if (passage->To && passage->To != room)
+			MarkRoomDirty(passage->To);
+	}
 }
-// Reshapes darkness in player room
-void AMainGameMode::CompleteReshapeDarknessAround()
+// Marks all rooms that a light with such radius could reach
+void AMainGameMode::MarkRoomsDirty(const FVector center, const float radius)
 {
-	if (!PlayerRoom)
-		return;
+	for (const TPair<LabRoom*, TArray<FRectSpaceStruct>>& pair : AllocatedRoomSpace)
+	{
+		LabRoom* room = pair.Key;
 
-	CompleteReshapeDarkness(PlayerRoom, false);
+		// World bounds of the room, a bit bigger since passages are checked from both sides
+		float minX, minY, maxX, maxY;
+		GridToWorld(room->BotLeftX, room->BotLeftY, 0, 0, minX, minY);
+		GridToWorld(room->BotLeftX + room->SizeX, room->BotLeftY + room->SizeY, 0, 0, maxX, maxY);
+		FBox bounds = FBox(FVector(minX - 50.f, minY - 50.f, center.Z - radius), FVector(maxX + 50.f, maxY + 50.f, center.Z + radius));
+
+		if (FMath::SphereAABBIntersection(center, radius * radius, bounds))
+			MarkRoomDirty(room);
+	}
 }
-// Pools all dark rooms on the map and fixes every room that needs fixing
-void AMainGameMode::ReshapeAllDarkness()
+// Marks rooms around lights that changed since last call and around moving doors
+void AMainGameMode::MarkRoomsAroundChangedLights()
 {
-	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::ReshapeAllDarkness"));
+	// Same lights as GetLightingAmount uses
+	TMap<const UPointLightComponent*, FLightStateStruct> lightStates;
+	UWorld* gameWorld = GetWorld();
+	for (TObjectIterator<UPointLightComponent> Itr; Itr; ++Itr)
+	{
+		// World Check
+		if (Itr->GetWorld() != gameWorld)
+			continue;
 
-	TArray<LabRoom*> allRooms;
-	AllocatedRoomSpace.GetKeys(allRooms);	
+		// We don't care about invisible lights
+		if ((!Itr->IsVisible()) || Itr->bHiddenInGame || Itr->GetOwner()->bHidden)
+			continue;
 
-	TArray<LabRoom*> toPool;
-	TArray<LabRoom*> toFix;
+		// Lights of parked objects are far from the laboratory
+		ABasicDeactivatableObject* owner = Cast<ABasicDeactivatableObject>(Itr->GetOwner());
+		if (owner && owner->IsParked())
+			continue;
 
-	for (LabRoom* room : allRooms)
+		lightStates.Add(*Itr, FLightStateStruct(Itr->GetComponentLocation(), Itr->GetForwardVector(), Itr->AttenuationRadius, Itr->Intensity));
+	}
+
+	// New, moved or changed lights
+	for (const TPair<const UPointLightComponent*, FLightStateStruct>& pair : lightStates)
 	{
-		// If we found a room that is not in the darkness, we add it for the fix and continue, same if character is in that room
-		if (PlayerRoom == room || ActualPlayerRoom == room || IsRoomIlluminated(room))
-			toFix.AddUnique(room);
-		else
+		const FLightStateStruct* last = LastLightStates.Find(pair.Key);
+		if (last && last->Equals(pair.Value))
+			continue;
+
+		MarkRoomsDirty(pair.Value.Location, pair.Value.Radius);
+		if (last)
+			MarkRoomsDirty(last->Location, last->Radius);
+	}
+	// Lights that were turned off or removed
+	for (const TPair<const UPointLightComponent*, FLightStateStruct>& pair : LastLightStates)
+	{
+		if (!lightStates.Contains(pair.Key))
+			MarkRoomsDirty(pair.Value.Location, pair.Value.Radius);
+	}
+	LastLightStates = MoveTemp(lightStates);
+
+	// Doors block light while closed
+	for (int i = MovingDoors.Num() - 1; i >= 0; --i)
+	{
+		ABasicDoor* door = MovingDoors[i];
+		if (!door || !door->IsMoving())
+			MovingDoors.RemoveAt(i);
+		if (!door)
+			continue;
+
+		for (const TPair<LabPassage*, TArray<TScriptInterface<IDeactivatable>>>& pair : SpawnedPassageObjects)
 		{
-			bool poolIt = true;
-			// We check if room has exit cause if it does, we only want to delete it when both this room and the room behind exit are going to be pooled 
-			for (LabPassage* passage : room->Passages)
-			{
-				// found exit
-				if (passage->bIsDoor && passage->Width == ExitDoorWidth)
-				{
-					LabRoom* otherRoom = passage->To == room ? passage->From : passage->To;
-					if (PlayerRoom == otherRoom || ActualPlayerRoom == otherRoom || IsRoomIlluminated(otherRoom))
-					{
-						poolIt = false;
-						break;
-					}
-				}
-			}
-			if (poolIt)
-				toPool.AddUnique(room);
-			else
-				toFix.AddUnique(room);
+			if (!pair.Value.ContainsByPredicate([door](const TScriptInterface<IDeactivatable>& object) { return object.GetObject() == door; }))
+				continue;
+
+			MarkRoomDirty(pair.Key->From);
+			MarkRoomDirty(pair.Key->To);
+			break;
 		}
 	}
-
-	for (int i = toPool.Num() - 1; i >= 0; --i)
-		PoolRoom(toPool[i]);
-	
-	// We want player's room to be fixed first so nothing interferes with it
-	FixRoom(PlayerRoom);
-	FixRoom(ActualPlayerRoom);
-	for (LabRoom* roomToFix : toFix)
-		FixRoom(roomToFix);
 }
 // Reshapes all darkness and also expands spawns and fills around player's room
 void AMainGameMode::CompleteReshapeAllDarknessAround()
@@ -900,66 +2520,155 @@ void AMainGameMode::CompleteReshapeAllDarknessAround()
 	if (!PlayerRoom)
 		return;
 
-	ReshapeAllDarkness();
-	ExpandInDepth(PlayerRoom, ExpandDepth);
-	SpawnFillInDepth(PlayerRoom, SpawnFillDepth);
+	// Expanding and spawning are also spread between frames
+	if (CVarReshapeTimeSlice.GetValueOnGameThread() > 0.f)
+	{
+		StartReshapeJob(CVarIncrementalReshape.GetValueOnGameThread() == 0, true);
+		return;
+	}
+
+	double startTime = FPlatformTime::Seconds();
+	ReshapeDarknessOnMap();
+	ExpandInDepth(PlayerRoom, CurrentExpandDepth);
+	SpawnFillInDepth(PlayerRoom, CurrentSpawnFillDepth);
+	RecordCost(ReshapeCostMs, startTime);
+	UpdateGovernor();
 }
 // Calls CompleteReshapeAllDarknessAround with specified probability
 void AMainGameMode::CompleteReshapeAllDarknessAroundOnTick()
 {
-	if (RandBool(ReshapeDarknessOnTickProbability))
+	if (RandBool(CurrentReshapeDarknessOnTickProbability))
 		CompleteReshapeAllDarknessAround();
 }
 
+// Adds cost of a call that started at startTime to the running average
+void AMainGameMode::RecordCost(float & averageMs, const double startTime)
+{
+	float costMs = (FPlatformTime::Seconds() - startTime) * 1000.0;
+	averageMs = averageMs > 0.f ? FMath::Lerp(averageMs, costMs, GovernorSmoothing) : costMs;
+}
+// Changes governor level if recent costs are too far from the target
+void AMainGameMode::UpdateGovernor()
+{
+	SET_FLOAT_STAT(STAT_GovernorEnterRoomMs, EnterRoomCostMs);
+	SET_FLOAT_STAT(STAT_GovernorReshapeMs, ReshapeCostMs);
+	CVarGovernorEnterRoomMs->Set(EnterRoomCostMs, ECVF_SetByCode);
+	CVarGovernorReshapeMs->Set(ReshapeCostMs, ECVF_SetByCode);
+
+	if (CVarGovernorEnable.GetValueOnGameThread() == 0)
+		return;
+
+	// We give new values some time to show their cost
+	float time = GetWorld()->GetTimeSeconds();
+	if (time - LastGovernorChangeTime < GovernorCooldown)
+		return;
+
+	float targetMs = CVarGovernorTargetMs.GetValueOnGameThread();
+	float costMs = FMath::Max(EnterRoomCostMs, ReshapeCostMs);
+	int level = GovernorLevel;
+	if (costMs > targetMs)
+		level = FMath::Min(level + 1, MaxGovernorLevel);
+	else if (costMs < targetMs * GovernorRaiseFraction)
+		level = FMath::Max(level - 1, MinGovernorLevel);
+
+	if (level == GovernorLevel)
+		return;
+
+	UE_LOG(LogDarkLab, Log, TEXT("Governor level %d -> %d, cost: %f ms, target: %f ms"), GovernorLevel, level, costMs, targetMs);
+	GovernorLevel = level;
+	LastGovernorChangeTime = time;
+	ApplyGovernorLevel();
+}
+// Sets generation depths and reshape frequency for current governor level
+void AMainGameMode::ApplyGovernorLevel()
+{
+	// Spawning can't go deeper than expanding, scalability limits are never exceeded
+	CurrentExpandDepth = FMath::Clamp(ExpandDepth - GovernorLevel, MinExpandDepth, ExpandDepth - MinGovernorLevel);
+	CurrentExpandDepth = FMath::Min(CurrentExpandDepth, LabScalability::GetMaxExpandDepth());
+	CurrentSpawnFillDepth = FMath::Clamp(SpawnFillDepth - GovernorLevel, MinSpawnFillDepth, CurrentExpandDepth - 1);
+	CurrentSpawnFillDepth = FMath::Clamp(CurrentSpawnFillDepth, 1, LabScalability::GetMaxSpawnFillDepth());
+	AppliedScalabilityVersion = LabScalability::GetSettingsVersion();
+	CurrentReshapeDarknessDepth = FMath::Clamp(ReshapeDarknessDepth - GovernorLevel, MinReshapeDarknessDepth, ReshapeDarknessDepth - MinGovernorLevel);
+	
+	// Reshaping happens less often on higher levels
+	float reshapeTick = ReshapeDarknessTick * (1.f + GovernorTickScalePerLevel * GovernorLevel);
+	float probabilityScale = 1.f - GovernorProbabilityScalePerLevel * GovernorLevel;
+	CurrentReshapeDarknessOnEnterProbability = FMath::Clamp(ReshapeDarknessOnEnterProbability * probabilityScale, 0.1f, 1.f);
+	CurrentReshapeDarknessOnTickProbability = FMath::Clamp(ReshapeDarknessOnTickProbability * probabilityScale, 0.1f, 1.f);
+
+	if (reshapeTick != CurrentReshapeDarknessTick)
+	{
+		CurrentReshapeDarknessTick = reshapeTick;
+		if (ReshapeTimerHandle.IsValid())
+			((AActor*)this)->GetWorldTimerManager().SetTimer(ReshapeTimerHandle, this, &AMainGameMode::CompleteReshapeAllDarknessAroundOnTick, CurrentReshapeDarknessTick, true, CurrentReshapeDarknessTick);
+	}
+
+	SET_DWORD_STAT(STAT_GovernorLevel, GovernorLevel);
+	SET_DWORD_STAT(STAT_GovernorExpandDepth, CurrentExpandDepth);
+	SET_DWORD_STAT(STAT_GovernorSpawnFillDepth, CurrentSpawnFillDepth);
+	SET_FLOAT_STAT(STAT_GovernorReshapeTick, CurrentReshapeDarknessTick);
+	CVarGovernorLevel->Set(GovernorLevel, ECVF_SetByCode);
+	CVarGovernorExpandDepth->Set(CurrentExpandDepth, ECVF_SetByCode);
+	CVarGovernorSpawnFillDepth->Set(CurrentSpawnFillDepth, ECVF_SetByCode);
+	CVarGovernorReshapeDepth->Set(CurrentReshapeDarknessDepth, ECVF_SetByCode);
+	CVarGovernorReshapeInterval->Set(CurrentReshapeDarknessTick, ECVF_SetByCode);
+}
+
 // Tries to find a poolable object
 UObject* AMainGameMode::TryGetPoolable(UClass* cl)
 {
 	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::TryGetPoolable"));
 
-	TArray<TScriptInterface<IDeactivatable>>& pool = GetCorrectPool(cl);
+	// The object is in use whether it's taken from the pool or spawned by the caller
+	FPoolStatsStruct& stats = PoolStats.FindOrAdd(cl);
+	++stats.Live;
+	stats.HighWater = FMath::Max(stats.HighWater, stats.Live);
 
+	// Every pool only has objects of one class, so any of them will do
+	TArray<TScriptInterface<IDeactivatable>>& pool = GetCorrectPool(cl);
 	if (pool.Num() == 0)
-		return nullptr;
-
-	int index = -1;
-	TScriptInterface<IDeactivatable> object;
-	if (pool != DefaultPool)
-		index = 0;
-	else
 	{
-		for (int i = 0; i < pool.Num(); ++i)
-		{
-			TScriptInterface<IDeactivatable> temp = pool[i];
-			if (temp->_getUObject()->GetClass() == cl)
-			{
-				index = i;
-				break;
-			}
-		}
-	}
-
-	if (index < 0)
+		++stats.Misses;
 		return nullptr;
+	}
+	++stats.Hits;
 
-	object = pool[index];
+	TScriptInterface<IDeactivatable> object = pool.Pop(false);
 	UObject* obj = object->_getUObject();
 	// object->Execute_SetActive(obj, true);
-	pool.RemoveAt(index);
 	return obj;
 }
 
+// Returns how floors and walls are spawned, their Spawn functions return nullptr if not as actors
+EGeometryModeEnum AMainGameMode::GetGeometryMode() const
+{
+	if (!Geometry || !Geometry->IsReady())
+		return EGeometryModeEnum::VE_Actors;
+	return (EGeometryModeEnum)FMath::Clamp(CVarGeometryMode.GetValueOnGameThread(), 0, (int32)EGeometryModeEnum::VE_Merged);
+}
+// Returns how pooled objects are deactivated
+EPoolingStrategyEnum AMainGameMode::GetPoolingStrategy() const
+{
+	int32 strategy = PoolingStrategyOverride >= 0 ? PoolingStrategyOverride : CVarPoolStrategy.GetValueOnGameThread();
+	return (EPoolingStrategyEnum)FMath::Clamp(strategy, 0, (int32)EPoolingStrategyEnum::VE_Park);
+}
 // Spawn specific objects
 ABasicFloor* AMainGameMode::SpawnBasicFloor(const int botLeftX, const int botLeftY, const int sizeX, const int sizeY, LabRoom* room)
 {
-	ABasicFloor* floor = Cast<ABasicFloor>(TryGetPoolable(BasicFloorBP));
-	if (!floor)
+	// Floors can be parts of bigger geometry
+	if (GetGeometryMode() != EGeometryModeEnum::VE_Actors)
 	{
-		floor = GetWorld()->SpawnActor<ABasicFloor>(BasicFloorBP);
-		floor->Execute_SetActive(floor, false);
+		Geometry->AddFloor(room, botLeftX, botLeftY, sizeX, sizeY, GetGeometryMode());
+		return nullptr;
 	}
 
-	PlaceObject(floor, botLeftX, botLeftY, sizeX, sizeY);
-	floor->Execute_SetActive(floor, true);
+	ABasicFloor* floor = Cast<ABasicFloor>(TryGetPoolable(BasicFloorBP));
+	// New objects are spawned where they belong, pooled ones are moved there
+	if (floor)
+		PlaceObject(floor, botLeftX, botLeftY, sizeX, sizeY);
+	else
+		floor = Cast<ABasicFloor>(SpawnPlaced(BasicFloorBP, FIntVector(botLeftX, botLeftY, 0), EDirectionEnum::VE_Up, FIntVector(sizeX, sizeY, 0)));
+	LabNativeEvents::SetActive(floor, true);
 
 	if (room && SpawnedRoomObjects.Contains(room))
 		SpawnedRoomObjects[room].Add(floor);
@@ -970,6 +2679,12 @@ ABasicFloor* AMainGameMode::SpawnBasicFloor(const int botLeftX, const int botLef
 }
 ABasicFloor* AMainGameMode::SpawnBasicFloor(const int botLeftX, const int botLeftY, const int sizeX, const int sizeY, LabPassage* passage)
 {
+	if (GetGeometryMode() != EGeometryModeEnum::VE_Actors)
+	{
+		Geometry->AddFloor(passage, botLeftX, botLeftY, sizeX, sizeY, GetGeometryMode());
+		return nullptr;
+	}
+
 	ABasicFloor* floor = SpawnBasicFloor(botLeftX, botLeftY, sizeX, sizeY);
 	if (passage && SpawnedPassageObjects.Contains(passage))
 		SpawnedPassageObjects[passage].Add(floor);
@@ -978,15 +2693,19 @@ ABasicFloor* AMainGameMode::SpawnBasicFloor(const int botLeftX, const int botLef
 }
 ABasicWall* AMainGameMode::SpawnBasicWall(const int botLeftX, const int botLeftY, const int sizeX, const int sizeY, LabRoom* room)
 {
-	ABasicWall* wall = Cast<ABasicWall>(TryGetPoolable(BasicWallBP));
-	if (!wall)
+	// Walls can be parts of bigger geometry
+	if (GetGeometryMode() != EGeometryModeEnum::VE_Actors)
 	{
-		wall = GetWorld()->SpawnActor<ABasicWall>(BasicWallBP);
-		wall->Execute_SetActive(wall, false);
+		Geometry->AddWall(room, botLeftX, botLeftY, sizeX, sizeY, GetGeometryMode());
+		return nullptr;
 	}
 
-	PlaceObject(wall, botLeftX, botLeftY, sizeX, sizeY);
-	wall->Execute_SetActive(wall, true);
+	ABasicWall* wall = Cast<ABasicWall>(TryGetPoolable(BasicWallBP));
+	if (wall)
+		PlaceObject(wall, botLeftX, botLeftY, sizeX, sizeY);
+	else
+		wall = Cast<ABasicWall>(SpawnPlaced(BasicWallBP, FIntVector(botLeftX, botLeftY, 0), EDirectionEnum::VE_Up, FIntVector(sizeX, sizeY, 0)));
+	LabNativeEvents::SetActive(wall, true);
 
 	if (room && SpawnedRoomObjects.Contains(room))
 		SpawnedRoomObjects[room].Add(wall);
@@ -998,16 +2717,14 @@ ABasicWall* AMainGameMode::SpawnBasicWall(const int botLeftX, const int botLeftY
 ABasicDoor * AMainGameMode::SpawnBasicDoor(const int botLeftX, const int botLeftY, const EDirectionEnum direction, const FLinearColor color, const int width, LabPassage* passage)
 {
 	ABasicDoor* door = Cast<ABasicDoor>(TryGetPoolable(BasicDoorBP));
-	if (!door)
-	{
-		door = GetWorld()->SpawnActor<ABasicDoor>(BasicDoorBP);
-		door->Execute_SetActive(door, false);
-	}
+	if (door)
+		PlaceObject(door, botLeftX, botLeftY, direction, width);
+	else
+		door = Cast<ABasicDoor>(SpawnPlaced(BasicDoorBP, FIntVector(botLeftX, botLeftY, 0), direction, FIntVector(width, 1, 0)));
 
 	door->ResetDoor(width == ExitDoorWidth); // Clothes the door if it was open
 	door->DoorColor = color; // Sets door's color
-	PlaceObject(door, botLeftX, botLeftY, direction, width);
-	door->Execute_SetActive(door, true);
+	LabNativeEvents::SetActive(door, true);
 
 	if (passage && SpawnedPassageObjects.Contains(passage))
 		SpawnedPassageObjects[passage].Add(door);
@@ -1019,16 +2736,14 @@ ABasicDoor * AMainGameMode::SpawnBasicDoor(const int botLeftX, const int botLeft
 AWallLamp * AMainGameMode::SpawnWallLamp(const int botLeftX, const int botLeftY, const EDirectionEnum direction, const FLinearColor color, const int width, LabRoom* room)
 {
 	AWallLamp* lamp = Cast<AWallLamp>(TryGetPoolable(WallLampBP));
-	if (!lamp)
-	{
-		lamp = GetWorld()->SpawnActor<AWallLamp>(WallLampBP);
-		lamp->Execute_SetActive(lamp, false);
-	}
+	if (lamp)
+		PlaceObject(lamp, botLeftX, botLeftY, direction, width);
+	else
+		lamp = Cast<AWallLamp>(SpawnPlaced(WallLampBP, FIntVector(botLeftX, botLeftY, 0), direction, FIntVector(width, 1, 0)));
 
 	lamp->Reset(); // Disables light if it was on
 	lamp->SetColor(color); // Sets correct color
-	PlaceObject(lamp, botLeftX, botLeftY, direction, width);
-	lamp->Execute_SetActive(lamp, true);
+	LabNativeEvents::SetActive(lamp, true);
 
 	if (room)
 	{
@@ -1045,15 +2760,13 @@ AWallLamp * AMainGameMode::SpawnWallLamp(const int botLeftX, const int botLeftY,
 AFlashlight* AMainGameMode::SpawnFlashlight(const int botLeftX, const int botLeftY, const EDirectionEnum direction, LabRoom* room)
 {
 	AFlashlight* flashlight = Cast<AFlashlight>((TryGetPoolable(FlashlightBP)));
-	if (!flashlight)
-	{
-		flashlight = GetWorld()->SpawnActor<AFlashlight>(FlashlightBP);
-		flashlight->Execute_SetActive(flashlight, false);
-	}
+	if (flashlight)
+		PlaceObject(flashlight, botLeftX, botLeftY, direction);
+	else
+		flashlight = Cast<AFlashlight>(SpawnPlaced(FlashlightBP, FIntVector(botLeftX, botLeftY, 0), direction));
 
 	flashlight->Reset(); // Disables light if it was on
-	PlaceObject(flashlight, botLeftX, botLeftY, direction);
-	flashlight->Execute_SetActive(flashlight, true);
+	LabNativeEvents::SetActive(flashlight, true);
 
 	if (room)
 	{
@@ -1073,12 +2786,12 @@ ALighter * AMainGameMode::SpawnLighter(const int botLeftX, const int botLeftY, c
 	//if (!lighter)
 	//{
 	ALighter* lighter = GetWorld()->SpawnActor<ALighter>(LighterBP);
-	lighter->Execute_SetActive(lighter, false);
+	LabNativeEvents::SetActive(lighter, false);
 	//}
 
 	lighter->Reset(); // Disables light if it was on
 	PlaceObject(lighter, botLeftX, botLeftY, direction);
-	lighter->Execute_SetActive(lighter, true);
+	LabNativeEvents::SetActive(lighter, true);
 
 	if (room)
 	{
@@ -1095,15 +2808,13 @@ ALighter * AMainGameMode::SpawnLighter(const int botLeftX, const int botLeftY, c
 ADoorcard* AMainGameMode::SpawnDoorcard(const int botLeftX, const int botLeftY, const EDirectionEnum direction, const FLinearColor color, LabRoom* room)
 {
 	ADoorcard* doorcard = Cast<ADoorcard>((TryGetPoolable(DoorcardBP)));
-	if (!doorcard)
-	{
-		doorcard = GetWorld()->SpawnActor<ADoorcard>(DoorcardBP);
-		doorcard->Execute_SetActive(doorcard, false);
-	}
+	if (doorcard)
+		PlaceObject(doorcard, botLeftX, botLeftY, direction);
+	else
+		doorcard = Cast<ADoorcard>(SpawnPlaced(DoorcardBP, FIntVector(botLeftX, botLeftY, 0), direction));
 
 	doorcard->SetColor(color); // Sets correct color
-	PlaceObject(doorcard, botLeftX, botLeftY, direction);
-	doorcard->Execute_SetActive(doorcard, true);
+	LabNativeEvents::SetActive(doorcard, true);
 
 	if (room)
 	{
@@ -1120,15 +2831,13 @@ ADoorcard* AMainGameMode::SpawnDoorcard(const int botLeftX, const int botLeftY,
 AExitVolume * AMainGameMode::SpawnExitVolume(const int botLeftX, const int botLeftY, const EDirectionEnum direction, LabRoom * room)
 {
 	AExitVolume* exit = Cast<AExitVolume>(TryGetPoolable(ExitVolumeBP));
-	if (!exit)
-	{
-		exit = GetWorld()->SpawnActor<AExitVolume>(ExitVolumeBP);
-		exit->Execute_SetActive(exit, false);
-	}
+	if (exit)
+		PlaceObject(exit, botLeftX, botLeftY, direction, ExitDoorWidth);
+	else
+		exit = Cast<AExitVolume>(SpawnPlaced(ExitVolumeBP, FIntVector(botLeftX, botLeftY, 0), direction, FIntVector(ExitDoorWidth, 1, 0)));
 
 	exit->Reset(); // Disables light if it was on
-	PlaceObject(exit, botLeftX, botLeftY, direction, ExitDoorWidth);
-	exit->Execute_SetActive(exit, true);
+	LabNativeEvents::SetActive(exit, true);
 
 	if (room && SpawnedRoomObjects.Contains(room))
 		SpawnedRoomObjects[room].Add(exit);
@@ -1150,6 +2859,9 @@ void AMainGameMode::SpawnRoom(LabRoom * room)
 	if (SpawnedRoomObjects.Contains(room))
 		return;
 
+	// New walls block light
+	MarkRoomDirty(room, true);
+
 	/*if (!PlayerRoom || room == PlayerRoom)
 	{
 		UE_LOG(LogTemp, Warning, TEXT("%s"), (!room->Passages[0]->bIsDoor ? TEXT("YES") : TEXT("NO")));
@@ -1255,6 +2967,14 @@ void AMainGameMode::SpawnRoom(LabRoom * room)
 		SpawnBasicWall(room->BotLeftX + bottomWallPositions[i], room->BotLeftY, wallLength, 1, room);
 	}
 
+	// The character can walk into rooms next to it before a worker builds them, so their geometry is built and cooked right away
+	if (GetGeometryMode() == EGeometryModeEnum::VE_Merged && IsNextToPlayer(room))
+	{
+		Geometry->BuildMergedNow(room);
+		for (LabPassage* passage : room->Passages)
+			Geometry->BuildMergedNow(passage);
+	}
+
 	// UE_LOG(LogTemp, Warning, TEXT("Spawned a room"));
 }
 void AMainGameMode::SpawnPassage(LabPassage* passage, LabRoom* room)
@@ -1270,6 +2990,10 @@ void AMainGameMode::SpawnPassage(LabPassage* passage, LabRoom* room)
 
 	SpawnedPassageObjects.Add(passage);
 
+	// Merged passage floors are drawn with the room that spawned them
+	if (room && GetGeometryMode() == EGeometryModeEnum::VE_Merged)
+		Geometry->SetMergedHost(passage, room);
+
 	// Spawns floor under the passage
 	if (passage->GridDirection == EDirectionEnum::VE_Up || passage->GridDirection == EDirectionEnum::VE_Down)
 		SpawnBasicFloor(passage->BotLeftX, passage->BotLeftY, passage->Width, 1, passage);
@@ -1284,6 +3008,19 @@ void AMainGameMode::SpawnPassage(LabPassage* passage, LabRoom* room)
 
 	// UE_LOG(LogTemp, Warning, TEXT("> Spawned a passage"));
 }
+// Returns true if the room is the player's room or one passage away from it
+bool AMainGameMode::IsNextToPlayer(LabRoom * room) const
+{
+	if (!room || !PlayerRoom)
+		return false;
+	if (room == PlayerRoom)
+		return true;
+
+	for (LabPassage* passage : PlayerRoom->Passages)
+		if (RoomGraph.GetOtherRoom(passage, PlayerRoom) == room)
+			return true;
+	return false;
+}
 // Despawns room so it can be respawned later
 void AMainGameMode::DespawnRoom(LabRoom * room)
 {
@@ -1292,9 +3029,24 @@ void AMainGameMode::DespawnRoom(LabRoom * room)
 	if (!room)
 		return;
 
+	// Walls are gone so light can reach further
+	if (SpawnedRoomObjects.Contains(room))
+		MarkRoomDirty(room, true);
+
 	if (SpawnedRoomObjects.Contains(room))
 	{
 		PoolObjects(SpawnedRoomObjects[room]);
+		if (Geometry)
+		{
+			// Passages that stay are merged into the other room's mesh
+			for (LabPassage* passage : room->Passages)
+			{
+				LabRoom* otherRoom = passage ? RoomGraph.GetOtherRoom(passage, room) : nullptr;
+				if (otherRoom && SpawnedRoomObjects.Contains(otherRoom) && SpawnedPassageObjects.Contains(passage) && GetGeometryMode() == EGeometryModeEnum::VE_Merged)
+					Geometry->SetMergedHost(passage, otherRoom);
+			}
+			Geometry->RemoveAll(room);
+		}
 		for (LabPassage* passage : room->Passages)
 		{
 			if (!passage)
@@ -1317,10 +3069,16 @@ void AMainGameMode::DespawnRoom(LabRoom * room)
 		}
 	}
 	SpawnedRoomObjects.Remove(room);
+	DequeueRoomSpawn(room);
+	RoomsAwaitingContents.Remove(room);
+	PlannedRooms.Remove(room);
+	LampsOnAfterContents.Remove(room);
 	AllocatedRoomSpace[room].Empty();
 	ExpandedRooms.Remove(room);
 	VisitedRooms.Remove(room); // ?
-	RoomsWithLampsOn.Remove(room);
+	if (RoomsWithLampsOn.Remove(room) > 0)
+		UpdateLampShadows();
+	RoomGraph.SetRoomLit(room, false);
 	AllocateRoom(room);
 }
 
@@ -1664,6 +3422,8 @@ LabRoom* AMainGameMode::CreateRoom(const int botLeftX, const int botLeftY, const
 	LabRoom* room = new LabRoom(botLeftX, botLeftY, sizeX, sizeY);
 	AllocateRoom(room);
 	AllocatedRoomSpace.Add(room);
+	RoomGraph.AddRoom(room);
+	MarkRoomDirty(room);
 
 	return room;
 }
@@ -2142,6 +3902,7 @@ TArray<LabRoom*> AMainGameMode::ExpandRoom(LabRoom * room, int desiredNumOfPassa
 		return newRooms;
 
 	ExpandedRooms.AddUnique(room);
+	MarkRoomDirty(room, true);
 
 	// Room shouldn't be inner side of the exit
 	for (LabPassage* interPas : room->Passages)
@@ -2178,6 +3939,10 @@ TArray<LabRoom*> AMainGameMode::ExpandRoom(LabRoom * room, int desiredNumOfPassa
 		LabPassage* passage = CreateAndAddRandomPassage(room, minRoomSpace, possibleRoomConnection);
 		if (passage)
 		{
+			// Both rooms of the new passage, a room created for it below is new to the graph anyway
+			RoomGraph.MarkPassagesChanged(room);
+			RoomGraph.MarkPassagesChanged(possibleRoomConnection);
+
 			// TODO it shouldn't be like this
 			// For start room
 			if (desiredNumOfPassagesOverride >= MinRoomNumOfPassages && !SpawnedPassageObjects.Contains(passage))
@@ -2279,6 +4044,7 @@ void AMainGameMode::FixRoom(LabRoom * room, int depth)
 					{
 						// We add passage to the room
 						newRoom->AddPassage(passage);
+						RoomGraph.MarkPassagesChanged(room);
 						continue;
 					}
 					// else delete
@@ -2293,6 +4059,8 @@ void AMainGameMode::FixRoom(LabRoom * room, int depth)
 					{
 						// At this point other room should be considered good
 						intersected->AddPassage(passage);
+						RoomGraph.MarkPassagesChanged(room);
+						RoomGraph.MarkPassagesChanged(intersected);
 						continue;
 					}					
 					else if (canNotDelete)
@@ -2356,7 +4124,10 @@ void AMainGameMode::FixRoom(LabRoom * room, int depth)
 							// We create new room from min space
 							LabRoom* newRoom = CreateRandomRoom(minRoomSpace, true, !passage->To ? passage->GridDirection : GetReverseDirection(passage->GridDirection));
 							if (newRoom)
+							{
 								newRoom->AddPassage(passage);
+								RoomGraph.MarkPassagesChanged(room);
+							}
 							for (LabRoom* roomToFix : toFix)
 								FixRoom(roomToFix, depth + 1);
 							if (newRoom)
@@ -2384,6 +4155,8 @@ void AMainGameMode::FixRoom(LabRoom * room, int depth)
 
 						// At this point other room should be considered good
 						intersected->AddPassage(passage);
+						RoomGraph.MarkPassagesChanged(room);
+						RoomGraph.MarkPassagesChanged(intersected);
 						continue;
 					}
 					// TODO add same as in intersection above?
@@ -2398,12 +4171,14 @@ void AMainGameMode::FixRoom(LabRoom * room, int depth)
 		// TODO check if at least one connection exists
 
 		room->Passages.RemoveAt(i);
+		MarkRoomDirty(room);
 		// We pool and delete passage and spawn a wall instead
 		if (SpawnedRoomObjects.Contains(room))
 		{
 			PoolPassage(passage);
 			SpawnBasicWall(passage->BotLeftX, passage->BotLeftY, passage->GridDirection == EDirectionEnum::VE_Up || passage->GridDirection == EDirectionEnum::VE_Down ? passage->Width : 1, passage->GridDirection == EDirectionEnum::VE_Up || passage->GridDirection == EDirectionEnum::VE_Down ? 1 : passage->Width, room);
 		}
+		RoomGraph.RemovePassage(passage);
 		delete passage;
 	}
 }
@@ -2457,15 +4232,29 @@ bool AMainGameMode::CreateRandomInsideSpaceOfWidthNearWall(LabRoom * room, int&
 	return canBeTaken || RoomSpaceIsFree(room, xOffset, yOffset, direction, width);
 }
 
-// Fills room with random objects, spawns and returns them
+// Decides which objects the room will have and allocates space for them without spawning anything
 // Should always be called on a room that is already spawned
-TArray<AActor*> AMainGameMode::FillRoom(LabRoom* room, int minNumOfLampsOverride)
+void AMainGameMode::PlanRoomContents(LabRoom * room, int minNumOfLampsOverride)
 {
-	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::FillRoom"));
+	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::PlanRoomContents"));
 
-	TArray<AActor*> spawnedActors;
+	if (!room)
+		return;
+
+	// Room is planned only once until it's despawned
+	if (PlannedRooms.Contains(room))
+		return;
+	PlannedRooms.Add(room);
 
-	bool isExitRoom = room && room->Passages.Num() == 1 && room->Passages[0]->bIsDoor && room->Passages[0]->Width == ExitDoorWidth;
+	// Rooms spawned again get the same objects
+	TPair<FIntPoint, FIntPoint> key = GetRoomPlanKey(room);
+	TArray<FRoomContentStruct>* existing = RoomContentPlans.Find(key);
+	if (existing && AllocatePlannedContents(room, *existing))
+		return;
+
+	TArray<FRoomContentStruct>& planned = RoomContentPlans.Add(key);
+
+	bool isExitRoom = IsExitRoom(room);
 
 	if (!isExitRoom)
 	{
@@ -2492,12 +4281,13 @@ TArray<AActor*> AMainGameMode::FillRoom(LabRoom* room, int minNumOfLampsOverride
 
 		// The number of lamps we want to have in the room
 		int desiredNumOfLamps = FMath::RandRange(MinRoomNumOfLamps, 1 + MaxRoomNumOfLampsPerHundredArea * room->SizeX * room->SizeY / 100);
+		int numOfLamps = 0;
 
 		// Maximum number of tries
 		int maxTries = MaxRoomLampCreationTriesPerDesired * desiredNumOfLamps;
 
 		// Creates new lamps in the room
-		for (int i = 0; spawnedActors.Num() < MinRoomNumOfLamps || (i < maxTries && spawnedActors.Num() < desiredNumOfLamps) || spawnedActors.Num() < minNumOfLampsOverride; ++i)
+		for (int i = 0; numOfLamps < MinRoomNumOfLamps || (i < maxTries && numOfLamps < desiredNumOfLamps) || numOfLamps < minNumOfLampsOverride; ++i)
 		{
 			int xOff;
 			int yOff;
@@ -2508,11 +4298,12 @@ TArray<AActor*> AMainGameMode::FillRoom(LabRoom* room, int minNumOfLampsOverride
 				if (!colorIsDetermined)
 				{
 					color = RandColor();
-					while (color == FLinearColor::Black && spawnedActors.Num() < minNumOfLampsOverride)
+					while (color == FLinearColor::Black && numOfLamps < minNumOfLampsOverride)
 						color = RandColor();
 				}
-				AWallLamp* lamp = SpawnWallLamp(room->BotLeftX + xOff, room->BotLeftY + yOff, direction, color, width, room);
-				spawnedActors.Add(lamp);
+				planned.Add(FRoomContentStruct(ERoomContentEnum::VE_Lamp, room->BotLeftX + xOff, room->BotLeftY + yOff, direction, color, width));
+				AllocateRoomSpace(room, room->BotLeftX + xOff, room->BotLeftY + yOff, direction, width, false);
+				++numOfLamps;
 			}
 		}
 
@@ -2534,45 +4325,154 @@ TArray<AActor*> AMainGameMode::FillRoom(LabRoom* room, int minNumOfLampsOverride
 						color = RandColor();
 				}
 				EDirectionEnum direction = RandDirection();
-				ADoorcard* doorcard = SpawnDoorcard(room->BotLeftX + xOff, room->BotLeftY + yOff, direction, color, room);
-				spawnedActors.Add(doorcard);
+				planned.Add(FRoomContentStruct(ERoomContentEnum::VE_Doorcard, room->BotLeftX + xOff, room->BotLeftY + yOff, direction, color));
+				AllocateRoomSpace(room, room->BotLeftX + xOff, room->BotLeftY + yOff, 1, 1, false);
+				break; // We only spawn once
+			}
+		}
+
+		// Creates a flashlight
+		bool shouldSpawnFlashlight = RandBool(SpawnFlashlightProbability);
+		for (int i = 0; shouldSpawnFlashlight && i < MaxGenericSpawnTries; ++i)
+		{
+			int xOff;
+			int yOff;
+			if (CreateRandomInsideSpaceOfSize(room, xOff, yOff, 1, 1, false))
+			{
+				EDirectionEnum direction = RandDirection();
+				planned.Add(FRoomContentStruct(ERoomContentEnum::VE_Flashlight, room->BotLeftX + xOff, room->BotLeftY + yOff, direction));
+				AllocateRoomSpace(room, room->BotLeftX + xOff, room->BotLeftY + yOff, 1, 1, false);
 				break; // We only spawn once
 			}
 		}
+	}
+	else
+	{
+		LabPassage* passage = room->Passages[0];
+		int x = passage->BotLeftX;
+		int y = passage->BotLeftY;
+		if (passage->GridDirection == EDirectionEnum::VE_Right)
+			x++;
+		else if (passage->GridDirection == EDirectionEnum::VE_Left)
+			x--;
+		else if (passage->GridDirection == EDirectionEnum::VE_Up)
+			y++;
+		else if (passage->GridDirection == EDirectionEnum::VE_Down)
+			y--;
+		planned.Add(FRoomContentStruct(ERoomContentEnum::VE_ExitVolume, x, y, GetReverseDirection(passage->GridDirection)));
+	}
+}
+// Allocates space for objects planned when the room was spawned before, drops the ones new passages took the space of
+// Returns false if the plan doesn't fit the room anymore
+bool AMainGameMode::AllocatePlannedContents(LabRoom * room, TArray<FRoomContentStruct>& planned)
+{
+	// Exit volume stands in the only passage
+	bool hasExitVolume = planned.ContainsByPredicate([](const FRoomContentStruct& content) { return content.Type == ERoomContentEnum::VE_ExitVolume; });
+	if (hasExitVolume != IsExitRoom(room))
+		return false;
+
+	for (int i = 0; i < planned.Num(); ++i)
+	{
+		FRoomContentStruct& content = planned[i];
+		int xOff = content.BotLeftX - room->BotLeftX;
+		int yOff = content.BotLeftY - room->BotLeftY;
+		switch (content.Type)
+		{
+		case ERoomContentEnum::VE_Lamp:
+			if (!RoomSpaceIsFree(room, xOff, yOff, content.Direction, content.Width))
+			{
+				planned.RemoveAt(i--);
+				continue;
+			}
+			AllocateRoomSpace(room, content.BotLeftX, content.BotLeftY, content.Direction, content.Width, false);
+			break;
+		case ERoomContentEnum::VE_Flashlight:
+			if (!RoomSpaceIsFree(room, xOff, yOff, 1, 1))
+			{
+				planned.RemoveAt(i--);
+				continue;
+			}
+			AllocateRoomSpace(room, content.BotLeftX, content.BotLeftY, 1, 1, false);
+			break;
+		case ERoomContentEnum::VE_Doorcard:
+			// Doorcards could always take space that is already taken
+			AllocateRoomSpace(room, content.BotLeftX, content.BotLeftY, 1, 1, false);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return true;
+}
+// Returns the key of the room's plan
+TPair<FIntPoint, FIntPoint> AMainGameMode::GetRoomPlanKey(LabRoom * room)
+{
+	return TPair<FIntPoint, FIntPoint>(FIntPoint(room->BotLeftX, room->BotLeftY), FIntPoint(room->SizeX, room->SizeY));
+}
+// Returns true if the room only leads to the exit
+bool AMainGameMode::IsExitRoom(LabRoom * room) const
+{
+	return room->Passages.Num() == 1 && room->Passages[0]->bIsDoor && room->Passages[0]->Width == ExitDoorWidth;
+}
+// Spawns objects planned for the room and returns them
+TArray<AActor*> AMainGameMode::SpawnRoomContents(LabRoom * room)
+{
+	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::SpawnRoomContents"));
+
+	TArray<AActor*> spawnedActors;
+
+	TArray<FRoomContentStruct>* planned = room ? RoomContentPlans.Find(GetRoomPlanKey(room)) : nullptr;
+	if (!planned || !PlannedRooms.Contains(room) || !SpawnedRoomObjects.Contains(room))
+		return spawnedActors;
 
-		// Creates a flashlight
-		bool shouldSpawnFlashlight = RandBool(SpawnFlashlightProbability);
-		for (int i = 0; shouldSpawnFlashlight && i < MaxGenericSpawnTries; ++i)
+	// Space is already allocated during planning so we don't send the room to spawn functions
+	for (const FRoomContentStruct& content : *planned)
+	{
+		AActor* actor = nullptr;
+		switch (content.Type)
 		{
-			int xOff;
-			int yOff;
-			if (CreateRandomInsideSpaceOfSize(room, xOff, yOff, 1, 1, false))
-			{
-				EDirectionEnum direction = RandDirection();
-				AFlashlight* flashlight = SpawnFlashlight(room->BotLeftX + xOff, room->BotLeftY + yOff, direction, room);
-				spawnedActors.Add(flashlight);
-				break; // We only spawn once
-			}
+		case ERoomContentEnum::VE_Lamp:
+			actor = SpawnWallLamp(content.BotLeftX, content.BotLeftY, content.Direction, content.Color, content.Width);
+			break;
+		case ERoomContentEnum::VE_Doorcard:
+			actor = SpawnDoorcard(content.BotLeftX, content.BotLeftY, content.Direction, content.Color);
+			break;
+		case ERoomContentEnum::VE_Flashlight:
+			actor = SpawnFlashlight(content.BotLeftX, content.BotLeftY, content.Direction);
+			break;
+		case ERoomContentEnum::VE_ExitVolume:
+			// Exit volume is never returned
+			SpawnExitVolume(content.BotLeftX, content.BotLeftY, content.Direction, room);
+			break;
 		}
-	}
-	else
-	{
-		LabPassage* passage = room->Passages[0];
-		int x = passage->BotLeftX;
-		int y = passage->BotLeftY;
-		if (passage->GridDirection == EDirectionEnum::VE_Right)
-			x++;
-		else if (passage->GridDirection == EDirectionEnum::VE_Left)
-			x--;
-		else if (passage->GridDirection == EDirectionEnum::VE_Up)
-			y++;
-		else if (passage->GridDirection == EDirectionEnum::VE_Down)
-			y--;
-		AExitVolume* exitVolume = SpawnExitVolume(x, y, GetReverseDirection(passage->GridDirection), room);
+
+		if (!actor)
+			continue;
+
+		SpawnedRoomObjects[room].Add(actor);
+		spawnedActors.Add(actor);
 	}
 
+	// The plan is kept for when the room is spawned again
+	PlannedRooms.Remove(room);
+
+	// Lamps were meant to be turned on before they were there
+	if (LampsOnAfterContents.Remove(room) > 0)
+		ActivateRoomLamps(room);
+
 	return spawnedActors;
 }
+// Fills room with random objects, spawns and returns them
+// Should always be called on a room that is already spawned
+TArray<AActor*> AMainGameMode::FillRoom(LabRoom* room, int minNumOfLampsOverride)
+{
+	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::FillRoom"));
+
+	PlanRoomContents(room, minNumOfLampsOverride);
+	RoomsAwaitingContents.Remove(room);
+	return SpawnRoomContents(room);
+}
 
 // Activates all lamps in a single room
 void AMainGameMode::ActivateRoomLamps(LabRoom * room, bool forceAll)
@@ -2585,6 +4485,14 @@ void AMainGameMode::ActivateRoomLamps(LabRoom * room, bool forceAll)
 	if (!SpawnedRoomObjects.Contains(room))
 		return;
 
+	// Lamps are not spawned yet, they are turned on when they are, or not if this is called again before that
+	if (PlannedRooms.Contains(room))
+	{
+		if (LampsOnAfterContents.Remove(room) == 0)
+			LampsOnAfterContents.Add(room);
+		return;
+	}
+
 	// Turn on
 	if (!RoomsWithLampsOn.Contains(room))
 	{
@@ -2595,10 +4503,14 @@ void AMainGameMode::ActivateRoomLamps(LabRoom * room, bool forceAll)
 			if (!lamp)
 				continue;
 			atLeastOneLamp = true;
-			lamp->Execute_ActivateIndirectly(lamp);
+			LabNativeEvents::ActivateIndirectly(lamp);
 		}
-		if(atLeastOneLamp)
+		if (atLeastOneLamp)
+		{
 			RoomsWithLampsOn.Add(room);
+			RoomGraph.SetRoomLit(room, true);
+			UpdateLampShadows();
+		}
 	}
 	// Turn off
 	else
@@ -2614,13 +4526,13 @@ void AMainGameMode::ActivateRoomLamps(LabRoom * room, bool forceAll)
 			if (turnOffAll)
 			{
 				if (lamp->IsOn())
-					lamp->Execute_ActivateIndirectly(lamp);
+					LabNativeEvents::ActivateIndirectly(lamp);
 			}
 			else if (!turnedOffOne)
 			{
 				if (lamp->IsOn())
 				{
-					lamp->Execute_ActivateIndirectly(lamp);
+					LabNativeEvents::ActivateIndirectly(lamp);
 					turnedOffOne = true;
 				}
 			}
@@ -2634,8 +4546,34 @@ void AMainGameMode::ActivateRoomLamps(LabRoom * room, bool forceAll)
 			}
 		}
 		if (turnOffAll || !atLeastOneLampLeft)
+		{
 			RoomsWithLampsOn.Remove(room);
+			RoomGraph.SetRoomLit(room, false);
+			UpdateLampShadows();
+		}
+	}
+}
+// Lets only lamps of the most recently lit rooms cast shadows, the rest stay on without them
+// The light budget turns the shadows on and off, this only tells it which lamps are denied them
+void AMainGameMode::UpdateLampShadows()
+{
+	int maxRooms = LabScalability::GetMaxRoomsWithShadowedLamps();
+	TSet<UPointLightComponent*> denied;
+	for (int i = 0; maxRooms > 0 && i < RoomsWithLampsOn.Num() - maxRooms; ++i)
+	{
+		LabRoom* room = RoomsWithLampsOn[i];
+		if (!SpawnedRoomObjects.Contains(room))
+			continue;
+
+		for (TScriptInterface<IDeactivatable> obj : SpawnedRoomObjects[room])
+		{
+			AWallLamp* lamp = Cast<AWallLamp>(obj->_getUObject());
+			UPointLightComponent* light = lamp ? lamp->FindComponentByClass<UPointLightComponent>() : nullptr;
+			if (light)
+				denied.Add(light);
+		}
 	}
+	LightBudget.SetShadowsDenied(denied);
 }
 
 // Returns true if unexpanded rooms are reachable from here
@@ -2767,18 +4705,26 @@ void AMainGameMode::ExpandInDepth(LabRoom * start, int depth)
 }
 // Spawns and fills room if it's not spawned yet
 // Repeats with all adjasent rooms recursively
-void AMainGameMode::SpawnFillInDepth(LabRoom * start, int depth, LabPassage* fromPassage, FVector initialPasLoc)
+// Rooms close to the start are spawned right away, the rest are sent to the spawn queue
+void AMainGameMode::SpawnFillInDepth(LabRoom * start, int depth, LabPassage* fromPassage, FVector initialPasLoc, int distance)
 {
 	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::SpawnFillInDepth1"));
 
 	if (!start)
 		return;
 
-	// If not spawned
-	if (!SpawnedRoomObjects.Contains(start))
+	// Adjacent rooms are always complete, others wait for their turn
+	// Contents of farther rooms are only spawned if the character can see into them
+	if (distance <= 1)
+		SpawnFillRoom(start);
+	else if (!SpawnedRoomObjects.Contains(start) || RoomsAwaitingContents.Contains(start))
 	{
-		SpawnRoom(start);
-		FillRoom(start);
+		ACharacter* character = MainPlayerController ? MainPlayerController->GetCharacter() : nullptr;
+		bool visible = character && fromPassage && CanSee(character, GetPassageLocation(fromPassage) + FVector(0, 0, 30));
+		if (!SpawnedRoomObjects.Contains(start))
+			EnqueueRoomSpawn(start, false, visible, distance);
+		else if (visible)
+			EnqueueRoomSpawn(start, true, visible, distance);
 	}
 
 	if (depth <= 1)
@@ -2790,14 +4736,15 @@ void AMainGameMode::SpawnFillInDepth(LabRoom * start, int depth, LabPassage* fro
 			continue;
 
 		// location of the floor
-		FVector pasLoc = Cast<AActor>(SpawnedPassageObjects[passage][0]->_getUObject())->GetActorLocation() + FVector(0, 0, 30);
+		// We don't take it from the spawned floor since the room might still be in the queue
+		FVector pasLoc = GetPassageLocation(passage) + FVector(0, 0, 30);
 
 		if (CanSee(initialPasLoc, pasLoc))
 		{
 			if (passage->From != start)
-				SpawnFillInDepth(passage->From, depth - 1, passage, initialPasLoc);
+				SpawnFillInDepth(passage->From, depth - 1, passage, initialPasLoc, distance + 1);
 			if (passage->To != start)
-				SpawnFillInDepth(passage->To, depth - 1, passage, initialPasLoc);
+				SpawnFillInDepth(passage->To, depth - 1, passage, initialPasLoc, distance + 1);
 		}
 	}
 }
@@ -2808,12 +4755,8 @@ void AMainGameMode::SpawnFillInDepth(LabRoom* start, int depth)
 	if (!start)
 		return;
 
-	// If not spawned
-	if (!SpawnedRoomObjects.Contains(start))
-	{
-		SpawnRoom(start);
-		FillRoom(start);
-	}
+	// The start room is always complete
+	SpawnFillRoom(start);
 
 	if (depth <= 1)
 		return;
@@ -2821,7 +4764,7 @@ void AMainGameMode::SpawnFillInDepth(LabRoom* start, int depth)
 	for (LabPassage* passage : start->Passages)
 	{
 		// location of the floor
-		FVector initialPasLoc = Cast<AActor>(SpawnedPassageObjects[passage][0]->_getUObject())->GetActorLocation() + FVector(0, 0, 30);
+		FVector initialPasLoc = GetPassageLocation(passage) + FVector(0, 0, 30);
 		if ((passage->From == start && passage->GridDirection == EDirectionEnum::VE_Right) || (passage->To == start && passage->GridDirection == EDirectionEnum::VE_Left))
 			initialPasLoc += FVector(0, 30, 0);
 		else if ((passage->From == start && passage->GridDirection == EDirectionEnum::VE_Left) || (passage->To == start && passage->GridDirection == EDirectionEnum::VE_Right))
@@ -2832,9 +4775,149 @@ void AMainGameMode::SpawnFillInDepth(LabRoom* start, int depth)
 			initialPasLoc += FVector(-30, 0, 0);
 		
 		if (passage->From != start)
-			SpawnFillInDepth(passage->From, depth - 1, passage, initialPasLoc);
+			SpawnFillInDepth(passage->From, depth - 1, passage, initialPasLoc, 1);
 		if (passage->To != start)
-			SpawnFillInDepth(passage->To, depth - 1, passage, initialPasLoc);
+			SpawnFillInDepth(passage->To, depth - 1, passage, initialPasLoc, 1);
+	}
+}
+
+// Spawns and fills room right away if it's not spawned or filled yet
+void AMainGameMode::SpawnFillRoom(LabRoom * room)
+{
+	if (!room)
+		return;
+
+	DequeueRoomSpawn(room);
+
+	// If not spawned
+	if (!SpawnedRoomObjects.Contains(room))
+	{
+		SpawnRoom(room);
+		FillRoom(room);
+	}
+	// If spawned but not filled
+	else if (RoomsAwaitingContents.Contains(room))
+	{
+		RoomsAwaitingContents.Remove(room);
+		SpawnRoomContents(room);
+	}
+}
+// Adds room to the spawn queue or raises its priority if it's already there
+void AMainGameMode::EnqueueRoomSpawn(LabRoom * room, const bool contents, const bool visible, const int distance)
+{
+	if (!room)
+		return;
+
+	bSpawnQueueDirty = true;
+
+	for (FRoomSpawnRequest& request : SpawnQueue)
+	{
+		if (request.Room != room)
+			continue;
+
+		request.bContents = contents;
+		request.bVisible = request.bVisible || visible;
+		request.Distance = FMath::Min(request.Distance, distance);
+		return;
+	}
+
+	SpawnQueue.Add(FRoomSpawnRequest(room, contents, visible, distance));
+}
+// Removes room from the spawn queue
+void AMainGameMode::DequeueRoomSpawn(LabRoom * room)
+{
+	SpawnQueue.RemoveAll([room](const FRoomSpawnRequest& request) { return request.Room == room; });
+}
+// Spawns and fills rooms from the queue until the frame budget is spent
+void AMainGameMode::ProcessSpawnQueue()
+{
+	if (SpawnQueue.Num() == 0)
+	{
+		SET_DWORD_STAT(STAT_SpawnQueueDepth, 0);
+		SET_FLOAT_STAT(STAT_WorstSpawnFrameMs, WorstSpawnFrameMs);
+		return;
+	}
+
+	SCOPE_CYCLE_COUNTER(STAT_ProcessSpawnQueue);
+
+	// Rooms the character can see go first, then the closer ones
+	// Rooms that are already spawned get filled before new ones are started
+	if (bSpawnQueueDirty)
+	{
+		SpawnQueue.StableSort([](const FRoomSpawnRequest& a, const FRoomSpawnRequest& b)
+		{
+			if (a.bVisible != b.bVisible)
+				return a.bVisible;
+			if (a.Distance != b.Distance)
+				return a.Distance < b.Distance;
+			return a.bContents && !b.bContents;
+		});
+		bSpawnQueueDirty = false;
+	}
+
+	double startTime = FPlatformTime::Seconds();
+
+	// At least one step is made every frame so the queue can't stall
+	do
+	{
+		FRoomSpawnRequest request = SpawnQueue[0];
+		SpawnQueue.RemoveAt(0);
+
+		if (!request.bContents)
+		{
+			if (SpawnedRoomObjects.Contains(request.Room))
+				continue;
+
+			// Contents are decided right away but spawned only when the room can be seen
+			SpawnRoom(request.Room);
+			PlanRoomContents(request.Room);
+			RoomsAwaitingContents.AddUnique(request.Room);
+			if (request.bVisible)
+			{
+				request.bContents = true;
+				SpawnQueue.Insert(request, 0);
+			}
+		}
+		else if (RoomsAwaitingContents.Contains(request.Room))
+		{
+			RoomsAwaitingContents.Remove(request.Room);
+			SpawnRoomContents(request.Room);
+		}
+	} while (SpawnQueue.Num() > 0 && (FPlatformTime::Seconds() - startTime) * 1000.0 < SpawnQueueFrameBudget);
+
+	float frameMs = (FPlatformTime::Seconds() - startTime) * 1000.0;
+	WorstSpawnFrameMs = FMath::Max(WorstSpawnFrameMs, frameMs);
+
+	SET_DWORD_STAT(STAT_SpawnQueueDepth, SpawnQueue.Num());
+	SET_FLOAT_STAT(STAT_WorstSpawnFrameMs, WorstSpawnFrameMs);
+}
+// Sends rooms that became visible to the queue to get their contents
+void AMainGameMode::CheckRoomsAwaitingContents()
+{
+	if (RoomsAwaitingContents.Num() == 0)
+		return;
+
+	ACharacter* character = MainPlayerController ? MainPlayerController->GetCharacter() : nullptr;
+	if (!character)
+		return;
+
+	// Only a few rooms are checked every frame
+	for (int i = 0; i < MaxContentVisibilityChecksPerTick && i < RoomsAwaitingContents.Num(); ++i)
+	{
+		AwaitingContentsCheckIndex = (AwaitingContentsCheckIndex + 1) % RoomsAwaitingContents.Num();
+		LabRoom* room = RoomsAwaitingContents[AwaitingContentsCheckIndex];
+
+		for (LabPassage* passage : room->Passages)
+		{
+			if (!passage)
+				continue;
+
+			if (CanSee(character, GetPassageLocation(passage) + FVector(0, 0, 30)))
+			{
+				EnqueueRoomSpawn(room, true, true, 1);
+				break;
+			}
+		}
 	}
 }
 
@@ -2845,6 +4928,9 @@ void AMainGameMode::GenerateMap()
 	ExpandRoom(startRoom, 1);
 	SpawnRoom(startRoom);
 	FillRoom(startRoom, 1);
+	// Character stands on the start room right away, with its collision cooked
+	if (Geometry)
+		Geometry->BuildMergedNow();
 	MainPlayerController->GetCharacter()->SetActorLocation(FVector(25, 25, 90)); //, false, nullptr, ETeleportType::TeleportPhysics);
 	// GetCharacterRoom();
 }
@@ -2860,6 +4946,308 @@ void AMainGameMode::ShowHideDebug()
 {
 	bShowDebug = !bShowDebug;
 }
+// Compares serial and parallel illumination checks of all rooms and logs the time
+void AMainGameMode::BenchmarkIllumination(const int32 repeats)
+{
+	TArray<LabRoom*> allRooms;
+	AllocatedRoomSpace.GetKeys(allRooms);
+	int runs = FMath::Max(repeats, 1);
+
+	// Old way, one room after another with GetLightingAmount
+	double startTime = FPlatformTime::Seconds();
+	TBitArray<> oldLit(false, allRooms.Num());
+	for (int run = 0; run < runs; ++run)
+		for (int i = 0; i < allRooms.Num(); ++i)
+			oldLit[i] = IsRoomIlluminated(allRooms[i]);
+	double oldMs = (FPlatformTime::Seconds() - startTime) * 1000.0 / runs;
+
+	startTime = FPlatformTime::Seconds();
+	TBitArray<> serialLit;
+	for (int run = 0; run < runs; ++run)
+		serialLit = ClassifyRoomsIllumination(allRooms, false);
+	double serialMs = (FPlatformTime::Seconds() - startTime) * 1000.0 / runs;
+
+	startTime = FPlatformTime::Seconds();
+	TBitArray<> parallelLit;
+	for (int run = 0; run < runs; ++run)
+		parallelLit = ClassifyRoomsIllumination(allRooms, true);
+	double parallelMs = (FPlatformTime::Seconds() - startTime) * 1000.0 / runs;
+
+	int mismatches = 0;
+	for (int i = 0; i < allRooms.Num(); ++i)
+		if (oldLit[i] != parallelLit[i] || serialLit[i] != parallelLit[i])
+			++mismatches;
+
+	UE_LOG(LogDarkLab, Log, TEXT("Illumination benchmark: %d rooms, %d cores, %d worker threads"), allRooms.Num(), FPlatformMisc::NumberOfCoresIncludingHyperthreads(), FTaskGraphInterface::Get().GetNumWorkerThreads());
+	UE_LOG(LogDarkLab, Log, TEXT("> Old: %f ms, serial: %f ms, parallel: %f ms, speedup: %f, mismatches: %d"), oldMs, serialMs, parallelMs, parallelMs > 0.0 ? serialMs / parallelMs : 0.0, mismatches);
+}
+// Compares dense and adaptive illumination sampling of all rooms and logs the time and mismatches
+void AMainGameMode::BenchmarkAdaptiveSampling(const int32 repeats)
+{
+	TArray<LabRoom*> allRooms;
+	AllocatedRoomSpace.GetKeys(allRooms);
+	int runs = FMath::Max(repeats, 1);
+
+	if (CVarAdaptiveSampling.GetValueOnGameThread() == 0)
+		UE_LOG(LogDarkLab, Warning, TEXT("lab.Light.Adaptive is 0, both runs use the dense lattice"));
+
+	// Single thread so only the sampling is compared
+	double startTime = FPlatformTime::Seconds();
+	TBitArray<> denseLit;
+	for (int run = 0; run < runs; ++run)
+		denseLit = ClassifyRoomsIllumination(allRooms, false, false);
+	double denseMs = (FPlatformTime::Seconds() - startTime) * 1000.0 / runs;
+
+	startTime = FPlatformTime::Seconds();
+	TBitArray<> adaptiveLit;
+	for (int run = 0; run < runs; ++run)
+		adaptiveLit = ClassifyRoomsIllumination(allRooms, false, true);
+	double adaptiveMs = (FPlatformTime::Seconds() - startTime) * 1000.0 / runs;
+
+	// Missed means the dense lattice found light and adaptive sampling didn't, extra is the opposite
+	int lit = 0, missed = 0, extra = 0;
+	for (int i = 0; i < allRooms.Num(); ++i)
+	{
+		lit += denseLit[i] ? 1 : 0;
+		if (denseLit[i] && !adaptiveLit[i])
+			++missed;
+		else if (!denseLit[i] && adaptiveLit[i])
+			++extra;
+	}
+
+	UE_LOG(LogDarkLab, Log, TEXT("Adaptive sampling benchmark: %d rooms, %d lit, sample step: %d"), allRooms.Num(), lit, LabScalability::GetLightSampleStep());
+	UE_LOG(LogDarkLab, Log, TEXT("> Dense: %f ms, adaptive: %f ms, speedup: %f, missed: %d, extra: %d"), denseMs, adaptiveMs, adaptiveMs > 0.0 ? denseMs / adaptiveMs : 0.0, missed, extra);
+}
+
+// Spawns or destroys extra darkness hunters so that there are count of them, for comparing the cost of many hunters
+void AMainGameMode::SpawnDarknessHunters(const int32 count)
+{
+	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::SpawnDarknessHunters"));
+
+	if (DarknessManager)
+		DarknessManager->SetHunterCount(DarknessBP, FMath::Max(count, 0));
+}
+// Logs the number of floor and wall actors, instances and primitives drawing them
+void AMainGameMode::ReportGeometry()
+{
+	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::ReportGeometry"));
+
+	// Every primitive of an actor is drawn separately
+	int actors = 0, actorPrimitives = 0;
+	auto countPieces = [&actors, &actorPrimitives](const TArray<TScriptInterface<IDeactivatable>>& objects)
+	{
+		for (const TScriptInterface<IDeactivatable>& object : objects)
+		{
+			AActor* actor = Cast<ABasicFloor>(object.GetObject());
+			if (!actor)
+				actor = Cast<ABasicWall>(object.GetObject());
+			if (!actor)
+				continue;
+
+			TArray<UPrimitiveComponent*> primitives;
+			actor->GetComponents<UPrimitiveComponent>(primitives);
+			++actors;
+			actorPrimitives += primitives.Num();
+		}
+	};
+	for (const TPair<LabRoom*, TArray<TScriptInterface<IDeactivatable>>>& pair : SpawnedRoomObjects)
+		countPieces(pair.Value);
+	for (const TPair<LabPassage*, TArray<TScriptInterface<IDeactivatable>>>& pair : SpawnedPassageObjects)
+		countPieces(pair.Value);
+
+	int instances = Geometry ? Geometry->GetNumInstances() : 0;
+	int instancePrimitives = Geometry ? Geometry->GetNumPrimitives() : 0;
+	UE_LOG(LogDarkLab, Log, TEXT("Geometry: %d rooms spawned, mode: %d"), SpawnedRoomObjects.Num(), (int)GetGeometryMode());
+	UE_LOG(LogDarkLab, Log, TEXT("> Actors: %d, their primitives: %d"), actors, actorPrimitives);
+	UE_LOG(LogDarkLab, Log, TEXT("> Instances: %d, instanced and merged primitives: %d"), instances, instancePrimitives);
+}
+
+// Logs live and idle objects, high-water marks and hits of every pool
+void AMainGameMode::ReportPools()
+{
+	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::ReportPools"));
+
+	UE_LOG(LogDarkLab, Log, TEXT("Pools: %d classes"), PoolStats.Num());
+	for (const TPair<UClass*, FPoolStatsStruct>& pair : PoolStats)
+	{
+		const FPoolStatsStruct& stats = pair.Value;
+		int requests = stats.Hits + stats.Misses;
+		UE_LOG(LogDarkLab, Log, TEXT("> %s: live: %d, idle: %d, high-water: %d, hits: %d, misses: %d, hit ratio: %f, target: %d"), *GetNameSafe(pair.Key), stats.Live, GetCorrectPool(pair.Key).Num(), stats.HighWater, stats.Hits, stats.Misses, requests > 0 ? (float)stats.Hits / requests : 0.f, GetPoolTarget(stats));
+	}
+}
+
+// Despawns and respawns the objects of a spawned room with every pooling strategy and logs the time
+void AMainGameMode::BenchmarkPoolingStrategies(const int32 repeats)
+{
+	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::BenchmarkPoolingStrategies"));
+
+	// The room with the most objects, but not the one the character stands in
+	LabRoom* room = nullptr;
+	for (const TPair<LabRoom*, TArray<TScriptInterface<IDeactivatable>>>& pair : SpawnedRoomObjects)
+		if (pair.Key != ActualPlayerRoom && (!room || pair.Value.Num() > SpawnedRoomObjects[room].Num()))
+			room = pair.Key;
+	if (!room)
+	{
+		UE_LOG(LogDarkLab, Warning, TEXT("No spawned room to benchmark pooling strategies with"));
+		return;
+	}
+
+	TArray<TScriptInterface<IDeactivatable>> objects = SpawnedRoomObjects[room];
+	TArray<FTransform> transforms;
+	for (const TScriptInterface<IDeactivatable>& object : objects)
+	{
+		AActor* actor = Cast<AActor>(object.GetObject());
+		transforms.Add(actor ? actor->GetActorTransform() : FTransform::Identity);
+	}
+
+	UE_LOG(LogDarkLab, Log, TEXT("Pooling strategy benchmark: %d objects, geometry mode: %d"), objects.Num(), (int)GetGeometryMode());
+
+	// Benchmark runs are not gameplay, pool targets shouldn't learn from them
+	TMap<UClass*, FPoolStatsStruct> savedStats = PoolStats;
+
+	int runs = FMath::Max(repeats, 1);
+	for (int32 strategy = 0; strategy <= (int32)EPoolingStrategyEnum::VE_Park; ++strategy)
+	{
+		PoolingStrategyOverride = strategy;
+
+		double despawnMs = 0.0, respawnMs = 0.0;
+		int mismatches = 0;
+		for (int run = 0; run < runs; ++run)
+		{
+			double startTime = FPlatformTime::Seconds();
+			PoolObjects(objects);
+			despawnMs += (FPlatformTime::Seconds() - startTime) * 1000.0;
+
+			// Pools give back the last pooled objects first, so going backwards returns the same objects
+			startTime = FPlatformTime::Seconds();
+			for (int i = objects.Num() - 1; i >= 0; --i)
+			{
+				UObject* obj = TryGetPoolable(objects[i]->_getUObject()->GetClass());
+				if (obj != objects[i].GetObject())
+					++mismatches;
+				if (!obj)
+					continue;
+				AActor* actor = Cast<AActor>(obj);
+				if (actor)
+					actor->SetActorTransform(transforms[i]);
+				LabNativeEvents::SetActive(obj, true);
+			}
+			respawnMs += (FPlatformTime::Seconds() - startTime) * 1000.0;
+		}
+
+		UE_LOG(LogDarkLab, Log, TEXT("> Strategy %d: despawn: %f ms, respawn: %f ms, mismatches: %d"), strategy, despawnMs / runs, respawnMs / runs, mismatches);
+	}
+	PoolingStrategyOverride = -1;
+	PoolStats = savedStats;
+}
+
+// Generates the laboratory from the seed, makes random changes that dirty rooms and reshapes incrementally after each of them
+// Returns the number of rooms incremental reshapes classified differently from a full reshape, used by the automation test
+int AMainGameMode::VerifyIncrementalReshape(const int32 seed, const int32 steps)
+{
+	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::VerifyIncrementalReshape"));
+
+	// Generation only uses the global random stream
+	FMath::RandInit(seed);
+	FMath::SRandInit(seed);
+	ResetMap();
+
+	bVerifyReshape = true;
+	int mismatches = 0;
+	for (int step = 0; step < steps; ++step)
+	{
+		TArray<LabRoom*> spawnedRooms;
+		SpawnedRoomObjects.GetKeys(spawnedRooms);
+		if (spawnedRooms.Num() == 0)
+			break;
+
+		// Lamps change which rooms are lit and new rooms change adjacency, as if the character went there
+		LabRoom* room = spawnedRooms[FMath::RandRange(0, spawnedRooms.Num() - 1)];
+		SpawnFillRoom(room);
+		ActivateRoomLamps(room);
+		ExpandInDepth(room, CurrentExpandDepth);
+		SpawnFillInDepth(room, CurrentSpawnFillDepth);
+		while (SpawnQueue.Num() > 0)
+			ProcessSpawnQueue();
+
+		LastReshapeMismatches = 0;
+		ReshapeChangedDarkness();
+		mismatches += LastReshapeMismatches;
+	}
+	bVerifyReshape = false;
+
+	// The rest of the game shouldn't repeat itself
+	FMath::RandInit(FPlatformTime::Cycles());
+	FMath::SRandInit(FPlatformTime::Cycles());
+
+	UE_LOG(LogDarkLab, Log, TEXT("Incremental reshape with seed %d: %d mismatches in %d steps"), seed, mismatches, steps);
+	return mismatches;
+}
+// Takes, places, activates and pools count walls through interface events with and without reflection and logs the time
+void AMainGameMode::BenchmarkNativeEvents(const int32 count)
+{
+	UE_LOG(LogTemp, Warning, TEXT("MainGameMode::BenchmarkNativeEvents"));
+
+	// Wall actors are only used in actors mode, otherwise the benchmark would fill a pool nothing takes from
+	if (GetGeometryMode() != EGeometryModeEnum::VE_Actors)
+	{
+		UE_LOG(LogDarkLab, Warning, TEXT("Walls are not actors, set lab.Geometry.Mode to 0 to benchmark native events"));
+		return;
+	}
+
+	// Benchmark runs are not gameplay, pool targets shouldn't learn from them
+	TMap<UClass*, FPoolStatsStruct> savedStats = PoolStats;
+
+	int num = FMath::Max(count, 1);
+	TArray<TScriptInterface<IDeactivatable>> objects;
+	objects.Reserve(num);
+
+	// Walls go far from the laboratory, one cell apart
+	auto takeAndPlace = [this, num, &objects]()
+	{
+		for (int i = 0; i < num; ++i)
+		{
+			FIntVector location = FIntVector(-10000 - (i % 100) * 2, -10000 - (i / 100) * 2, 0);
+			UObject* obj = TryGetPoolable(BasicWallBP);
+			if (!obj)
+				obj = SpawnPlaced(BasicWallBP, location, EDirectionEnum::VE_Up, FIntVector(1, 1, 0));
+			if (!obj)
+				continue;
+
+			// The events PlaceObject uses for objects it can't place at once
+			LabNativeEvents::SetSizeXY(obj, 1, 1);
+			LabNativeEvents::Place(obj, location, EDirectionEnum::VE_Up);
+			LabNativeEvents::SetActive(obj, true);
+			objects.Add(obj);
+		}
+	};
+
+	// Spawning is measured once, both runs after it take the same walls from the pool
+	double startTime = FPlatformTime::Seconds();
+	takeAndPlace();
+	double spawnMs = (FPlatformTime::Seconds() - startTime) * 1000.0;
+	PoolObjects(objects);
+	objects.Reset();
+	UE_LOG(LogDarkLab, Log, TEXT("Native events benchmark: %d walls, first spawn and place: %f ms"), num, spawnMs);
+
+	for (int native = 0; native <= 1; ++native)
+	{
+		LabNativeEvents::SetEnabledOverride(native);
+
+		startTime = FPlatformTime::Seconds();
+		takeAndPlace();
+		double placeMs = (FPlatformTime::Seconds() - startTime) * 1000.0;
+
+		startTime = FPlatformTime::Seconds();
+		PoolObjects(objects);
+		double poolMs = (FPlatformTime::Seconds() - startTime) * 1000.0;
+		objects.Reset();
+
+		UE_LOG(LogDarkLab, Log, TEXT("> %s: take and place: %f ms, pool: %f ms"), native ? TEXT("Native") : TEXT("Reflection"), placeMs, poolMs);
+	}
+	LabNativeEvents::SetEnabledOverride(-1);
+	PoolStats = savedStats;
+}
 
 // Sets default values
 AMainGameMode::AMainGameMode()
@@ -2889,11 +5277,35 @@ AMainGameMode::AMainGameMode()
 	static ConstructorHelpers::FObjectFinder<UClass> exitVolumeBP(TEXT("Class'/Game/Blueprints/ExitVolumeBP.ExitVolumeBP_C'"));
 	if (exitVolumeBP.Succeeded())
 		ExitVolumeBP = exitVolumeBP.Object;
+	static ConstructorHelpers::FObjectFinder<UClass> darknessBP(TEXT("Class'/Game/Blueprints/DarknessBP.DarknessBP_C'"));
+	if (darknessBP.Succeeded())
+		DarknessBP = darknessBP.Object;
+
+	// Pools are found by class
+	RegisterPool(BasicFloorBP, BasicFloorPool);
+	RegisterPool(BasicWallBP, BasicWallPool);
+	RegisterPool(BasicDoorBP, BasicDoorPool);
+	RegisterPool(WallLampBP, WallLampPool);
+	RegisterPool(FlashlightBP, FlashlightPool);
+	RegisterPool(DoorcardBP, DoorcardPool);
+	RegisterPool(ExitVolumeBP, ExitVolumePool);
+
+	// Generation starts with default values
+	ApplyGovernorLevel();
 
 	// Set to call Tick() every frame
 	PrimaryActorTick.bCanEverTick = true;
 }
 
+// Called after the components are initialized, before the game starts
+void AMainGameMode::PostInitializeComponents()
+{
+	Super::PostInitializeComponents();
+
+	// Darkness placed in the level registers with the manager on its BeginPlay, so it has to exist before
+	DarknessManager = GetWorld()->SpawnActor<ADarknessManager>();
+}
+
 // Called when the game starts or when spawned
 void AMainGameMode::BeginPlay()
 {
@@ -2902,31 +5314,28 @@ void AMainGameMode::BeginPlay()
 	// TODO remove before shipping
 	// ShowHideDebug();
 
-	// We find darkness controller
+	// We find the character controller, darkness registers with the manager
 	UWorld* gameWorld = GetWorld();
-	for (TObjectIterator<ADarknessController> Itr; Itr; ++Itr)
-	{
-		// World Check
-		if (Itr->GetWorld() != gameWorld)
-			continue;
-
-		DarknessController = *Itr;
-		break; // We only need one (and there should be only one)
-	}
-
-	// Then we find the character controller
 	APlayerController* controller = gameWorld->GetFirstPlayerController();
 	MainPlayerController = Cast<AMainPlayerController>(controller);
 
+	// Floors and walls can be drawn as instances of the blueprints' meshes
+	Geometry = gameWorld->SpawnActor<ALabGeometry>();
+	if (Geometry && BasicFloorBP && BasicWallBP)
+		Geometry->Init(BasicFloorBP->GetDefaultObject<ABasicFloor>()->GetFloorMesh(), BasicWallBP->GetDefaultObject<ABasicWall>()->GetWallMesh());
+
+	// The level is still loading behind the loading screen, so objects spawned now don't cost anything during the game
+	PrewarmPools();
+
 	// Finally we generate map
 	GenerateMap(); 
 	
 	// Make world reshape every few seconds even if character doesn't change rooms
-	FTimerHandle handler;
-	((AActor*)this)->GetWorldTimerManager().SetTimer(handler, this, &AMainGameMode::CompleteReshapeAllDarknessAroundOnTick, ReshapeDarknessTick, true, ReshapeDarknessTick);
+	((AActor*)this)->GetWorldTimerManager().SetTimer(ReshapeTimerHandle, this, &AMainGameMode::CompleteReshapeAllDarknessAroundOnTick, CurrentReshapeDarknessTick, true, CurrentReshapeDarknessTick);
 
 	// TODO delete, used only for tests sometimes
-	/*((AActor*)this)->GetWorldTimerManager().SetTimer(handler, this, &AMainGameMode::ResetMap, 2, true, 2);*/
+	/*FTimerHandle handler;
+	((AActor*)this)->GetWorldTimerManager().SetTimer(handler, this, &AMainGameMode::ResetMap, 2, true, 2);*/
 }
 
 // Called every frame
@@ -2939,6 +5348,29 @@ void AMainGameMode::Tick(const float deltaTime)
 	// Updates PlayerRoom, calls OnEnterRoom
 	GetCharacterRoom();
 
+	// Prepares the room character is heading to
+	LookAhead();
+
+	// Continues reshaping darkness
+	ProcessReshapeJob();
+
+	// Scalability settings might have changed
+	if (AppliedScalabilityVersion != LabScalability::GetSettingsVersion())
+		ApplyGovernorLevel();
+
+	// Spawns some of the queued rooms
+	CheckRoomsAwaitingContents();
+	ProcessSpawnQueue();
+
+	// Destroys idle objects pools don't need anymore
+	TrimPools();
+
+	// Stops drawing rooms the player can't see
+	UpdateCulling();
+
+	// Shadows and drawing of lights that are left
+	UpdateLightBudget();
+
 	// Turns off some lamps from time to time
 	for (int i = RoomsWithLampsOn.Num() - 1; i >= 0; --i)
 	{
@@ -2951,23 +5383,42 @@ void AMainGameMode::Tick(const float deltaTime)
 	AMainCharacter* character = tempCharacter ? Cast<AMainCharacter>(tempCharacter) : nullptr;
 
 	// If player finds black card, we make darkness know
-	if (character && DarknessController && !DarknessController->bIsPersistent && character->HasDoorcardOfColor(FLinearColor::Black))
-		DarknessController->OnPlayerFindsBlackCard();
+	if (character && DarknessManager && character->HasDoorcardOfColor(FLinearColor::Black))
+		DarknessManager->OnPlayerFindsBlackCard();
 
 	// On screen debug
 	if (bShowDebug && GEngine)
 	{
 		// Pools debug
-		// GEngine->AddOnScreenDebugMessage(-1, 0.0f, FColor::Yellow, FString::Printf(TEXT("Pools: default: %d, floor: %d, wall: %d, door: %d, lamp: %d, flashlight: %d"), DefaultPool.Num(), BasicFloorPool.Num(), BasicWallPool.Num(), BasicDoorPool.Num(), WallLampPool.Num(), FlashlightPool.Num()), true);
+		// GEngine->AddOnScreenDebugMessage(-1, 0.0f, FColor::Yellow, FString::Printf(TEXT("Pools: default: %d, floor: %d, wall: %d, door: %d, lamp: %d, flashlight: %d"), DefaultPools.Num(), BasicFloorPool.Num(), BasicWallPool.Num(), BasicDoorPool.Num(), WallLampPool.Num(), FlashlightPool.Num()), true);
+
+		// Spawn queue debug
+		GEngine->AddOnScreenDebugMessage(-1, 0.0f, FColor::Yellow, FString::Printf(TEXT("Spawn queue: %d, awaiting contents: %d, worst frame: %f ms"), SpawnQueue.Num(), RoomsAwaitingContents.Num(), WorstSpawnFrameMs), false);
+
+		// Culling debug
+		GEngine->AddOnScreenDebugMessage(-1, 0.0f, FColor::Yellow, FString::Printf(TEXT("Culled rooms: %d, passages: %d, primitives: %d, lights: %d"), CulledRooms.Num(), CulledPassages.Num(), NumCulledPrimitives, NumCulledLights), false);
+
+		// Light budget debug
+		GEngine->AddOnScreenDebugMessage(-1, 0.0f, FColor::Yellow, FString::Printf(TEXT("Lights: %d, shadowed: %d, not drawn: %d"), LightBudget.GetNumRanked(), LightBudget.GetNumShadowed(), LightBudget.GetNumNotDrawn()), false);
+
+		// Reshape debug
+		GEngine->AddOnScreenDebugMessage(-1, 0.0f, FColor::Yellow, FString::Printf(TEXT("Reshape phase: %d, last took %d frames"), (int)ReshapeJob.Phase, LastReshapeFrames), false);
+
+		// Governor debug
+		GEngine->AddOnScreenDebugMessage(-1, 0.0f, FColor::Yellow, FString::Printf(TEXT("Governor level: %d, depths: %d/%d/%d, reshape every %f s, costs: %f/%f ms"), GovernorLevel, CurrentExpandDepth, CurrentSpawnFillDepth, CurrentReshapeDarknessDepth, CurrentReshapeDarknessTick, EnterRoomCostMs, ReshapeCostMs), false);
+
+		// Hunters debug
+		if (DarknessManager)
+			GEngine->AddOnScreenDebugMessage(-1, 0.0f, FColor::Yellow, FString::Printf(TEXT("Darkness hunters: %d"), DarknessManager->GetNumHunters()), false);
 
 		// Darkness debug
-		APawn* tempDarkness = DarknessController->GetPawn();
-		if (tempDarkness)
+		for (int i = 0; DarknessManager && i < DarknessManager->GetHunters().Num(); ++i)
 		{
-			ADarkness* darkness = Cast<ADarkness>(tempDarkness);
+			ADarkness* darkness = DarknessManager->GetHunters()[i];
+			ADarknessController* darknessController = Cast<ADarknessController>(darkness->GetController());
 
 			// Title
-			GEngine->AddOnScreenDebugMessage(-1, 0.0f, FColor::Yellow, TEXT("Darkness:"), false);
+			GEngine->AddOnScreenDebugMessage(-1, 0.0f, FColor::Yellow, FString::Printf(TEXT("Darkness %d:"), i), false);
 			
 			// Current location
 			int darkX, darkY;
@@ -2977,17 +5428,20 @@ void AMainGameMode::Tick(const float deltaTime)
 			
 			// Current state
 			FString state = "Unknown";
-			switch (DarknessController->State)
+			if (darknessController)
 			{
-			case EDarkStateEnum::VE_Passive:
-				state = "Passive";
-				break;
-			case EDarkStateEnum::VE_Hunting:
-				state = "Hunting";
-				break;
-			case EDarkStateEnum::VE_Retreating:
-				state = "Retreating";
-				break;
+				switch (darknessController->State)
+				{
+				case EDarkStateEnum::VE_Passive:
+					state = "Passive";
+					break;
+				case EDarkStateEnum::VE_Hunting:
+					state = "Hunting";
+					break;
+				case EDarkStateEnum::VE_Retreating:
+					state = "Retreating";
+					break;
+				}
 			}
 			GEngine->AddOnScreenDebugMessage(-1, 0.0f, FColor::Yellow, FString::Printf(TEXT("> State: %s"), *state), false);
 
@@ -3080,6 +5534,7 @@ void AMainGameMode::EndPlay(const EEndPlayReason::Type EndPlayReason)
 	AllocatedRoomSpace.GetKeys(allRooms);
 	for (int i = allRooms.Num() - 1; i >= 0; --i)
 		delete allRooms[i];
+	RoomGraph.Empty();
 }
 
 // TODO delete?
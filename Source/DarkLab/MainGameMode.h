@@ -5,6 +5,8 @@
 #include "CoreMinimal.h"
 #include "GameFramework/GameModeBase.h"
 #include "Placeable.h"
+#include "LabRoomGraph.h"
+#include "LabLightBudget.h"
 #include "MainGameMode.generated.h"
 
 class IDeactivatable;
@@ -16,8 +18,154 @@ class AFlashlight;
 class ALighter;
 class ADoorcard;
 class AExitVolume;
+class ADarkness;
 class LabRoom;
 class LabPassage;
+enum class EGeometryModeEnum : uint8;
+enum class EPoolingStrategyEnum : uint8;
+
+// Objects that can be put into a room when it's filled
+UENUM(BlueprintType)
+enum class ERoomContentEnum : uint8
+{
+	VE_Lamp 	UMETA(DisplayName = "Lamp"),
+	VE_Doorcard 	UMETA(DisplayName = "Doorcard"),
+	VE_Flashlight	UMETA(DisplayName = "Flashlight"),
+	VE_ExitVolume	UMETA(DisplayName = "Exit volume")
+};
+
+// An object that is planned for a room but may not be spawned yet
+struct FRoomContentStruct
+{
+	ERoomContentEnum Type;
+	// Grid location (not offsets)
+	int BotLeftX;
+	int BotLeftY;
+	EDirectionEnum Direction;
+	FLinearColor Color;
+	int Width;
+
+	FRoomContentStruct(const ERoomContentEnum type, const int botLeftX, const int botLeftY, const EDirectionEnum direction, const FLinearColor color = FLinearColor::White, const int width = 1) : Type(type), BotLeftX(botLeftX), BotLeftY(botLeftY), Direction(direction), Color(color), Width(width) {}
+};
+
+// Phases of darkness reshaping spread between frames
+UENUM(BlueprintType)
+enum class EReshapePhaseEnum : uint8
+{
+	VE_Idle 	UMETA(DisplayName = "Idle"),
+	VE_Classify 	UMETA(DisplayName = "Classify"),
+	VE_Pool 	UMETA(DisplayName = "Pool"),
+	VE_Fix 	UMETA(DisplayName = "Fix"),
+	VE_Expand 	UMETA(DisplayName = "Expand"),
+	VE_Spawn 	UMETA(DisplayName = "Spawn")
+};
+
+// Darkness reshaping that is spread between frames
+// Rooms pooled by anyone else are replaced with nullptr in the arrays
+struct FReshapeJobStruct
+{
+	EReshapePhaseEnum Phase = EReshapePhaseEnum::VE_Idle;
+	// If true, rooms around the player are expanded and spawned after reshaping
+	bool bComplete = false;
+	// Rooms to classify, then rooms to pool and rooms to fix
+	TArray<LabRoom*> ToCheck;
+	TArray<LabRoom*> ToPool;
+	TArray<LabRoom*> ToFix;
+	// Position in the array of the current phase
+	int Index = 0;
+	// Rooms that changed after they were classified
+	TSet<LabRoom*> Stale;
+	// Frame lights were last checked for changes on while pooling
+	uint64 LightsCheckFrame = 0;
+	// Frame the job was started on
+	uint64 StartFrame = 0;
+};
+
+// A light prepared for illumination checks off the game thread
+struct FLightSampleStruct
+{
+	FVector Location;
+	FVector Direction;
+	float Radius;
+	// Cosine of the cone angle for spot lights, -1 for point lights
+	float CosConeAngle;
+	// Light level at the light's location, from intensity and color
+	float Brightness;
+
+	FLightSampleStruct(const FVector location, const FVector direction, const float radius, const float cosConeAngle, const float brightness) : Location(location), Direction(direction), Radius(radius), CosConeAngle(cosConeAngle), Brightness(brightness) {}
+};
+
+// Outer edges of a room's walls and the passages through them
+struct FRoomWallsStruct
+{
+	FBox2D Bounds = FBox2D(ForceInit);
+	TArray<FBox2D> Openings;
+};
+
+// Points a room's interior is sampled at, the same the dense lattice has
+struct FSampleLatticeStruct
+{
+	// The first point and the distance to the next one along each axis
+	FVector2D Origin = FVector2D::ZeroVector;
+	FVector2D Step = FVector2D::ZeroVector;
+	// Number of points along each axis
+	FIntPoint Size = FIntPoint::ZeroValue;
+};
+
+// What a light does to one point of a lattice
+struct FLatticePointStruct
+{
+	// True if the point is in the light's radius and cone and if nothing blocks the light on its way
+	bool bInReach = false;
+	bool bLit = false;
+	// What blocks the light and the passages of the room its way goes through
+	const class UPrimitiveComponent* Blocker = nullptr;
+	uint32 Openings = 0;
+};
+
+// How a pool is used
+struct FPoolStatsStruct
+{
+	// Objects of the class that are in use and the most that were in use at once
+	int Live = 0;
+	int HighWater = 0;
+	// Requests served from the pool and requests that had to spawn a new object
+	int Hits = 0;
+	int Misses = 0;
+	// Idle objects that are never trimmed, the prewarmed amount
+	int Reserved = 0;
+};
+
+// State of a light that matters for room illumination
+struct FLightStateStruct
+{
+	FVector Location;
+	FVector Direction;
+	float Radius;
+	float Intensity;
+
+	FLightStateStruct() : Location(FVector::ZeroVector), Direction(FVector::ZeroVector), Radius(0.f), Intensity(0.f) {}
+	FLightStateStruct(const FVector location, const FVector direction, const float radius, const float intensity) : Location(location), Direction(direction), Radius(radius), Intensity(intensity) {}
+
+	bool Equals(const FLightStateStruct& other) const
+	{
+		return Location.Equals(other.Location, 1.f) && Direction.Equals(other.Direction, 0.01f) && FMath::IsNearlyEqual(Radius, other.Radius) && FMath::IsNearlyEqual(Intensity, other.Intensity);
+	}
+};
+
+// A room waiting in the spawn queue
+struct FRoomSpawnRequest
+{
+	LabRoom* Room;
+	// True if the room is already spawned and only needs to be filled
+	bool bContents;
+	// True if the passage leading to the room can be seen by the character
+	bool bVisible;
+	// Number of passages between the room and the player's room
+	int Distance;
+
+	FRoomSpawnRequest(LabRoom* room, const bool contents, const bool visible, const int distance) : Room(room), bContents(contents), bVisible(visible), Distance(distance) {}
+};
 
 // Controls the game
 UCLASS(Blueprintable)
@@ -42,6 +190,10 @@ public:
 	float GetLightingAmount(FVector& lightLoc, const TArray<FVector> locations, const bool returnFirstPositive = false);
 	float GetLightingAmount(FVector& lightLoc, const AActor* actor, const FVector location, const bool sixPoints = false, const float sixPointsRadius = 30.0f, const bool fourMore = false, const bool returnFirstPositive = false);
 	float GetLightingAmount(FVector& lightLoc, const AActor* actor, const TArray<FVector> locations, const bool returnFirstPositive = false);
+	// Same, but with lights gathered beforehand, only reads the world so it can be called from worker threads
+	static float GetLightingAmount(UWorld* world, FVector& lightLoc, const AActor* actor, const TArray<FVector>& locations, const TArray<FLightSampleStruct>& lights);
+	// Returns the point and the points around it that GetLightingAmount samples
+	static void GetSamplePointsAround(const FVector location, TArray<FVector>& locations, const bool sixPoints = false, const float sixPointsRadius = 30.0f, const bool fourMore = false);
 	// Returns true if one actor/location can see other actor/location
 	// Its not about visibility to human eye, doesn't take light into account
 	bool CanSee(const AActor* actor1, const AActor* actor2);
@@ -54,7 +206,53 @@ public:
 	bool CanSee(const FVector location1, const AActor* actor2, const FVector location2);
 	bool CanSee(const AActor* actor1, const FVector location1, const AActor* actor2, const FVector location2);
 
+	// Returns visible lights, gathered at most once per frame
+	const TArray<FLightSampleStruct>& GetFrameLightSamples();
+	// Returns true if location is inside the light's radius and cone
+	static bool IsInLightReach(const FVector& location, const FLightSampleStruct& light);
+
+	// Returns the graph of all created rooms
+	LabRoomGraph& GetRoomGraph();
+
+	// Returns the manager of all darkness hunters
+	class ADarknessManager* GetDarknessManager();
+
 protected:
+	// Return points used to check illumination
+	void GetPassageSamplePoints(LabPassage* passage, TArray<FVector>& locations, bool oneSide = false, bool innerSide = true);
+	void GetRoomSamplePoints(LabRoom* room, TArray<FVector>& locations, const bool interior = true);
+	// Returns false if the room has no interior to sample
+	bool GetRoomSampleLattice(LabRoom* room, FSampleLatticeStruct& lattice);
+	// Returns the outer edges of the room's walls and the passages through them
+	void GetRoomWalls(LabRoom* room, FRoomWallsStruct& walls);
+
+	// Returns visible lights that can make something illuminated
+	TArray<FLightSampleStruct> GatherLightSamples();
+	// Returns true if any of the locations is lit by any of the lights
+	// Only reads the world so it can be called from worker threads
+	static bool IsAnyLocationLit(UWorld* world, const TArray<FVector>& locations, const TArray<FLightSampleStruct>& lights);
+	// Returns true if nothing blocks the light on its way to location
+	static bool IsLightVisible(UWorld* world, const FVector& location, const FLightSampleStruct& light);
+	// Returns what blocks the light on its way to location, nullptr if nothing does
+	static const class UPrimitiveComponent* GetLightBlocker(UWorld* world, const FVector& location, const FLightSampleStruct& light);
+	// Returns true if any point of the lattice is lit by any of the lights
+	// Starts from the point closest to each light and refines with a quadtree only where corners of a quad disagree
+	// Every point is traced once, the budget is the number of traces per light before the rest of the lattice is traced densely
+	static bool IsLatticeLit(UWorld* world, const FSampleLatticeStruct& lattice, const float z, const FRoomWallsStruct& walls, const TArray<FLightSampleStruct>& lights, const int32 budget);
+	// Returns false if the budget ran out before the quad could be told lit or not, outOfBudget is set then
+	static bool IsQuadLit(UWorld* world, const FSampleLatticeStruct& lattice, const FIntPoint min, const FIntPoint max, const float z, const FRoomWallsStruct& walls, const FLightSampleStruct& light, TMap<FIntPoint, FLatticePointStruct>& samples, int32& budget, bool& outOfBudget);
+	// Traces the light to the point of the lattice unless it was already traced, returns false if the budget ran out
+	static bool SampleLatticePoint(UWorld* world, const FSampleLatticeStruct& lattice, const FIntPoint index, const float z, const FRoomWallsStruct& walls, const FLightSampleStruct& light, TMap<FIntPoint, FLatticePointStruct>& samples, int32& budget, FLatticePointStruct& sample);
+	// Returns the bounds of the lattice's points from min to max
+	static FBox2D GetLatticeBounds(const FSampleLatticeStruct& lattice, const FIntPoint min, const FIntPoint max);
+	// Returns true if the room's walls hide the whole quad from the light, which is only certain when no passage is in the way
+	static bool IsQuadEnclosed(const FBox2D& quad, const FRoomWallsStruct& walls, const FLightSampleStruct& light);
+	// Checks illumination of all rooms at once, on worker threads if parallel is true
+	// Returns bit per room, true if room is illuminated
+	TBitArray<> ClassifyRoomsIllumination(const TArray<LabRoom*>& rooms, const bool parallel = true, const bool adaptive = true);
+	// Classifies rooms and rooms behind their exits so IsRoomIlluminated doesn't have to
+	void PrecomputeIllumination(const TArray<LabRoom*>& rooms);
+
 	// Returns the light level for a passage
 	float GetPassageLightingAmount(LabPassage* passage, bool oneSide = false, bool innerSide = true, const bool returnFirstPositive = false);
 	// Returns true if passage is illuminated
@@ -70,6 +268,8 @@ public:
 	// Changes grid location into world location
 	static void GridToWorld(const int gridX, const int gridY, float& worldX, float& worldY);
 	static void GridToWorld(const int botLeftX, const int botLeftY, const int sizeX, const int sizeY, float& worldX, float& worldY);
+	// Returns world location of the passage's center on the floor level
+	static FVector GetPassageLocation(LabPassage* passage);
 
 protected:
 	// Places an object on the map
@@ -84,6 +284,9 @@ protected:
 	void PlaceObject(TScriptInterface<IPlaceable> object, const FIntVector botLeftLoc, const int sizeX, const int sizeY, const int sizeZ);
 	void PlaceObject(TScriptInterface<IPlaceable> object, const FIntVector botLeftLoc, const EDirectionEnum direction, const int sizeX, const int sizeY = 1);
 	void PlaceObject(TScriptInterface<IPlaceable> object, const FIntVector botLeftLoc, const EDirectionEnum direction, const int sizeX, const int sizeY, const int sizeZ);
+	// Spawns an object of the class already placed, its transform is only set once
+	// Size X or Y below 1 keeps the default width and length, size Z below 1 keeps the default height
+	class ABasicPlaceableObject* SpawnPlaced(UClass* cl, const FIntVector botLeftLoc, const EDirectionEnum direction, const FIntVector size = FIntVector(0, 0, 0));
 
 	// Returns by reference character's location on the grid
 	UFUNCTION(BlueprintCallable, Category = "Generic functions")
@@ -93,6 +296,11 @@ protected:
 	// Called when character enters new room
 	void OnEnterRoom(); // LabRoom* lastRoom, LabRoom* newRoom);
 
+	// Returns the passage of the player's room the character is most likely to go through next
+	LabPassage* PredictNextPassage();
+	// Expands and spawns the room behind predicted passage, one step per frame
+	void LookAhead();
+
 public:
 	// Called when character loses all of his lives
 	void OnLoss();
@@ -105,17 +313,46 @@ public:
 	void OnPickUp(TScriptInterface<class IPickupable> object);
 	// Called when exit door is opened to
 	void OnExitOpened(class ABasicDoor* door);
+	// Called when a door starts opening or closing since it changes what light can reach
+	void OnDoorMoved(class ABasicDoor* door);
 
 protected:
 	// Gets the pool for the object/class
 	TArray<TScriptInterface<IDeactivatable>>& GetCorrectPool(TScriptInterface<IDeactivatable> object);
 	TArray<TScriptInterface<IDeactivatable>>& GetCorrectPool(UClass* cl);
+	// Makes GetCorrectPool return the pool for the class
+	void RegisterPool(UClass* cl, TArray<TScriptInterface<IDeactivatable>>& pool);
+	// Spawns inactive objects into the pools until each has as many as its lab.Pool.Prewarm variable says
+	void PrewarmPools();
+	// Returns the number of idle objects the pool keeps when trimming
+	int GetPoolTarget(const FPoolStatsStruct& stats) const;
+	// Updates pool stats and destroys some idle objects above the target if nothing else is going on
+	void TrimPools();
 
 	// Deactivates and adds to a pool
 	UFUNCTION(BlueprintCallable, Category = "Pools")
 	void PoolObject(TScriptInterface<IDeactivatable> object);
 	UFUNCTION(BlueprintCallable, Category = "Pools")
 	void PoolObjects(TArray<TScriptInterface<IDeactivatable>>& objects);
+	// Deactivates the object the way lab.Pool.Strategy says
+	void DeactivatePooled(TScriptInterface<IDeactivatable> object, const EPoolingStrategyEnum strategy);
+	// Returns a place far from the laboratory for the next parked object
+	FVector GetParkingLocation();
+
+	// Returns true if the player could see through the passage
+	bool IsPassageOpen(LabPassage* passage);
+	// Finds spawned rooms that can be seen from the player's room through open passages, up to lab.Culling.PortalDepth passages away
+	void GetPortalVisibleRooms(TSet<LabRoom*>& visible);
+	// Returns false if there is no camera to take the frustum from
+	bool GetViewFrustum(struct FConvexVolume& frustum);
+	// Returns true if any part of the room is inside the frustum
+	bool IsRoomInFrustum(LabRoom* room, const struct FConvexVolume& frustum);
+	// Culls or unculls objects, instanced and merged geometry of the owner, adds what stays culled to the counts
+	void CullObjects(const void* owner, TArray<TScriptInterface<IDeactivatable>>& objects, const bool culled, int& primitives, int& lights);
+	// Stops drawing and ticking rooms the player can't see and resumes the ones that became visible
+	void UpdateCulling();
+	// Keeps the most important lights casting shadows and stops drawing the least important ones
+	void UpdateLightBudget();
 
 	// Pool full parts of the lab
 	void PoolRoom(LabRoom* room);
@@ -137,6 +374,33 @@ protected:
 	// Pools all dark rooms on the map and fixes every room that needs fixing
 	UFUNCTION(BlueprintCallable, Category = "Reshape")
 	void ReshapeAllDarkness();
+	// Same as ReshapeAllDarkness but only looks at rooms that changed since the last reshape and their neighbours
+	UFUNCTION(BlueprintCallable, Category = "Reshape")
+	void ReshapeChangedDarkness();
+	// Calls ReshapeChangedDarkness or ReshapeAllDarkness depending on settings
+	void ReshapeDarknessOnMap();
+	// Returns true if reshaping should pool the room
+	bool ShouldPoolDarkRoom(LabRoom* room);
+	// Returns dirty rooms with their neighbours and clears dirty rooms
+	TArray<LabRoom*> TakeDirtyRooms();
+	// Returns the number of rooms a full reshape would classify differently, logs each of them
+	int CountReshapeMismatches(const TArray<LabRoom*>& toPool);
+
+	// Starts reshaping that is spread between frames, unless one is already running
+	void StartReshapeJob(const bool allRooms, const bool complete);
+	// Continues reshaping until the time slice is spent
+	void ProcessReshapeJob();
+	// Makes a single step of reshaping, returns false if there is nothing to do
+	bool StepReshapeJob();
+	// Removes pooled room from reshaping
+	void ForgetRoomInReshapeJob(LabRoom* room);
+
+	// Room's lighting, visibility or passages changed, so it has to be checked during next reshape
+	void MarkRoomDirty(LabRoom* room, const bool withNeighbours = false);
+	// Marks all rooms that a light with such radius could reach
+	void MarkRoomsDirty(const FVector center, const float radius);
+	// Marks rooms around lights that changed since last call and around moving doors
+	void MarkRoomsAroundChangedLights();
 	// Reshapes all darkness and also expands spawns and fills around player's room
 	UFUNCTION(BlueprintCallable, Category = "Reshape")
 	void CompleteReshapeAllDarknessAround();
@@ -144,11 +408,22 @@ protected:
 	UFUNCTION(BlueprintCallable, Category = "Reshape")
 	void CompleteReshapeAllDarknessAroundOnTick();
 
+	// Adds cost of a call that started at startTime to the running average
+	void RecordCost(float& averageMs, const double startTime);
+	// Changes governor level if recent costs are too far from the target
+	void UpdateGovernor();
+	// Sets generation depths and reshape frequency for current governor level
+	void ApplyGovernorLevel();
+
 	// Tries to find a poolable object in a specified array
 	UFUNCTION(BlueprintCallable, Category = "Pools")
 	UObject* TryGetPoolable(UClass* cl);
 
 public:
+	// Returns how floors and walls are spawned, their Spawn functions return nullptr if not as actors
+	EGeometryModeEnum GetGeometryMode() const;
+	// Returns how pooled objects are deactivated
+	EPoolingStrategyEnum GetPoolingStrategy() const;
 	// Spawn specific objects
 	ABasicFloor* SpawnBasicFloor(const int botLeftX, const int botLeftY, const int sizeX, const int sizeY, LabRoom* room = nullptr);
 	ABasicFloor* SpawnBasicFloor(const int botLeftX, const int botLeftY, const int sizeX, const int sizeY, LabPassage* passage);
@@ -164,6 +439,8 @@ protected:
 	// Spawn full parts of the lab
 	void SpawnRoom(LabRoom* room);
 	void SpawnPassage(LabPassage* passage, LabRoom* room = nullptr);
+	// Returns true if the room is the player's room or one passage away from it
+	bool IsNextToPlayer(LabRoom* room) const;
 	// Despawns room so it can be respawned later
 	void DespawnRoom(LabRoom* room);
 
@@ -256,12 +533,27 @@ protected:
 	// Same but near wall and returns direction from wall (width is along wall)
 	bool CreateRandomInsideSpaceOfWidthNearWall(LabRoom* room, int& xOffset, int& yOffset, const int width, EDirectionEnum& direction, const bool canBeTaken = false);
 
+	// Decides which objects the room will have and allocates space for them without spawning anything
+	// Should always be called on a room that is already spawned
+	void PlanRoomContents(LabRoom* room, int minNumOfLampsOverride = 0);
+	// Allocates space for objects planned when the room was spawned before, drops the ones new passages took the space of
+	// Returns false if the plan doesn't fit the room anymore
+	bool AllocatePlannedContents(LabRoom* room, TArray<FRoomContentStruct>& planned);
+	// Returns the key of the room's plan
+	static TPair<FIntPoint, FIntPoint> GetRoomPlanKey(LabRoom* room);
+	// Returns true if the room only leads to the exit
+	bool IsExitRoom(LabRoom* room) const;
+	// Spawns objects planned for the room and returns them
+	TArray<AActor*> SpawnRoomContents(LabRoom* room);
 	// Fills room with random objects, spawns and returns them
 	// Should always be called on a room that is already spawned
 	TArray<AActor*> FillRoom(LabRoom* room, int minNumOfLampsOverride = 0);
 
 	// Activates all lamps in a single room
 	void ActivateRoomLamps(LabRoom* room, bool forceAll = false);
+	// Lets only lamps of the most recently lit rooms cast shadows, the rest stay on without them
+	// The light budget turns the shadows on and off, this only tells it which lamps are denied them
+	void UpdateLampShadows();
 
 	// Returns true if unexpanded rooms are reachable from here
 	bool CanReachUnexpanded(LabRoom* start, TArray<LabRoom*>& checkedRooms);
@@ -273,9 +565,21 @@ protected:
 	void ExpandInDepth(LabRoom* start, int depth);
 	// Spawns and fills room if it's not spawned yet
 	// Repeats with all adjasent rooms recursively
-	void SpawnFillInDepth(LabRoom* start, int depth, LabPassage* fromPassage, FVector initialPasLoc);
+	// Rooms close to the start are spawned right away, the rest are sent to the spawn queue
+	void SpawnFillInDepth(LabRoom* start, int depth, LabPassage* fromPassage, FVector initialPasLoc, int distance = 1);
 	void SpawnFillInDepth(LabRoom* start, int depth);
 
+	// Spawns and fills room right away if it's not spawned or filled yet
+	void SpawnFillRoom(LabRoom* room);
+	// Adds room to the spawn queue or raises its priority if it's already there
+	void EnqueueRoomSpawn(LabRoom* room, const bool contents, const bool visible, const int distance);
+	// Removes room from the spawn queue
+	void DequeueRoomSpawn(LabRoom* room);
+	// Spawns and fills rooms from the queue until the frame budget is spent
+	void ProcessSpawnQueue();
+	// Sends rooms that became visible to the queue to get their contents
+	void CheckRoomsAwaitingContents();
+
 public:
 	// Generates map
 	UFUNCTION(BlueprintCallable, Category = "Map generation")
@@ -286,10 +590,39 @@ public:
 	// Shows/hides debug
 	UFUNCTION(BlueprintCallable, Category = "Debug")
 	void ShowHideDebug();
+	// Compares serial and parallel illumination checks of all rooms and logs the time
+	UFUNCTION(Exec, Category = "Debug")
+	void BenchmarkIllumination(const int32 repeats = 10);
+	// Compares dense and adaptive illumination sampling of all rooms and logs the time and mismatches
+	UFUNCTION(Exec, Category = "Debug")
+	void BenchmarkAdaptiveSampling(const int32 repeats = 10);
+	// Spawns or destroys extra darkness hunters so that there are count of them, for comparing the cost of many hunters
+	UFUNCTION(Exec, Category = "Debug")
+	void SpawnDarknessHunters(const int32 count = 10);
+	// Logs the number of floor and wall actors, instances and primitives drawing them
+	UFUNCTION(Exec, Category = "Debug")
+	void ReportGeometry();
+	// Logs live and idle objects, high-water marks and hits of every pool
+	UFUNCTION(Exec, Category = "Debug")
+	void ReportPools();
+	// Despawns and respawns the objects of a spawned room with every pooling strategy and logs the time
+	UFUNCTION(Exec, Category = "Debug")
+	void BenchmarkPoolingStrategies(const int32 repeats = 10);
+	// Takes, places, activates and pools count walls through interface events with and without reflection and logs the time
+	UFUNCTION(Exec, Category = "Debug")
+	void BenchmarkNativeEvents(const int32 count = 10000);
+
+	// Generates the laboratory from the seed, makes random changes that dirty rooms and reshapes incrementally after each of them
+	// Returns the number of rooms incremental reshapes classified differently from a full reshape, used by the automation test
+	int VerifyIncrementalReshape(const int32 seed, const int32 steps);
 
 protected:
 	// For debug
 	bool bShowDebug = false;
+	// True if incremental reshapes are compared with full ones regardless of lab.Reshape.Verify
+	bool bVerifyReshape = false;
+	// Mismatches found by the last compared reshape
+	int LastReshapeMismatches = 0;
 
 	// Rooms that are created but are not spawned yet and can still be changed
 	TArray<LabRoom*> AllocatedRooms;
@@ -297,6 +630,11 @@ protected:
 	// Room-specific space taken by various objects (not world locations but offsets)
 	TMap<LabRoom*, TArray<FRectSpaceStruct>> AllocatedRoomSpace;
 
+	// All created rooms as a graph, used for spatial queries and paths
+	LabRoomGraph RoomGraph;
+	// Decides which lights cast shadows and which are drawn
+	LabLightBudget LightBudget;
+
 	// Rooms that have already been expanded
 	TArray<LabRoom*> ExpandedRooms;
 
@@ -308,6 +646,68 @@ protected:
 	// Rooms that have their lamps turned on
 	TArray<LabRoom*> RoomsWithLampsOn;
 
+	// Rooms that have to be checked during next incremental reshape
+	TSet<LabRoom*> DirtyRooms;
+	// Lights as they were during last reshape
+	TMap<const class UPointLightComponent*, FLightStateStruct> LastLightStates;
+	// Doors that are opening or closing
+	UPROPERTY()
+	TArray<ABasicDoor*> MovingDoors;
+
+	// Generation values currently used, changed by the governor
+	int CurrentExpandDepth = ExpandDepth;
+	int CurrentSpawnFillDepth = SpawnFillDepth;
+	int CurrentReshapeDarknessDepth = ReshapeDarknessDepth;
+	float CurrentReshapeDarknessTick = 0.f;
+	float CurrentReshapeDarknessOnEnterProbability = ReshapeDarknessOnEnterProbability;
+	float CurrentReshapeDarknessOnTickProbability = ReshapeDarknessOnTickProbability;
+	// 0 means default values, higher levels do less work, lower do more
+	int GovernorLevel = 0;
+	// Average costs of recent calls (ms)
+	float EnterRoomCostMs = 0.f;
+	float ReshapeCostMs = 0.f;
+	// Game time of the last level change
+	float LastGovernorChangeTime = 0.f;
+	// Used to change the reshape interval
+	FTimerHandle ReshapeTimerHandle;
+	// Scalability settings used by current values
+	uint32 AppliedScalabilityVersion = 0;
+
+	// Illumination of rooms found by PrecomputeIllumination, emptied before the map changes
+	TMap<LabRoom*, bool> PrecomputedIllumination;
+	// Lights returned by GetFrameLightSamples and the frame they were gathered on
+	TArray<FLightSampleStruct> FrameLightSamples;
+	uint64 FrameLightSamplesFrame = 0;
+
+	// Reshaping in progress
+	FReshapeJobStruct ReshapeJob;
+	// True while the reshape job pools a room itself
+	bool bReshapeJobIsPooling = false;
+	// The number of frames last reshape job took
+	int LastReshapeFrames = 0;
+
+	// Passage the character is expected to go through and how much of the look ahead is done for it
+	LabPassage* PredictedPassage = nullptr;
+	int LookAheadStage = 0;
+
+	// Rooms waiting to be spawned or filled, visible and closer ones go first
+	TArray<FRoomSpawnRequest> SpawnQueue;
+	// True if SpawnQueue needs sorting
+	bool bSpawnQueueDirty = false;
+	// Rooms that are spawned but not filled yet
+	// Contents are spawned when room is close to the player or can be seen through a passage
+	TArray<LabRoom*> RoomsAwaitingContents;
+	// Where CheckRoomsAwaitingContents continues next frame
+	int AwaitingContentsCheckIndex = 0;
+	// Objects decided for rooms by their location and size, kept while the room exists so it gets the same objects when spawned again
+	TMap<TPair<FIntPoint, FIntPoint>, TArray<FRoomContentStruct>> RoomContentPlans;
+	// Spawned rooms whose planned objects have space allocated but are not spawned yet
+	TSet<LabRoom*> PlannedRooms;
+	// Rooms whose lamps are turned on as soon as their objects are spawned
+	TSet<LabRoom*> LampsOnAfterContents;
+	// The most time the spawn queue took in a single frame (ms)
+	float WorstSpawnFrameMs = 0.f;
+
 	// The room the character is in
 	LabRoom* PlayerRoom; // Has an offset helping to avoid getting stuck in passage
 	LabRoom* ActualPlayerRoom; 
@@ -317,8 +717,27 @@ protected:
 	TMap<LabPassage*, TArray<TScriptInterface<IDeactivatable>>> SpawnedPassageObjects;
 
 	// Pools
-	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Pools")
-	TArray<TScriptInterface<IDeactivatable>> DefaultPool;
+	// Pools by class, so finding the pool and an object in it doesn't depend on the number of classes and pooled objects
+	TMap<UClass*, TArray<TScriptInterface<IDeactivatable>>*> PoolRegistry;
+	// Pools of classes that have no pool of their own, created when first needed
+	// Pooled actors stay referenced by the level, so these don't have to be visible to garbage collection
+	TMap<UClass*, TArray<TScriptInterface<IDeactivatable>>> DefaultPools;
+	// Usage of pools by class
+	TMap<UClass*, FPoolStatsStruct> PoolStats;
+	// Parked objects are spread so they don't overlap each other
+	int NextParkingSlot = 0;
+	// Used instead of lab.Pool.Strategy if not negative, so benchmarks don't depend on who set the variable
+	int PoolingStrategyOverride = -1;
+
+	// Culling
+	// Rooms seen from the player's room through open passages this frame
+	TSet<LabRoom*> PortalVisibleRooms;
+	// Rooms and passages that were culled last frame
+	TSet<LabRoom*> CulledRooms;
+	TSet<LabPassage*> CulledPassages;
+	// What culling stopped drawing last frame
+	int NumCulledPrimitives = 0;
+	int NumCulledLights = 0;
 	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Pools")
 	TArray<TScriptInterface<IDeactivatable>> BasicFloorPool;
 	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Pools")
@@ -338,6 +757,11 @@ protected:
 	static const int ExpandDepth = 5;
 	static const int SpawnFillDepth = 4;
 	static const int ReshapeDarknessDepth = 3;
+	static const int MinExpandDepth = 3;
+	static const int MinSpawnFillDepth = 2;
+	static const int MinReshapeDarknessDepth = 2;
+	static const int MinGovernorLevel = -1;
+	static const int MaxGovernorLevel = 3;
 	static const int MaxFixDepth = 4;
 	static const int MinRoomSize = 5;
 	static const int MaxRoomSize = 35;
@@ -364,6 +788,9 @@ protected:
 	static const int MinExpandTriesBeforeReshaping = 2;
 	static const int MaxExpandTriesBeforeDisablingLights = 7;
 	static const int MaxExpandTriesOverall = 10;
+	static const int MaxContentVisibilityChecksPerTick = 3;
+	static const int ReshapeClassifyBatch = 8;
+	static const int ParkingGridSize = 64;
 	// Probabilities
 	static const float ReshapeDarknessOnEnterProbability;
 	static const float ReshapeDarknessOnTickProbability;
@@ -385,10 +812,25 @@ protected:
 	static const float BlackProbability;
 	// Other constants
 	static const float ReshapeDarknessTick;
+	static const float SpawnQueueFrameBudget; // ms
+	static const float PredictionRadius;
+	static const float PredictionMinAlignment;
+	static const float PredictionVelocityWeight;
+	static const float GovernorSmoothing;
+	static const float GovernorCooldown;
+	static const float GovernorRaiseFraction;
+	static const float GovernorTickScalePerLevel;
+	static const float GovernorProbabilityScalePerLevel;
+	static const float ParkingDepth;
+	static const float ParkingSpacing;
+	static const float CullingRoomHeight;
 
 	// Pointers to existing controllers and HUD
 	UPROPERTY()
-	class ADarknessController* DarknessController;
+	class ADarknessManager* DarknessManager;
+	// Instanced floors and walls
+	UPROPERTY()
+	class ALabGeometry* Geometry;
 	UPROPERTY()
 	class AMainPlayerController* MainPlayerController;
 public:
@@ -408,12 +850,15 @@ private:
 	TSubclassOf<ALighter> LighterBP;
 	TSubclassOf<ADoorcard> DoorcardBP;
 	TSubclassOf<AExitVolume> ExitVolumeBP;
+	TSubclassOf<ADarkness> DarknessBP;
 
 public:
 	// Sets default values
 	AMainGameMode();
 
 protected:
+	// Called after the components are initialized, before the game starts
+	virtual void PostInitializeComponents() override;
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
 
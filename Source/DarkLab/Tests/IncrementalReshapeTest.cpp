@@ -0,0 +1,53 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "Misc/AutomationTest.h"
+#include "Tests/AutomationCommon.h"
+#include "Engine/Engine.h"
+#include "Engine/World.h"
+#include "MainGameMode.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+// Seeds laboratories are generated from, seeds of reported mismatches should be added here
+static const int32 ReshapeTestSeeds[] = { 1, 7, 42, 1337, 2018, 31337 };
+// Changes made to each laboratory, each is followed by an incremental reshape
+static const int32 ReshapeTestSteps = 20;
+
+// Returns the world the game runs in
+static UWorld* GetGameWorld()
+{
+	for (const FWorldContext& context : GEngine->GetWorldContexts())
+		if ((context.WorldType == EWorldType::Game || context.WorldType == EWorldType::PIE) && context.World())
+			return context.World();
+	return nullptr;
+}
+
+// Compares incremental reshapes with full ones on every seed
+DEFINE_LATENT_AUTOMATION_COMMAND_ONE_PARAMETER(FVerifyIncrementalReshapeCommand, FAutomationTestBase*, Test);
+bool FVerifyIncrementalReshapeCommand::Update()
+{
+	UWorld* world = GetGameWorld();
+	AMainGameMode* gameMode = world ? Cast<AMainGameMode>(world->GetAuthGameMode()) : nullptr;
+	if (!gameMode)
+	{
+		Test->AddError(TEXT("The test map has no MainGameMode"));
+		return true;
+	}
+
+	for (int32 seed : ReshapeTestSeeds)
+		Test->TestEqual(FString::Printf(TEXT("Rooms classified differently from a full reshape with seed %d"), seed), gameMode->VerifyIncrementalReshape(seed, ReshapeTestSteps), 0);
+
+	return true;
+}
+
+// Incremental reshape has to pool the same rooms a full reshape would
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FIncrementalReshapeTest, "DarkLab.Reshape.IncrementalMatchesFull", EAutomationTestFlags::ClientContext | EAutomationTestFlags::ProductFilter);
+bool FIncrementalReshapeTest::RunTest(const FString& Parameters)
+{
+	AutomationOpenMap(TEXT("/Game/Maps/TestMap"));
+	ADD_LATENT_AUTOMATION_COMMAND(FEngineWaitLatentCommand(1.f));
+	ADD_LATENT_AUTOMATION_COMMAND(FVerifyIncrementalReshapeCommand(this));
+	return true;
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include "Components/ArrowComponent.h"
 #include "Components/StaticMeshComponent.h"
 #include "Components/PointLightComponent.h"
+#include "LabMaterialCache.h"
 #include "MainCharacter.h"
 
 // Called when the object is activated
@@ -54,7 +55,8 @@ bool AWallLamp::IsOn()
 // Update's the color of the lamp mesh
 void AWallLamp::UpdateMeshColor(FLinearColor color)
 {
-	Lamp->SetVectorParameterValueOnMaterials("Color", FVector(color.R, color.G, color.B));
+	// Lamps and doorcards of the same color share material instances
+	LabMaterialCache::SetMeshColor(Lamp, color);
 }
 
 // Sets default values
@@ -61,8 +61,7 @@ protected:
 protected:
 	// The color of light
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Lamp")
-	FLinearColor Color = FLinearColor::White;
-	
+	FLinearColor Color = FLinearColor::White;	
 public:
 	// Sets default values
 	AWallLamp();